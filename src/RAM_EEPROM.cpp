@@ -21,88 +21,1881 @@
 
 #include "Arduino.h"
 #include "RAM_EEPROM.h"
+#include "RAM_EEPROM_CRC.h"
+#include "RAM_EEPROM_Backend.h"
+#if RAM_EEPROM_POSIX
+#include <pthread.h>
+#endif
 
-RAMEEPROMClass::RAMEEPROMClass(void *nothing, size_t size, uint8_t blockSize)
+/**
+ * Uses buffer as the E2
+ *
+ * The buffer is used in place.  It isn't copied, cleared or freed, so it
+ * has to outlive this object.  If buffer is NULL the E2 is allocated in RAM
+ * and erased to 0xFF instead.
+ *
+ * @param buffer    The memory to use, or NULL
+ * @param size      The size of the E2 in bytes
+ * @param blockSize The size of a block in bytes
+ */
+RAMEEPROMClass::RAMEEPROMClass(void *buffer, size_t size, uint8_t blockSize)
 : _size(size), _blockSize(blockSize)
 {
+    if (buffer == NULL) {
+        _alloc();
+    } else {
+        _data = (uint8_t *)buffer;
+    }
     _init();
 }
 
 RAMEEPROMClass::RAMEEPROMClass(unsigned int address, size_t size, uint8_t blockSize)
  : _size(size), _blockSize(blockSize)
 {
+    _alloc();
     _init();
 }
-void RAMEEPROMClass::_init(void) 
+
+/**
+ * Uses storage that the caller owns for both the E2 and the dirty bitmap
+ *
+ * This is for RAMEEPROM<>, which keeps both inside the object.  Neither
+ * is cleared here, except for the bitmap and write counts.
+ *
+ * @param data      The E2 buffer, size bytes long
+ * @param dirty     The dirty bitmap, one bit per page rounded up to a word
+ * @param size      The size of the E2 in bytes
+ * @param blockSize The size of a block in bytes
+ * @param wear      The page write counts, if RAM_EEPROM_STATS is set
+ */
+RAMEEPROMClass::RAMEEPROMClass(uint8_t *data, uint32_t *dirty, size_t size, uint8_t blockSize, uint16_t *wear)
+ : _size(size), _blockSize(blockSize)
+{
+    _data = data;
+    _dirty = dirty;
+#if RAM_EEPROM_STATS
+    _wear = wear;
+#endif
+    _init();
+}
+
+/**
+ * Sets up a sparse E2.  See RAMEEPROMSparseClass.
+ */
+RAMEEPROMClass::RAMEEPROMClass(const _Sparse &sparse, size_t size, uint8_t blockSize)
+ : _size(size), _blockSize(blockSize)
+{
+    _init();
+    _mapPages = (_size + RAM_EEPROM_SPARSE_PAGE_SIZE - 1) / RAM_EEPROM_SPARSE_PAGE_SIZE;
+    _pages = new uint8_t*[_mapPages]();
+    _pageGen = new uint32_t[_mapPages]();
+}
+
+#if RAM_EEPROM_POSIX
+/**
+ * Keeps the E2 in the image file filename
+ *
+ * The file is mapped, so nothing is read at startup and pages are faulted
+ * in as they are touched.  If the file is shorter than size it is
+ * extended, and the new part is erased to 0xFF.  commit() writes the dirty
+ * pages back to the file and end() unmaps it.  If the file can't be mapped
+ * every access fails the same way it does when the size is 0.  This is
+ * the same as using a RAMEEPROMMmapBackend.
+ *
+ * @param filename The image file.  It is created if it doesn't exist.
+ * @param size      The size of the E2 in bytes
+ * @param blockSize The size of a block in bytes
+ */
+RAMEEPROMClass::RAMEEPROMClass(const char *filename, size_t size, uint8_t blockSize)
+ : _size(size), _blockSize(blockSize)
+{
+    RAMEEPROMBackend *file = new RAMEEPROMMmapBackend(filename);
+    _init();
+    _attach(file);
+    if (_backend == NULL) {
+        delete file;
+    } else {
+        _freeBackend = true;
+    }
+}
+#endif
+
+/**
+ * Keeps the E2 in backend
+ *
+ * The backend is opened here and closed by end().  It isn't deleted, so
+ * it has to outlive this object.  If it can't be opened every access fails
+ * the same way it does when the size is 0.
+ *
+ * @param backend   Where to keep the bytes
+ * @param size      The size of the E2 in bytes
+ * @param blockSize The size of a block in bytes
+ */
+RAMEEPROMClass::RAMEEPROMClass(RAMEEPROMBackend &backend, size_t size, uint8_t blockSize)
+ : _size(size), _blockSize(blockSize)
+{
+    _init();
+    _attach(&backend);
+}
+
+/**
+ * Opens backend and uses its buffer directly if it has one
+ */
+void RAMEEPROMClass::_attach(RAMEEPROMBackend *backend)
+{
+    if ((_size == 0) || !backend->open(_size)) {
+        return;
+    }
+    _backend = backend;
+    _data = backend->data();
+}
+
+/**
+ * Allocates the E2 in RAM, erased to 0xFF
+ */
+void RAMEEPROMClass::_alloc(void)
 {
     _data = new uint8_t[_size];
+    _free = true;
+    memset(_data, 0xFF, _size);
+}
+
+void RAMEEPROMClass::_init(void) 
+{
     if (_blockSize > _size) {
         _blockSize = _size;
     }
-    memset(_data, 0xFF, _size);
+    _pageSize = (_blockSize > 0) ? _blockSize : RAM_EEPROM_PAGE_SIZE;
+    _pageCount = (_size + _pageSize - 1) / _pageSize;
+    if (_dirty == NULL) {
+        _dirty = new uint32_t[(_pageCount + 31) / 32];
+        _freeDirty = true;
+    }
+    memset(_dirty, 0, ((_pageCount + 31) / 32) * sizeof(uint32_t));
+#if RAM_EEPROM_STATS
+    if (_wear == NULL) {
+        _wear = new uint16_t[_pageCount];
+        _freeWear = true;
+    }
+    memset(_wear, 0, _pageCount * sizeof(uint16_t));
+#endif
 }
 
 RAMEEPROMClass::~RAMEEPROMClass()
 {
     end();
-    delete [] _data;
+    for (RAMEEPROMSnapshot *snap = _snapshots; snap != NULL; snap = snap->_next) {
+        snap->_owner = NULL;
+    }
+    _snapshots = NULL;
+    delete [] _snapPageGen;
+    _snapPageGen = NULL;
+    delete _flash;
+    _flash = NULL;
+    delete [] _crcs;
+    _crcs = NULL;
+    if (_free) {
+        delete [] _data;
+    }
     _data = NULL;
+    if (_freeDirty) {
+        delete [] _dirty;
+    }
+    _dirty = NULL;
+#if RAM_EEPROM_POSIX
+    concurrent(false);
+#endif
+#if RAM_EEPROM_STATS
+    if (_freeWear) {
+        delete [] _wear;
+    }
+    _wear = NULL;
+#endif
+    if (_pages != NULL) {
+        for (size_t index = 0; index < _mapPages; index++) {
+            delete [] _pages[index];
+        }
+        delete [] _pages;
+        delete [] _pageGen;
+        _pages = NULL;
+        _pageGen = NULL;
+    }
 }
 
 void RAMEEPROMClass::begin(void) {
 }
 
+/**
+ * Commits and closes the backend, if there is one.  The E2 can't be used
+ * after this, and flash mode is turned off.
+ */
 void RAMEEPROMClass::end(void) {
+    if (_backend != NULL) {
+        commit();
+#if RAM_EEPROM_POSIX
+        async(false);
+        // The locks could be in the backend
+        concurrent(false);
+#endif
+        _backend->close();
+        if (_freeBackend) {
+            delete _backend;
+        }
+        _backend = NULL;
+        _freeBackend = false;
+        _data = NULL;
+        delete _flash;
+        _flash = NULL;
+    }
 }
 
 
+/**
+ * Erases the whole E2 to 0xFF
+ *
+ * In sparse mode this only bumps the generation, which makes every page
+ * stale, so the cost doesn't depend on how much has been written.
+ */
+void RAMEEPROMClass::erase(void) {
+    if (!_ready()) {
+        return;
+    }
+#if RAM_EEPROM_POSIX
+    if (_locks != NULL) {
+        _set(0, 0xFF, _size);
+        return;
+    }
+#endif
+    if (_snapshots != NULL) {
+        _preserve(0, _size);
+    }
+    if (_flash != NULL) {
+        _flash->stats.erases += sectors();
+        _flash->stats.time += sectors() * _flash->config.eraseTime;
+    }
+    if (_data != NULL) {
+        memset(_data, 0xFF, _size);
+    } else if (_pages == NULL) {
+        _backendSet(0, 0xFF, _size);
+    } else if (++_generation == 0) {
+        // The generation wrapped, so old pages could look current again
+        for (size_t index = 0; index < _mapPages; index++) {
+            _sparseDrop(index);
+        }
+    }
+    _markDirty(0, _size);
+}
+
 uint8_t RAMEEPROMClass::read(int address) {
+    uint8_t value;
+    RAM_EEPROM_COUNT(reads, 1);
     if (!_goodAddress(address)) {
         return 0;
     }
-    return _data[address];
+    _load(address, &value, 1);
+    return value;
 }
 
 void RAMEEPROMClass::write(int address, uint8_t value) {
+    RAM_EEPROM_COUNT(writes, 1);
     if (!_goodAddress(address)) {
         return;
     }
-    _data[address] = value;
+    _store(address, &value, 1);
 }
 
-bool RAMEEPROMClass::readBlock(int block, uint8_t *buffer) {
-    int address = _blockAddress(block);
-    if (!_goodAddress(address, _blockSize) || !buffer || (_blockSize == 0)) {
+/**
+ * Writes value to address, but only if it is different from what is there
+ *
+ * This keeps unchanged bytes from being marked dirty.
+ */
+void RAMEEPROMClass::update(int address, uint8_t value) {
+    RAM_EEPROM_COUNT(writes, 1);
+    if (!_goodAddress(address)) {
+        return;
+    }
+#if RAM_EEPROM_POSIX
+    if (_locks != NULL) {
+        // The compare and the store have to happen under the same lock
+        uint64_t mask = _stripeMask(address, 1);
+        _writeLock(mask);
+        if (!_rawSame(address, &value, 1)) {
+            _rawStore(address, &value, 1);
+        }
+        _writeUnlock(mask);
+        return;
+    }
+#endif
+    if (!_rawSame(address, &value, 1)) {
+        _rawStore(address, &value, 1);
+    }
+}
+
+/**
+ * Reads length bytes starting at address into buffer
+ *
+ * The range is checked once, then copied in a single memcpy.
+ *
+ * @return true on success, false if the range is not inside the E2
+ */
+bool RAMEEPROMClass::readBytes(int address, void *buffer, size_t length) {
+    RAM_EEPROM_COUNT(reads, 1);
+    if (!_goodRange(address, length) || !buffer) {
         return false;
     }
-    memcpy(buffer, &_data[address], _blockSize);
+    _load(address, buffer, length);
     return true;
 }
 
-bool RAMEEPROMClass::writeBlock(int block, uint8_t *buffer) {
-    int address = _blockAddress(block);
-    uint8_t index;
-    if (!_goodAddress(address, _blockSize) || !buffer || (_blockSize == 0)) {
+/**
+ * Writes length bytes from buffer starting at address
+ *
+ * @return true on success, false if the range is not inside the E2
+ */
+bool RAMEEPROMClass::writeBytes(int address, const void *buffer, size_t length) {
+    RAM_EEPROM_COUNT(writes, 1);
+    if (!_goodRange(address, length) || !buffer) {
         return false;
     }
-    for (index = 0; index < _blockSize; index++) {
-        _data[address + index] = buffer[index];
+    _store(address, buffer, length);
+    return true;
+}
+
+/**
+ * Sets length bytes starting at address to value
+ *
+ * @return true on success, false if the range is not inside the E2
+ */
+bool RAMEEPROMClass::fillBytes(int address, uint8_t value, size_t length) {
+    RAM_EEPROM_COUNT(writes, 1);
+    if (!_goodRange(address, length)) {
+        return false;
     }
+    _set(address, value, length);
     return true;
 }
 
+/**
+ * Compares length bytes starting at address with buffer
+ *
+ * @return true if they match, false if they differ or the range is bad
+ */
+bool RAMEEPROMClass::compareBytes(int address, const void *buffer, size_t length) {
+    RAM_EEPROM_COUNT(reads, 1);
+    if (!_goodRange(address, length) || !buffer) {
+        return false;
+    }
+    return _same(address, buffer, length);
+}
+
+/**
+ * Does the work of fetchAdd(), exchange() and compareExchange()
+ *
+ * The cell is changed with one atomic instruction.  When there are no
+ * snapshots or checksums that is all, so concurrent writers never wait on
+ * a stripe.  Otherwise the stripe is held so the snapshot copy or the CRC
+ * goes with the change.
+ *
+ * @param op      _atomicAdd, _atomicExchange or _atomicCompare
+ * @param address The cell
+ * @param size    1, 2, 4 or 8
+ * @param value   What to add, store, or store if the cell holds old
+ * @param old     Gets what the cell held.  For a compare it comes in
+ *                holding the expected value.
+ *
+ * @return true if the cell was good, even if the compare didn't match
+ */
+bool RAMEEPROMClass::_atomic(uint8_t op, int address, size_t size, uint64_t value, uint64_t &old) {
+    uint8_t *cell;
+    bool wrote;
+    RAM_EEPROM_COUNT(atomics, 1);
+    if (!_goodRange(address, size) || (_flash != NULL) || ((_data == NULL) && (_pages == NULL))) {
+        return false;
+    }
+    // Before a sparse page is made for it
+    if ((size_t)address % size != 0) {
+        RAM_EEPROM_COUNT(rejected, 1);
+        return false;
+    }
+    if (_data != NULL) {
+        cell = &_data[address];
+    } else {
+        cell = _sparsePage(address / RAM_EEPROM_SPARSE_PAGE_SIZE, true) + (address % RAM_EEPROM_SPARSE_PAGE_SIZE);
+    }
+    if ((uintptr_t)cell % size != 0) {
+        RAM_EEPROM_COUNT(rejected, 1);
+        return false;
+    }
+    RAM_EEPROM_COUNT(bytesRead, size);
+    if (((op == _atomicAdd) && (value == 0)) || ((_snapshots == NULL) && (_crcs == NULL))) {
+        wrote = _atomicSized(cell, size, op, value, old);
+        if (wrote) {
+            _markDirty(address, size);
+        }
+    } else {
+#if RAM_EEPROM_POSIX
+        uint64_t mask = (_locks != NULL) ? _stripeMask(address, size) : 0;
+        _writeLock(mask);
+#endif
+        if (_snapshots != NULL) {
+            _preserve(address, size);
+        }
+        wrote = _atomicSized(cell, size, op, value, old);
+        if (wrote) {
+            _markDirty(address, size);
+        }
+#if RAM_EEPROM_POSIX
+        _writeUnlock(mask);
+#endif
+    }
+    if (wrote) {
+        RAM_EEPROM_COUNT(bytesWritten, size);
+    }
+    return true;
+}
+
+/**
+ * Picks the _atomicCell() for size
+ */
+bool RAMEEPROMClass::_atomicSized(uint8_t *cell, size_t size, uint8_t op, uint64_t value, uint64_t &old) {
+    switch (size) {
+    case 1:
+        return _atomicCell<uint8_t>(cell, op, value, old);
+    case 2:
+        return _atomicCell<uint16_t>(cell, op, value, old);
+    case 4:
+        return _atomicCell<uint32_t>(cell, op, value, old);
+    default:
+        return _atomicCell<uint64_t>(cell, op, value, old);
+    }
+}
+
+/**
+ * Does op on the T at cell
+ *
+ * @return true if the cell was written
+ */
+template<typename T>
+bool RAMEEPROMClass::_atomicCell(uint8_t *cell, uint8_t op, uint64_t value, uint64_t &old) {
+    T *target = (T *)cell;
+    T expected = (T)old;
+    if (op == _atomicExchange) {
+        old = __atomic_exchange_n(target, (T)value, __ATOMIC_SEQ_CST);
+        return true;
+    }
+    if (op == _atomicCompare) {
+        bool swapped = __atomic_compare_exchange_n(target, &expected, (T)value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        old = expected;
+        return swapped;
+    }
+    if (value == 0) {
+        old = __atomic_load_n(target, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    old = __atomic_fetch_add(target, (T)value, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+bool RAMEEPROMClass::readBlock(int block, uint8_t *buffer) {
+    return readBlocks(block, 1, buffer);
+}
+
+bool RAMEEPROMClass::writeBlock(int block, uint8_t *buffer) {
+    return writeBlocks(block, 1, buffer);
+}
+
 bool RAMEEPROMClass::copyBlock(int dest, int src) {
-    int address = _blockAddress(src);
-    if (!_goodAddress(address, _blockSize)) {
+    return moveBlocks(dest, src, 1);
+}
+
+/**
+ * Reads count blocks, starting at block first, into buffer
+ *
+ * @return true on success, false if the blocks are not all in the E2
+ */
+bool RAMEEPROMClass::readBlocks(int first, int count, uint8_t *buffer) {
+    RAM_EEPROM_COUNT(blockReads, 1);
+    if (!_goodBlocks(first, count) || !buffer) {
         return false;
     }
-    return writeBlock(dest, &_data[address]);
+    if (_verifyReads && (_crcs != NULL)) {
+        return _verifiedLoad(_blockAddress(first), buffer, count * _blockSize);
+    }
+    _load(_blockAddress(first), buffer, count * _blockSize);
+    return true;
 }
 
-bool RAMEEPROMClass::commit(void) {
+/**
+ * Writes count blocks from buffer, starting at block first
+ *
+ * @return true on success, false if the blocks are not all in the E2
+ */
+bool RAMEEPROMClass::writeBlocks(int first, int count, const uint8_t *buffer) {
+    RAM_EEPROM_COUNT(blockWrites, 1);
+    if (!_goodBlocks(first, count) || !buffer) {
+        return false;
+    }
+    _store(_blockAddress(first), buffer, count * _blockSize);
+    return true;
+}
+
+/**
+ * Copies count blocks starting at src to count blocks starting at dest
+ *
+ * The source and destination are allowed to overlap.
+ *
+ * @return true on success, false if the blocks are not all in the E2
+ */
+bool RAMEEPROMClass::moveBlocks(int dest, int src, int count) {
+    RAM_EEPROM_COUNT(blockCopies, 1);
+    if (!_goodBlocks(dest, count) || !_goodBlocks(src, count)) {
+        return false;
+    }
+    _move(_blockAddress(dest), _blockAddress(src), count * _blockSize);
+    return true;
+}
+
+/**
+ * Sets every byte of count blocks, starting at block first, to value
+ *
+ * @return true on success, false if the blocks are not all in the E2
+ */
+bool RAMEEPROMClass::fillBlocks(int first, int count, uint8_t value) {
+    RAM_EEPROM_COUNT(blockWrites, 1);
+    if (!_goodBlocks(first, count)) {
+        return false;
+    }
+    _set(_blockAddress(first), value, count * _blockSize);
+    return true;
+}
+
+/**
+ * Erases count blocks, starting at block first, to 0xFF
+ *
+ * @return true on success, false if the blocks are not all in the E2
+ */
+bool RAMEEPROMClass::eraseBlocks(int first, int count) {
+    return fillBlocks(first, count, 0xFF);
+}
+
+#if RAM_EEPROM_STATS
+/**
+ * Takes a snapshot of the operation counts
+ *
+ * Each counter is read atomically, so this can be called while other
+ * threads are using the E2.  The counters aren't read all at the same
+ * instant, though.
+ */
+void RAMEEPROMClass::stats(RAMEEPROMStats &stats) {
+    stats.reads = __atomic_load_n(&_stats.reads, __ATOMIC_RELAXED);
+    stats.writes = __atomic_load_n(&_stats.writes, __ATOMIC_RELAXED);
+    stats.gets = __atomic_load_n(&_stats.gets, __ATOMIC_RELAXED);
+    stats.puts = __atomic_load_n(&_stats.puts, __ATOMIC_RELAXED);
+    stats.blockReads = __atomic_load_n(&_stats.blockReads, __ATOMIC_RELAXED);
+    stats.blockWrites = __atomic_load_n(&_stats.blockWrites, __ATOMIC_RELAXED);
+    stats.blockCopies = __atomic_load_n(&_stats.blockCopies, __ATOMIC_RELAXED);
+    stats.commits = __atomic_load_n(&_stats.commits, __ATOMIC_RELAXED);
+    stats.atomics = __atomic_load_n(&_stats.atomics, __ATOMIC_RELAXED);
+    stats.rejected = __atomic_load_n(&_stats.rejected, __ATOMIC_RELAXED);
+    stats.crcErrors = __atomic_load_n(&_stats.crcErrors, __ATOMIC_RELAXED);
+    stats.bytesRead = __atomic_load_n(&_stats.bytesRead, __ATOMIC_RELAXED);
+    stats.bytesWritten = __atomic_load_n(&_stats.bytesWritten, __ATOMIC_RELAXED);
+}
+
+/**
+ * Zeros the operation counts and the page write counts
+ */
+void RAMEEPROMClass::clearStats(void) {
+    _stats = RAMEEPROMStats();
+    memset(_wear, 0, _pageCount * sizeof(uint16_t));
+}
+
+/**
+ * Returns how many times page has been written
+ *
+ * Pages are pageSize() bytes, so with a block size they are blocks.  The
+ * count sticks at 65535.
+ */
+uint16_t RAMEEPROMClass::pageWrites(size_t page) {
+    if (page >= _pageCount) {
+        return 0;
+    }
+    return __atomic_load_n(&_wear[page], __ATOMIC_RELAXED);
+}
+#endif
+
+#if RAM_EEPROM_POSIX
+/**
+ * Spins politely while waiting on another thread
+ */
+static inline void _pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Turns concurrent mode on or off
+ *
+ * In concurrent mode the E2 is covered by RAM_EEPROM_STRIPES seqlocks,
+ * one per page (see pageSize()) modulo the number of stripes.  Writers
+ * (write(), put(), writeBlock(), copyBlock() and the rest) hold the
+ * stripes they touch.  Readers (read(), get(), readBlock() and the rest)
+ * never take a lock.  They copy the data and retry if a writer touched
+ * one of their stripes meanwhile, so multi-byte values are never torn.
+ *
+ * This has to be set up before other threads start using the E2.  It
+ * can't be used with RAMEEPROMSparseClass, whose page table changes on
+ * writes, or in flash mode.  commit() and the dirty tracking calls should be made while the
+ * writers are quiet.
+ *
+ * If the backend has shared() storage, like RAMEEPROMShmBackend, the
+ * stripes are kept there, so E2s in other processes that map the same
+ * object and turn on concurrent mode lock against this one.  changes()
+ * counts the writes of all of them.  The dirty bits, CRCs and snapshots
+ * are still this E2's own, and only see its own writes.  The first E2 to
+ * turn it on records its page size and RAM_EEPROM_STRIPES there, and an
+ * E2 that would stripe the E2 differently is refused.
+ *
+ * @param enable true to turn it on, false to turn it off
+ *
+ * @return true on success, false if the E2 can't do it
+ */
+bool RAMEEPROMClass::concurrent(bool enable) {
+    if (!enable) {
+        if (_freeShared) {
+            delete _shared;
+        }
+        _shared = NULL;
+        _freeShared = false;
+        _locks = NULL;
+        return true;
+    }
+    if ((_data == NULL) || (_flash != NULL)) {
+        return false;
+    }
+    if (_shared == NULL) {
+        uint8_t *shared = (_backend != NULL) ? _backend->shared() : NULL;
+        uint64_t geometry = ((uint64_t)_pageSize << 8) | RAM_EEPROM_STRIPES;
+        uint64_t found = 0;
+        if (shared != NULL) {
+            _Shared *other = (_Shared *)shared;
+            if (!__atomic_compare_exchange_n(&other->geometry, &found, geometry, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+                && (found != geometry)) {
+                return false;
+            }
+            _shared = other;
+        } else {
+            _shared = new _Shared();
+            _shared->geometry = geometry;
+            _freeShared = true;
+        }
+        _locks = _shared->stripes;
+    }
+    return true;
+}
+
+/**
+ * Returns a bit for every stripe under [address, address + length)
+ */
+uint64_t RAMEEPROMClass::_stripeMask(size_t address, size_t length) {
+    const uint64_t all = (RAM_EEPROM_STRIPES == 64) ? ~(uint64_t)0 : ((uint64_t)1 << RAM_EEPROM_STRIPES) - 1;
+    if (length == 0) {
+        return 0;
+    }
+    size_t first = address / _pageSize;
+    size_t count = (address + length - 1) / _pageSize - first + 1;
+    if (count >= RAM_EEPROM_STRIPES) {
+        return all;
+    }
+    uint64_t bits = ((uint64_t)1 << count) - 1;
+    size_t shift = first % RAM_EEPROM_STRIPES;
+    if (shift != 0) {
+        bits = (bits << shift) | (bits >> (RAM_EEPROM_STRIPES - shift));
+    }
+    return bits & all;
+}
+
+/**
+ * Waits for the stripes in mask to be free of writers and saves their
+ * sequence numbers in seq.
+ */
+void RAMEEPROMClass::_readBegin(uint64_t mask, uint32_t *seq) {
+    while (mask != 0) {
+        int stripe = __builtin_ctzll(mask);
+        uint32_t value;
+        mask &= mask - 1;
+        while ((value = __atomic_load_n(&_locks[stripe].seq, __ATOMIC_ACQUIRE)) & 1) {
+            _pause();
+        }
+        seq[stripe] = value;
+    }
+}
+
+/**
+ * Checks if a writer got into any of the stripes in mask since
+ * _readBegin().  If so the read has to be done again.
+ */
+bool RAMEEPROMClass::_readRetry(uint64_t mask, const uint32_t *seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    while (mask != 0) {
+        int stripe = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        if (__atomic_load_n(&_locks[stripe].seq, __ATOMIC_RELAXED) != seq[stripe]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Takes the stripes in mask for writing.  They are always taken lowest
+ * first, so two writers can't deadlock.
+ */
+void RAMEEPROMClass::_writeLock(uint64_t mask) {
+    while (mask != 0) {
+        uint32_t *seq = &_locks[__builtin_ctzll(mask)].seq;
+        mask &= mask - 1;
+        for (;;) {
+            uint32_t value = __atomic_load_n(seq, __ATOMIC_RELAXED);
+            if (((value & 1) == 0)
+                && __atomic_compare_exchange_n(seq, &value, value + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+            _pause();
+        }
+    }
+    // Readers have to see the odd sequence before any of the new data
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Releases the stripes in mask
+ */
+void RAMEEPROMClass::_writeUnlock(uint64_t mask) {
+    while (mask != 0) {
+        int stripe = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        __atomic_fetch_add(&_locks[stripe].seq, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void RAMEEPROMClass::_lockedLoad(size_t address, void *buffer, size_t length) {
+    uint32_t seq[RAM_EEPROM_STRIPES];
+    uint64_t mask = _stripeMask(address, length);
+    do {
+        _readBegin(mask, seq);
+        _rawLoad(address, buffer, length);
+    } while (_readRetry(mask, seq));
+}
+
+bool RAMEEPROMClass::_lockedSame(size_t address, const void *buffer, size_t length) {
+    uint32_t seq[RAM_EEPROM_STRIPES];
+    uint64_t mask = _stripeMask(address, length);
+    bool same;
+    do {
+        _readBegin(mask, seq);
+        same = _rawSame(address, buffer, length);
+    } while (_readRetry(mask, seq));
+    return same;
+}
+
+/**
+ * _markDirtyPages() for concurrent mode, where writers in other stripes
+ * can be setting bits in the same words.
+ */
+void RAMEEPROMClass::_markDirtyAtomic(size_t first, size_t last) {
+    while (first <= last) {
+        size_t word = first >> 5;
+        size_t end = ((word << 5) + 31 < last) ? (word << 5) + 31 : last;
+        uint32_t bits = (~(uint32_t)0 << (first & 31)) & (~(uint32_t)0 >> (31 - (end & 31)));
+        // Most of the time the bits are already set, so don't bounce the line
+        if ((__atomic_load_n(&_dirty[word], __ATOMIC_RELAXED) & bits) != bits) {
+            __atomic_fetch_or(&_dirty[word], bits, __ATOMIC_RELAXED);
+        }
+        first = end + 1;
+    }
+}
+#endif
+
+/**
+ * Takes a snapshot of the E2
+ *
+ * Nothing is copied here.  Pages are copied into the snapshot as they are
+ * written from now on.  See RAMEEPROMSnapshot.
+ *
+ * @return The snapshot, which the caller has to delete, or NULL if there
+ *         is no storage behind the E2
+ */
+RAMEEPROMSnapshot *RAMEEPROMClass::snapshot(void) {
+    RAMEEPROMSnapshot *snap;
+    if (!_ready()) {
+        return NULL;
+    }
+    snap = new RAMEEPROMSnapshot(this);
+#if RAM_EEPROM_POSIX
+    // Holding every stripe means no write is half done in the snapshot
+    uint64_t mask = (_locks != NULL) ? _stripeMask(0, _size) : 0;
+    _writeLock(mask);
+#endif
+    if (_snapPageGen == NULL) {
+        _snapPages = (_size + RAM_EEPROM_SNAPSHOT_PAGE_SIZE - 1) / RAM_EEPROM_SNAPSHOT_PAGE_SIZE;
+        _snapPageGen = new uint32_t[_snapPages]();
+    }
+    if (++_snapGeneration == 0) {
+        // Wrapped, so old pages could look like they were already copied
+        memset(_snapPageGen, 0, _snapPages * sizeof(uint32_t));
+        _snapGeneration = 1;
+    }
+    snap->_generation = _snapGeneration;
+    snap->_next = _snapshots;
+    _snapshots = snap;
+#if RAM_EEPROM_POSIX
+    _writeUnlock(mask);
+#endif
+    return snap;
+}
+
+/**
+ * Takes snapshot off the list of open snapshots
+ */
+void RAMEEPROMClass::_release(RAMEEPROMSnapshot *snapshot) {
+    RAMEEPROMSnapshot **link;
+#if RAM_EEPROM_POSIX
+    uint64_t mask = (_locks != NULL) ? _stripeMask(0, _size) : 0;
+    _writeLock(mask);
+#endif
+    for (link = &_snapshots; *link != NULL; link = &(*link)->_next) {
+        if (*link == snapshot) {
+            *link = snapshot->_next;
+            break;
+        }
+    }
+#if RAM_EEPROM_POSIX
+    _writeUnlock(mask);
+#endif
+}
+
+/**
+ * Copies the pages under [address, address + length) into every snapshot
+ * that doesn't have its own copy yet.  This is called before they are
+ * written.
+ */
+void RAMEEPROMClass::_preserve(size_t address, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    size_t first = address / RAM_EEPROM_SNAPSHOT_PAGE_SIZE;
+    size_t last = (address + length - 1) / RAM_EEPROM_SNAPSHOT_PAGE_SIZE;
+#if RAM_EEPROM_POSIX
+    if (_locks != NULL) {
+        uint32_t unlocked = 0;
+        while (!__atomic_compare_exchange_n(&_snapLock, &unlocked, 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            unlocked = 0;
+            _pause();
+        }
+    }
+#endif
+    for (size_t page = first; page <= last; page++) {
+        if (_snapPageGen[page] == _snapGeneration) {
+            continue;
+        }
+        size_t start = page * RAM_EEPROM_SNAPSHOT_PAGE_SIZE;
+        size_t count = (_size - start < RAM_EEPROM_SNAPSHOT_PAGE_SIZE) ? _size - start : RAM_EEPROM_SNAPSHOT_PAGE_SIZE;
+        for (RAMEEPROMSnapshot *snap = _snapshots; snap != NULL; snap = snap->_next) {
+            if (snap->_copies == NULL) {
+                __atomic_store_n(&snap->_copies, new uint8_t*[_snapPages](), __ATOMIC_RELEASE);
+            }
+            if (snap->_copies[page] != NULL) {
+                continue;
+            }
+            uint8_t *copy = new uint8_t[count];
+            if (_data != NULL) {
+                memcpy(copy, &_data[start], count);
+            } else {
+                _indirectLoad(start, copy, count);
+            }
+            // Readers have to see the whole copy before the pointer
+            __atomic_store_n(&snap->_copies[page], copy, __ATOMIC_RELEASE);
+            snap->_copied++;
+        }
+        _snapPageGen[page] = _snapGeneration;
+    }
+#if RAM_EEPROM_POSIX
+    if (_locks != NULL) {
+        __atomic_store_n(&_snapLock, 0, __ATOMIC_RELEASE);
+    }
+#endif
+}
+
+RAMEEPROMSnapshot::RAMEEPROMSnapshot(RAMEEPROMClass *owner)
+ : _owner(owner), _size(owner->size())
+{
+}
+
+RAMEEPROMSnapshot::~RAMEEPROMSnapshot()
+{
+    if (_owner != NULL) {
+        _owner->_release(this);
+    }
+    if (_copies != NULL) {
+        size_t pages = (_size + RAM_EEPROM_SNAPSHOT_PAGE_SIZE - 1) / RAM_EEPROM_SNAPSHOT_PAGE_SIZE;
+        for (size_t page = 0; page < pages; page++) {
+            delete [] _copies[page];
+        }
+        delete [] _copies;
+    }
+}
+
+/**
+ * Returns this snapshot's copy of page, or NULL if it is still shared
+ */
+uint8_t *RAMEEPROMSnapshot::_copy(size_t page) {
+    uint8_t **copies = __atomic_load_n(&_copies, __ATOMIC_ACQUIRE);
+    return (copies != NULL) ? __atomic_load_n(&copies[page], __ATOMIC_ACQUIRE) : NULL;
+}
+
+uint8_t RAMEEPROMSnapshot::read(int address) {
+    uint8_t value = 0;
+    readBytes(address, &value, 1);
+    return value;
+}
+
+/**
+ * Reads length bytes starting at address, as they were when the snapshot
+ * was taken
+ *
+ * @return true on success, false if the range is not inside the E2 or the
+ *         E2 is gone
+ */
+bool RAMEEPROMSnapshot::readBytes(int address, void *buffer, size_t length) {
+    uint8_t *out = (uint8_t *)buffer;
+    if ((_owner == NULL) || !_owner->_ready() || (buffer == NULL) || (address < 0)
+        || ((size_t)address > _size) || (length > _size - (size_t)address)) {
+        return false;
+    }
+    while (length > 0) {
+        size_t page = address / RAM_EEPROM_SNAPSHOT_PAGE_SIZE;
+        size_t offset = address % RAM_EEPROM_SNAPSHOT_PAGE_SIZE;
+        size_t count = (length < RAM_EEPROM_SNAPSHOT_PAGE_SIZE - offset) ? length : RAM_EEPROM_SNAPSHOT_PAGE_SIZE - offset;
+        uint8_t *copy = _copy(page);
+        if (copy == NULL) {
+            _owner->_load(address, out, count);
+            // A writer copies the page before it writes, so if it got in
+            // while we were reading, the copy is there now.
+            copy = _copy(page);
+        }
+        if (copy != NULL) {
+            memcpy(out, &copy[offset], count);
+        }
+        address += count;
+        out += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Reads a block of the E2 as it was when the snapshot was taken
+ *
+ * @return true on success, false if the block is not in the E2
+ */
+bool RAMEEPROMSnapshot::readBlock(int block, uint8_t *buffer) {
+    size_t blockSize = (_owner != NULL) ? _owner->blockSize() : 0;
+    if ((blockSize == 0) || (block < 0) || ((size_t)block >= _size / blockSize)) {
+        return false;
+    }
+    return readBytes(block * blockSize, buffer, blockSize);
+}
+
+/**
+ * Turns on flash mode, which makes the E2 behave like NOR flash
+ *
+ * Writes can only clear bits: each byte written is ANDed into what is
+ * there, the way programming flash works.  The only way to set bits again
+ * is to erase a whole sector with eraseSector() or erase().  fillBytes()
+ * and eraseBlocks() with 0xFF are writes too, so they don't set anything.
+ *
+ * Every write is charged config.programTime for each program page it
+ * touches, and every sector erase config.eraseTime.  flashStats() has the
+ * totals, for measuring the write amplification and time of a storage
+ * scheme before it goes on real hardware.
+ *
+ * Calling it again changes the settings.  It can't be used with concurrent
+ * mode.
+ *
+ * @param config The flash geometry and timing
+ *
+ * @return true on success, false if the settings or the E2 can't do it
+ */
+bool RAMEEPROMClass::flash(const RAMEEPROMFlashConfig &config) {
+    if (!_ready() || (config.programSize == 0) || (config.sectorSize == 0)
+        || ((config.sectorSize % config.programSize) != 0)) {
+        return false;
+    }
+#if RAM_EEPROM_POSIX
+    if (_locks != NULL) {
+        return false;
+    }
+#endif
+    if (_flash == NULL) {
+        _flash = new _Flash();
+    }
+    _flash->config = config;
+    return true;
+}
+
+/**
+ * Erases sector to 0xFF in flash mode
+ *
+ * @return true on success, false if not in flash mode or sector doesn't exist
+ */
+bool RAMEEPROMClass::eraseSector(int sector) {
+    if (!_ready() || (sector < 0) || ((size_t)sector >= sectors())) {
+        return false;
+    }
+    size_t start = sector * _flash->config.sectorSize;
+    size_t count = (_size - start < _flash->config.sectorSize) ? _size - start : _flash->config.sectorSize;
+    if (_snapshots != NULL) {
+        _preserve(start, count);
+    }
+    if (_data != NULL) {
+        memset(&_data[start], 0xFF, count);
+    } else {
+        _indirectSet(start, 0xFF, count);
+    }
+    _markDirty(start, count);
+    _flash->stats.erases++;
+    _flash->stats.time += _flash->config.eraseTime;
     return true;
 }
 
+/**
+ * Gets the flash mode counters.  They are all 0 outside of flash mode.
+ */
+void RAMEEPROMClass::flashStats(RAMEEPROMFlashStats &stats) {
+    if (_flash == NULL) {
+        stats = RAMEEPROMFlashStats();
+        return;
+    }
+    stats = _flash->stats;
+}
+
+void RAMEEPROMClass::clearFlashStats(void) {
+    if (_flash != NULL) {
+        _flash->stats = RAMEEPROMFlashStats();
+    }
+}
+
+/**
+ * Charges a write of [address, address + length) for the program pages it
+ * touches
+ */
+void RAMEEPROMClass::_flashCharge(size_t address, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    size_t programSize = _flash->config.programSize;
+    size_t programs = (address + length - 1) / programSize - address / programSize + 1;
+    _flash->stats.programs += programs;
+    _flash->stats.bytesRequested += length;
+    _flash->stats.bytesProgrammed += programs * programSize;
+    _flash->stats.time += programs * _flash->config.programTime;
+}
+
+/**
+ * ANDs buffer, or value if buffer is NULL, into [address, address + length)
+ */
+void RAMEEPROMClass::_flashProgram(size_t address, const uint8_t *buffer, uint8_t value, size_t length) {
+    uint8_t chunk[64];
+    while (length > 0) {
+        size_t count = (length < sizeof(chunk)) ? length : sizeof(chunk);
+        if (_data != NULL) {
+            memcpy(chunk, &_data[address], count);
+        } else {
+            _indirectLoad(address, chunk, count);
+        }
+        for (size_t i = 0; i < count; i++) {
+            uint8_t want = (buffer != NULL) ? buffer[i] : value;
+            _flash->stats.stuckBits += __builtin_popcount((uint8_t)(want & ~chunk[i]));
+            chunk[i] &= want;
+        }
+        if (_data != NULL) {
+            memcpy(&_data[address], chunk, count);
+        } else {
+            _indirectStore(address, chunk, count);
+        }
+        if (buffer != NULL) {
+            buffer += count;
+        }
+        address += count;
+        length -= count;
+    }
+}
+
+/**
+ * Programs [src, src + length) into dest.  The ranges can overlap, so this
+ * goes backwards when dest is above src.
+ */
+void RAMEEPROMClass::_flashMove(size_t dest, size_t src, size_t length) {
+    uint8_t chunk[64];
+    size_t done = 0;
+    _flashCharge(dest, length);
+    while (done < length) {
+        size_t count = (length - done < sizeof(chunk)) ? length - done : sizeof(chunk);
+        size_t offset = (dest > src) ? length - done - count : done;
+        if (_data != NULL) {
+            memcpy(chunk, &_data[src + offset], count);
+        } else {
+            _indirectLoad(src + offset, chunk, count);
+        }
+        _flashProgram(dest + offset, chunk, 0, count);
+        done += count;
+    }
+}
+
+/**
+ * Turns on a CRC32C for every page (block, if there is a block size)
+ *
+ * Every write updates the CRCs of the pages it touches, so they are
+ * always current, and digest() sums up the whole E2 from them without
+ * reading it.  Like concurrent(), this has to be set up before other
+ * threads start using the E2.
+ *
+ * @param enable true to turn it on, false to turn it off
+ *
+ * @return true on success, false if there is no storage behind the E2
+ */
+bool RAMEEPROMClass::checksums(bool enable) {
+    if (!enable) {
+        delete [] _crcs;
+        _crcs = NULL;
+        return true;
+    }
+    if (!_ready()) {
+        return false;
+    }
+    if (_crcs == NULL) {
+        uint8_t erased[64];
+        memset(erased, 0xFF, sizeof(erased));
+        _erasedCrc = 0;
+        for (size_t done = 0; done < _pageSize; done += sizeof(erased)) {
+            size_t count = (_pageSize - done < sizeof(erased)) ? _pageSize - done : sizeof(erased);
+            _erasedCrc = RAMEEPROMCrc32c(erased, count, _erasedCrc);
+        }
+        _crcs = new uint32_t[_pageCount];
+        if (_pageCount > 0) {
+            _crcUpdate(0, _pageCount - 1);
+        }
+    }
+    return true;
+}
+
+/**
+ * Makes readBlock() and readBlocks() check each block against its CRC,
+ * and fail if it doesn't match.  This catches the E2 being changed behind
+ * our back, through the buffer or the image file.  It only works with
+ * checksums() on.
+ */
+void RAMEEPROMClass::verifyReads(bool enable) {
+    _verifyReads = enable;
+}
+
+/**
+ * Returns the CRC32C of page, or 0 if checksums() is off
+ */
+uint32_t RAMEEPROMClass::pageCrc(size_t page) {
+    if ((_crcs == NULL) || (page >= _pageCount)) {
+        return 0;
+    }
+    return __atomic_load_n(&_crcs[page], __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns a digest of the whole E2
+ *
+ * This is the CRC32C of the page CRCs, so it costs one word per page
+ * instead of reading every byte.  It isn't the same number as the CRC32C
+ * of the E2 itself.
+ *
+ * @return The digest, or 0 if checksums() is off
+ */
+uint32_t RAMEEPROMClass::digest(void) {
+    if (_crcs == NULL) {
+        return 0;
+    }
+    return RAMEEPROMCrc32c(_crcs, _pageCount * sizeof(uint32_t));
+}
+
+/**
+ * Works out the CRCs of pages first through last
+ */
+void RAMEEPROMClass::_crcUpdate(size_t first, size_t last) {
+    uint8_t buffer[64];
+    for (size_t page = first; page <= last; page++) {
+        size_t start = page * _pageSize;
+        size_t count = (_size - start < _pageSize) ? _size - start : _pageSize;
+        uint32_t crc = 0;
+        if (_data != NULL) {
+            crc = RAMEEPROMCrc32c(&_data[start], count);
+        } else if ((_pages != NULL) && (count == _pageSize)
+            && ((start / RAM_EEPROM_SPARSE_PAGE_SIZE) == ((start + count - 1) / RAM_EEPROM_SPARSE_PAGE_SIZE))
+            && (_sparsePage(start / RAM_EEPROM_SPARSE_PAGE_SIZE, false) == NULL)) {
+            // Erased sparse pages stay cheap
+            crc = _erasedCrc;
+        } else {
+            for (size_t done = 0; done < count; done += sizeof(buffer)) {
+                size_t chunk = (count - done < sizeof(buffer)) ? count - done : sizeof(buffer);
+                _indirectLoad(start + done, buffer, chunk);
+                crc = RAMEEPROMCrc32c(buffer, chunk, crc);
+            }
+        }
+        __atomic_store_n(&_crcs[page], crc, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Reads whole pages into buffer, checking each against its CRC
+ *
+ * @return true if they all match
+ */
+bool RAMEEPROMClass::_verifiedLoad(size_t address, uint8_t *buffer, size_t length) {
+    while (length > 0) {
+        size_t page = address / _pageSize;
+        size_t count = (length < _pageSize) ? length : _pageSize;
+        uint32_t expect;
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            // The CRC has to come from the same write as the data
+            uint32_t seq[RAM_EEPROM_STRIPES];
+            uint64_t mask = _stripeMask(address, count);
+            do {
+                _readBegin(mask, seq);
+                _rawLoad(address, buffer, count);
+                expect = __atomic_load_n(&_crcs[page], __ATOMIC_RELAXED);
+            } while (_readRetry(mask, seq));
+        } else
+#endif
+        {
+            _rawLoad(address, buffer, count);
+            expect = _crcs[page];
+        }
+        if (RAMEEPROMCrc32c(buffer, count) != expect) {
+            RAM_EEPROM_COUNT(crcErrors, 1);
+            return false;
+        }
+        address += count;
+        buffer += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Returns sparse page index, or NULL if it is erased
+ *
+ * Stale pages (from before the last erase()) count as erased.  If create is
+ * set an erased page is allocated (or a stale one reused) and set to 0xFF.
+ * Otherwise a stale page is freed.
+ */
+uint8_t *RAMEEPROMClass::_sparsePage(size_t index, bool create) {
+    uint8_t *page = _pages[index];
+    if ((page != NULL) && (_pageGen[index] == _generation)) {
+        return page;
+    }
+    if (!create) {
+        _sparseDrop(index);
+        return NULL;
+    }
+    if (page == NULL) {
+        page = new uint8_t[RAM_EEPROM_SPARSE_PAGE_SIZE];
+        _pages[index] = page;
+        _resident++;
+    }
+    memset(page, 0xFF, RAM_EEPROM_SPARSE_PAGE_SIZE);
+    _pageGen[index] = _generation;
+    return page;
+}
+
+/**
+ * Frees sparse page index, so it reads as erased
+ */
+void RAMEEPROMClass::_sparseDrop(size_t index) {
+    if (_pages[index] != NULL) {
+        delete [] _pages[index];
+        _pages[index] = NULL;
+        _resident--;
+    }
+}
+
+void RAMEEPROMClass::_sparseLoad(size_t address, uint8_t *buffer, size_t length) {
+    while (length > 0) {
+        size_t offset = address & (RAM_EEPROM_SPARSE_PAGE_SIZE - 1);
+        size_t count = RAM_EEPROM_SPARSE_PAGE_SIZE - offset;
+        uint8_t *page = _sparsePage(address / RAM_EEPROM_SPARSE_PAGE_SIZE, false);
+        if (count > length) {
+            count = length;
+        }
+        if (page != NULL) {
+            memcpy(buffer, &page[offset], count);
+        } else {
+            memset(buffer, 0xFF, count);
+        }
+        address += count;
+        buffer += count;
+        length -= count;
+    }
+}
+
+void RAMEEPROMClass::_sparseStore(size_t address, const uint8_t *buffer, size_t length) {
+    while (length > 0) {
+        size_t offset = address & (RAM_EEPROM_SPARSE_PAGE_SIZE - 1);
+        size_t count = RAM_EEPROM_SPARSE_PAGE_SIZE - offset;
+        uint8_t *page = _sparsePage(address / RAM_EEPROM_SPARSE_PAGE_SIZE, true);
+        if (count > length) {
+            count = length;
+        }
+        memcpy(&page[offset], buffer, count);
+        address += count;
+        buffer += count;
+        length -= count;
+    }
+}
+
+/**
+ * Fills in sparse mode.  Erasing a whole page frees it, and erasing part of
+ * an erased page does nothing.
+ */
+void RAMEEPROMClass::_sparseSet(size_t address, uint8_t value, size_t length) {
+    while (length > 0) {
+        size_t index = address / RAM_EEPROM_SPARSE_PAGE_SIZE;
+        size_t offset = address & (RAM_EEPROM_SPARSE_PAGE_SIZE - 1);
+        size_t count = RAM_EEPROM_SPARSE_PAGE_SIZE - offset;
+        if (count > length) {
+            count = length;
+        }
+        if ((value == 0xFF) && (count == RAM_EEPROM_SPARSE_PAGE_SIZE)) {
+            _sparseDrop(index);
+        } else {
+            uint8_t *page = _sparsePage(index, value != 0xFF);
+            if (page != NULL) {
+                memset(&page[offset], value, count);
+            }
+        }
+        address += count;
+        length -= count;
+    }
+}
+
+/**
+ * memmove() in sparse mode.  This goes through a small buffer in whichever
+ * direction is safe for the overlap.  Erased source pages are copied with
+ * _sparseSet() so they don't allocate anything.
+ */
+void RAMEEPROMClass::_sparseMove(size_t dest, size_t src, size_t length) {
+    uint8_t buffer[256];
+    bool forward = dest <= src;
+    size_t done = 0;
+    while (done < length) {
+        size_t count = length - done;
+        size_t from;
+        if (count > sizeof(buffer)) {
+            count = sizeof(buffer);
+        }
+        if (forward) {
+            from = src + done;
+            size_t room = RAM_EEPROM_SPARSE_PAGE_SIZE - (from & (RAM_EEPROM_SPARSE_PAGE_SIZE - 1));
+            if (count > room) {
+                count = room;
+            }
+        } else {
+            size_t room = ((src + length - done - 1) & (RAM_EEPROM_SPARSE_PAGE_SIZE - 1)) + 1;
+            if (count > room) {
+                count = room;
+            }
+            from = src + length - done - count;
+        }
+        size_t to = dest + (from - src);
+        uint8_t *page = _sparsePage(from / RAM_EEPROM_SPARSE_PAGE_SIZE, false);
+        if (page == NULL) {
+            _sparseSet(to, 0xFF, count);
+        } else {
+            memcpy(buffer, &page[from & (RAM_EEPROM_SPARSE_PAGE_SIZE - 1)], count);
+            _sparseStore(to, buffer, count);
+        }
+        done += count;
+    }
+}
+
+bool RAMEEPROMClass::_sparseSame(size_t address, const uint8_t *buffer, size_t length) {
+    while (length > 0) {
+        size_t offset = address & (RAM_EEPROM_SPARSE_PAGE_SIZE - 1);
+        size_t count = RAM_EEPROM_SPARSE_PAGE_SIZE - offset;
+        uint8_t *page = _sparsePage(address / RAM_EEPROM_SPARSE_PAGE_SIZE, false);
+        if (count > length) {
+            count = length;
+        }
+        if (page != NULL) {
+            if (memcmp(&page[offset], buffer, count) != 0) {
+                return false;
+            }
+        } else {
+            for (size_t index = 0; index < count; index++) {
+                if (buffer[index] != 0xFF) {
+                    return false;
+                }
+            }
+        }
+        address += count;
+        buffer += count;
+        length -= count;
+    }
+    return true;
+}
+
+/*
+ * A backend without data() is read and written through its calls.  A
+ * failure can't be returned from here, so it is kept for commit(), and a
+ * failed read comes back erased.
+ */
+void RAMEEPROMClass::_backendLoad(size_t address, uint8_t *buffer, size_t length) {
+    if (!_backend->read(address, buffer, length)) {
+        memset(buffer, 0xFF, length);
+        _backendError = true;
+    }
+}
+
+void RAMEEPROMClass::_backendStore(size_t address, const uint8_t *buffer, size_t length) {
+    if (!_backend->write(address, buffer, length)) {
+        _backendError = true;
+    }
+}
+
+void RAMEEPROMClass::_backendSet(size_t address, uint8_t value, size_t length) {
+    uint8_t chunk[256];
+    memset(chunk, value, (length < sizeof(chunk)) ? length : sizeof(chunk));
+    while (length > 0) {
+        size_t count = (length < sizeof(chunk)) ? length : sizeof(chunk);
+        _backendStore(address, chunk, count);
+        address += count;
+        length -= count;
+    }
+}
+
+/**
+ * memmove() through the backend, backwards when dest is above src
+ */
+void RAMEEPROMClass::_backendMove(size_t dest, size_t src, size_t length) {
+    uint8_t chunk[256];
+    size_t done = 0;
+    while (done < length) {
+        size_t count = (length - done < sizeof(chunk)) ? length - done : sizeof(chunk);
+        size_t offset = (dest > src) ? length - done - count : done;
+        _backendLoad(src + offset, chunk, count);
+        _backendStore(dest + offset, chunk, count);
+        done += count;
+    }
+}
+
+bool RAMEEPROMClass::_backendSame(size_t address, const uint8_t *buffer, size_t length) {
+    uint8_t chunk[256];
+    while (length > 0) {
+        size_t count = (length < sizeof(chunk)) ? length : sizeof(chunk);
+        _backendLoad(address, chunk, count);
+        if (memcmp(chunk, buffer, count) != 0) {
+            return false;
+        }
+        address += count;
+        buffer += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Marks the pages first through last (inclusive) as dirty
+ */
+void RAMEEPROMClass::_markDirtyPages(size_t first, size_t last) {
+    size_t word = first >> 5;
+    size_t lastWord = last >> 5;
+    uint32_t head = ~(uint32_t)0 << (first & 31);
+    uint32_t tail = ~(uint32_t)0 >> (31 - (last & 31));
+    if (word == lastWord) {
+        _dirty[word] |= head & tail;
+        return;
+    }
+    _dirty[word++] |= head;
+    while (word < lastWord) {
+        _dirty[word++] = ~(uint32_t)0;
+    }
+    _dirty[word] |= tail;
+}
+
+/**
+ * Checks if the page holding address has been written since the last commit
+ */
+bool RAMEEPROMClass::isDirty(int address) {
+    if (!_goodAddress(address)) {
+        return false;
+    }
+    size_t page = (size_t)address / _pageSize;
+    return (_dirty[page >> 5] >> (page & 31)) & 1;
+}
+
+/**
+ * Finds the next run of dirty pages that starts at or after address
+ *
+ * Clean stretches are skipped a word (32 pages) at a time, so walking all
+ * of the dirty ranges costs about what changed, not the size of the E2.
+ *
+ * @code
+ * int address = 0;
+ * size_t length;
+ * while (EEPROM.nextDirty(address, length)) {
+ *     // [address, address + length) has changed
+ *     address += length;
+ * }
+ * @endcode
+ *
+ * @param address Where to start looking.  Set to the start of the run.
+ * @param length  Set to the length of the run in bytes
+ *
+ * @return true if a run was found, false otherwise
+ */
+bool RAMEEPROMClass::nextDirty(int &address, size_t &length) {
+    // Running off the end is how the walk stops, so it isn't a rejection
+    if (!_ready() || (address < 0) || ((size_t)address >= _size)) {
+        return false;
+    }
+    size_t words = (_pageCount + 31) / 32;
+    size_t page = (size_t)address / _pageSize;
+    size_t word = page >> 5;
+    uint32_t bits = _dirty[word] & (~(uint32_t)0 << (page & 31));
+    while (bits == 0) {
+        if (++word >= words) {
+            return false;
+        }
+        bits = _dirty[word];
+    }
+    size_t first = (word << 5) + __builtin_ctz(bits);
+    // Now look for the first clean page after it
+    page = first;
+    bits = ~_dirty[word] & (~(uint32_t)0 << (page & 31));
+    while (bits == 0) {
+        if (++word >= words) {
+            break;
+        }
+        bits = ~_dirty[word];
+    }
+    size_t last = (word < words) ? (word << 5) + __builtin_ctz(bits) : _pageCount;
+    size_t end = last * _pageSize;
+    if (end > _size) {
+        end = _size;
+    }
+    address = first * _pageSize;
+    length = end - address;
+    return true;
+}
+
+/**
+ * Marks every page clean
+ */
+void RAMEEPROMClass::clearDirty(void) {
+    if (_dirty != NULL) {
+        memset(_dirty, 0, ((_pageCount + 31) / 32) * sizeof(uint32_t));
+    }
+}
+
+/**
+ * Hands the dirty ranges to the backend's sync(), if there is one, and
+ * marks everything clean.
+ *
+ * In RAM there is nowhere to write the data back to, so anything that
+ * needs the changes has to walk them with nextDirty() before calling this.
+ *
+ * In async mode the ranges are queued for the flusher thread instead, and
+ * this returns straight away, unless the queue is full.  See async().
+ *
+ * @return true on success, false if the backend failed since the last
+ *         commit()
+ */
+bool RAMEEPROMClass::commit(void) {
+    bool ret = true;
+    RAM_EEPROM_COUNT(commits, 1);
+#if RAM_EEPROM_POSIX
+    if (_async != NULL) {
+        return _asyncCommit();
+    }
+#endif
+    if (_backend != NULL) {
+        RAMEEPROMRange ranges[RAM_EEPROM_SYNC_BATCH];
+        size_t count = 0;
+        int address = 0;
+        size_t length;
+        while (nextDirty(address, length)) {
+            ranges[count].address = address;
+            ranges[count].length = length;
+            address += length;
+            if (++count == RAM_EEPROM_SYNC_BATCH) {
+                ret = _backend->sync(ranges, count) && ret;
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            ret = _backend->sync(ranges, count) && ret;
+        }
+        if (_backendError) {
+            _backendError = false;
+            ret = false;
+        }
+    }
+    clearDirty();
+    return ret;
+}
+
+#if RAM_EEPROM_POSIX
+/**
+ * The queue between commit() and the flusher thread
+ */
+struct RAMEEPROMClass::_Async {
+    /** The ranges from one commit() */
+    struct Job {
+        Job *next;
+        uint64_t number;
+        RAMEEPROMRange *ranges;
+        size_t count;
+        size_t bytes;
+    };
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /** The flusher waits on this for jobs */
+    pthread_cond_t work;
+    /** commit() and flush() wait on this for jobs to finish */
+    pthread_cond_t done;
+    Job *head;
+    Job *tail;
+    /** The bytes in the queue, including the job being synced */
+    size_t bytes;
+    size_t limit;
+    /** The last job queued, and the last one finished */
+    uint64_t queued;
+    uint64_t finished;
+    bool failed;
+    bool stop;
+    RAMEEPROMCommitCallback callback;
+    void *arg;
+};
+#endif
+
+/**
+ * Waits for everything commit() has queued so far to reach the backend
+ *
+ * Only async mode has anything to wait for.  The callbacks for those
+ * commits have all returned by the time this does.
+ *
+ * @return true on success, false if a sync() failed since the last flush()
+ */
 bool RAMEEPROMClass::flush(void) {
+#if RAM_EEPROM_POSIX
+    if (_async != NULL) {
+        bool ret;
+        pthread_mutex_lock(&_async->lock);
+        uint64_t target = _async->queued;
+        while (_async->finished < target) {
+            pthread_cond_wait(&_async->done, &_async->lock);
+        }
+        ret = !_async->failed;
+        _async->failed = false;
+        pthread_mutex_unlock(&_async->lock);
+        return ret;
+    }
+#endif
     return true;
-}
\ No newline at end of file
+}
+
+#if RAM_EEPROM_POSIX
+/**
+ * Turns async mode on or off
+ *
+ * In async mode commit() takes the dirty ranges, queues them and returns.
+ * A flusher thread hands them to the backend's sync() in the order they
+ * were committed, and calls callback(arg, number, ok) after each one.
+ * lastCommit() numbers the commits and committed() says how far the
+ * flusher has got, so a caller can also poll for one to finish, and flush()
+ * waits for all of them.
+ *
+ * When more than limit dirty bytes are waiting, commit() blocks until the
+ * flusher catches up, so writers can't get ahead of it without bound.  A
+ * single commit() bigger than limit still goes, once the queue is empty.
+ *
+ * Only backends with data() can be used, as sync() runs beside writes to
+ * the E2.  Turning it off, or end(), waits for the queue to empty.  Calling
+ * it again while it is on changes the limit and callback.
+ *
+ * @param enable   true to turn it on, false to turn it off
+ * @param limit    The most dirty bytes to queue
+ * @param callback Called from the flusher thread, or NULL
+ * @param arg      Passed to callback
+ *
+ * @return true on success, false if the E2 can't do it
+ */
+bool RAMEEPROMClass::async(bool enable, size_t limit, RAMEEPROMCommitCallback callback, void *arg) {
+    if (!enable) {
+        if (_async != NULL) {
+            pthread_mutex_lock(&_async->lock);
+            _async->stop = true;
+            pthread_cond_signal(&_async->work);
+            pthread_mutex_unlock(&_async->lock);
+            pthread_join(_async->thread, NULL);
+            pthread_cond_destroy(&_async->work);
+            pthread_cond_destroy(&_async->done);
+            pthread_mutex_destroy(&_async->lock);
+            delete _async;
+            _async = NULL;
+        }
+        return true;
+    }
+    if (_async != NULL) {
+        pthread_mutex_lock(&_async->lock);
+        _async->limit = limit;
+        _async->callback = callback;
+        _async->arg = arg;
+        // A bigger limit could let a blocked commit() in
+        pthread_cond_broadcast(&_async->done);
+        pthread_mutex_unlock(&_async->lock);
+        return true;
+    }
+    if ((_backend == NULL) || (_data == NULL)) {
+        return false;
+    }
+    _async = new _Async();
+    _async->limit = limit;
+    _async->callback = callback;
+    _async->arg = arg;
+    pthread_mutex_init(&_async->lock, NULL);
+    pthread_cond_init(&_async->work, NULL);
+    pthread_cond_init(&_async->done, NULL);
+    if (pthread_create(&_async->thread, NULL, _flusher, this) != 0) {
+        pthread_cond_destroy(&_async->work);
+        pthread_cond_destroy(&_async->done);
+        pthread_mutex_destroy(&_async->lock);
+        delete _async;
+        _async = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The number given to the last commit() that queued anything in async
+ * mode.  It is done when committed() gets to it.
+ *
+ * @return The number, or 0 if nothing has been queued
+ */
+uint64_t RAMEEPROMClass::lastCommit(void) {
+    return (_async != NULL) ? __atomic_load_n(&_async->queued, __ATOMIC_ACQUIRE) : 0;
+}
+
+/**
+ * The number of the last commit() the flusher has finished in async mode.
+ * They finish in order.
+ *
+ * @return The number, or 0 if none have finished
+ */
+uint64_t RAMEEPROMClass::committed(void) {
+    return (_async != NULL) ? __atomic_load_n(&_async->finished, __ATOMIC_ACQUIRE) : 0;
+}
+
+/**
+ * commit() in async mode
+ */
+bool RAMEEPROMClass::_asyncCommit(void) {
+    _Async::Job *job = new _Async::Job();
+    size_t room = RAM_EEPROM_SYNC_BATCH;
+    int address = 0;
+    size_t length;
+    job->ranges = new RAMEEPROMRange[room];
+    while (nextDirty(address, length)) {
+        if (job->count == room) {
+            RAMEEPROMRange *ranges = new RAMEEPROMRange[room * 2];
+            memcpy(ranges, job->ranges, room * sizeof(RAMEEPROMRange));
+            delete [] job->ranges;
+            job->ranges = ranges;
+            room *= 2;
+        }
+        job->ranges[job->count].address = address;
+        job->ranges[job->count].length = length;
+        job->count++;
+        job->bytes += length;
+        address += length;
+    }
+    clearDirty();
+    if (job->count == 0) {
+        delete [] job->ranges;
+        delete job;
+        return true;
+    }
+    pthread_mutex_lock(&_async->lock);
+    while ((_async->bytes > 0) && (_async->bytes + job->bytes > _async->limit)) {
+        pthread_cond_wait(&_async->done, &_async->lock);
+    }
+    job->number = _async->queued + 1;
+    __atomic_store_n(&_async->queued, job->number, __ATOMIC_RELEASE);
+    if (_async->tail != NULL) {
+        _async->tail->next = job;
+    } else {
+        _async->head = job;
+    }
+    _async->tail = job;
+    _async->bytes += job->bytes;
+    pthread_cond_signal(&_async->work);
+    pthread_mutex_unlock(&_async->lock);
+    return true;
+}
+
+/**
+ * The flusher thread.  It empties the queue before it stops.
+ */
+void *RAMEEPROMClass::_flusher(void *arg) {
+    RAMEEPROMClass *e2 = (RAMEEPROMClass *)arg;
+    _Async *async = e2->_async;
+    pthread_mutex_lock(&async->lock);
+    for (;;) {
+        while ((async->head == NULL) && !async->stop) {
+            pthread_cond_wait(&async->work, &async->lock);
+        }
+        _Async::Job *job = async->head;
+        if (job == NULL) {
+            break;
+        }
+        RAMEEPROMCommitCallback callback = async->callback;
+        void *callbackArg = async->arg;
+        bool ok = true;
+        pthread_mutex_unlock(&async->lock);
+        for (size_t i = 0; i < job->count; i += RAM_EEPROM_SYNC_BATCH) {
+            size_t count = job->count - i;
+            if (count > RAM_EEPROM_SYNC_BATCH) {
+                count = RAM_EEPROM_SYNC_BATCH;
+            }
+            ok = e2->_backend->sync(&job->ranges[i], count) && ok;
+        }
+        if (callback != NULL) {
+            callback(callbackArg, job->number, ok);
+        }
+        pthread_mutex_lock(&async->lock);
+        async->head = job->next;
+        if (async->head == NULL) {
+            async->tail = NULL;
+        }
+        async->bytes -= job->bytes;
+        async->failed = async->failed || !ok;
+        __atomic_store_n(&async->finished, job->number, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&async->done);
+        delete [] job->ranges;
+        delete job;
+    }
+    pthread_mutex_unlock(&async->lock);
+    return NULL;
+}
+#endif
\ No newline at end of file
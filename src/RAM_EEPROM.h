@@ -27,25 +27,260 @@
 #include <string.h>
 #include <cstdio>
 
+#ifndef RAM_EEPROM_POSIX
+#if defined(__unix__) || defined(__APPLE__)
+/** Set when the host has mmap() and friends.  Define to 0 to leave them out */
+#define RAM_EEPROM_POSIX 1
+#else
+#define RAM_EEPROM_POSIX 0
+#endif
+#endif
+
+#ifndef RAM_EEPROM_PAGE_SIZE
+/** The dirty tracking granularity used when the block size is 0 */
+#define RAM_EEPROM_PAGE_SIZE 32
+#endif
+
+#if RAM_EEPROM_POSIX
+/** The number of seqlock stripes in concurrent mode.  64 at most */
+#define RAM_EEPROM_STRIPES 64
+/**
+ * The bytes of RAMEEPROMBackend::shared(): a change counter and the
+ * stripes, each on its own 64 byte line
+ */
+#define RAM_EEPROM_SHARED_SIZE (64 * (RAM_EEPROM_STRIPES + 1))
+#endif
+
+#ifndef RAM_EEPROM_STATS
+/** Set to 1 to count operations.  When 0 the counters aren't built at all */
+#define RAM_EEPROM_STATS 0
+#endif
+
+#if RAM_EEPROM_STATS
+#define RAM_EEPROM_COUNT(counter, n) _count(_stats.counter, n)
+#else
+#define RAM_EEPROM_COUNT(counter, n)
+#endif
+
+/**
+ * Operation counts from RAMEEPROMClass::stats()
+ */
+struct RAMEEPROMStats {
+    uint32_t reads;         //!< read(), readBytes() and compareBytes() calls
+    uint32_t writes;        //!< write(), update(), writeBytes() and fillBytes() calls
+    uint32_t gets;          //!< get() calls
+    uint32_t puts;          //!< put() calls
+    uint32_t blockReads;    //!< readBlock() and readBlocks() calls
+    uint32_t blockWrites;   //!< writeBlock(), writeBlocks(), fillBlocks() and eraseBlocks() calls
+    uint32_t blockCopies;   //!< copyBlock() and moveBlocks() calls
+    uint32_t commits;       //!< commit() calls
+    uint32_t atomics;       //!< fetchAdd(), exchange() and compareExchange() calls
+    uint32_t rejected;      //!< Calls refused because the address was out of range
+    uint32_t crcErrors;     //!< Blocks that failed verification in readBlock()
+    uint64_t bytesRead;     //!< Bytes read out of the E2
+    uint64_t bytesWritten;  //!< Bytes written into the E2
+};
+
+/**
+ * The geometry and timing of the flash in RAMEEPROMClass::flash()
+ */
+struct RAMEEPROMFlashConfig {
+    size_t sectorSize;      //!< The erase granularity in bytes
+    size_t programSize;     //!< The program page size in bytes.  Has to divide sectorSize
+    uint32_t programTime;   //!< Virtual time charged for each page programmed
+    uint32_t eraseTime;     //!< Virtual time charged for each sector erased
+};
+
+/**
+ * Flash mode counters from RAMEEPROMClass::flashStats()
+ *
+ * The write amplification is bytesProgrammed / bytesRequested.
+ */
+struct RAMEEPROMFlashStats {
+    uint32_t programs;          //!< Program pages written
+    uint32_t erases;            //!< Sectors erased
+    uint32_t stuckBits;         //!< 0 bits that writes tried to set back to 1
+    uint64_t bytesRequested;    //!< Bytes the write calls asked for
+    uint64_t bytesProgrammed;   //!< Whole program pages written, in bytes
+    uint64_t time;              //!< Virtual time spent programming and erasing
+};
+
+#ifndef RAM_EEPROM_SPARSE_PAGE_SIZE
+/** The page size in sparse mode.  This has to be a power of 2 */
+#define RAM_EEPROM_SPARSE_PAGE_SIZE 4096
+#endif
+
+#ifndef RAM_EEPROM_SNAPSHOT_PAGE_SIZE
+/** The size of the pieces snapshots copy when the E2 is written */
+#define RAM_EEPROM_SNAPSHOT_PAGE_SIZE 4096
+#endif
+
+#ifndef RAM_EEPROM_SYNC_BATCH
+/** The most dirty ranges commit() hands a backend's sync() at once */
+#define RAM_EEPROM_SYNC_BATCH 16
+#endif
+
+#if RAM_EEPROM_POSIX
+#ifndef RAM_EEPROM_ASYNC_LIMIT
+/** The dirty bytes async() lets wait for the flusher before commit() blocks */
+#define RAM_EEPROM_ASYNC_LIMIT (1024 * 1024)
+#endif
+
+/**
+ * Called from the flusher thread when an async commit() is done
+ *
+ * @param arg    What was given to async()
+ * @param number The commit, as lastCommit() gave it
+ * @param ok     false if the backend's sync() failed
+ */
+typedef void (*RAMEEPROMCommitCallback)(void *arg, uint64_t number, bool ok);
+#endif
+
+/**
+ * A range of the E2 handed to RAMEEPROMBackend::sync()
+ */
+struct RAMEEPROMRange {
+    size_t address;
+    size_t length;
+};
+
+/**
+ * Where an E2 keeps its bytes
+ *
+ * A backend that can hand its storage out as one flat buffer returns it
+ * from data().  The E2 then reads and writes that buffer itself, exactly
+ * as it does memory it allocated, so the usual RAM case never makes a
+ * virtual call.  A backend that can't (a device on a bus, a cache in front
+ * of one) returns NULL, and every access goes through read() and write().
+ *
+ * commit() hands the dirty ranges to sync() in order, up to
+ * RAM_EEPROM_SYNC_BATCH at a time, so they can be persisted together.
+ * See RAM_EEPROM_Backend.h for the ones that come with the library.
+ */
+class RAMEEPROMBackend {
+public:
+    virtual ~RAMEEPROMBackend() {}
+
+    /**
+     * Gets size bytes ready.  Bytes that didn't exist before read as 0xFF.
+     *
+     * @return true on success
+     */
+    virtual bool open(size_t size) = 0;
+    /**
+     * Lets go of the storage.  The E2 calls this from end(), after commit().
+     */
+    virtual void close(void) {}
+    /**
+     * The storage as one flat buffer, or NULL to be called for every access
+     */
+    virtual uint8_t *data(void) {
+        return NULL;
+    }
+#if RAM_EEPROM_POSIX
+    /**
+     * RAM_EEPROM_SHARED_SIZE bytes, 64 byte aligned and zero when first
+     * created, that every E2 opened on the same storage sees, even in other
+     * processes.  concurrent() keeps its locks here, so they all take the
+     * same ones.  NULL if the storage isn't shared.
+     */
+    virtual uint8_t *shared(void) {
+        return NULL;
+    }
+#endif
+    virtual bool read(size_t address, void *buffer, size_t length) = 0;
+    virtual bool write(size_t address, const void *buffer, size_t length) = 0;
+    /**
+     * Persists count ranges that have been written since the last sync()
+     *
+     * @return true on success
+     */
+    virtual bool sync(const RAMEEPROMRange *ranges, size_t count) {
+        return true;
+    }
+};
+
+class RAMEEPROMSnapshot;
+
 class RAMEEPROMClass {
+    friend class RAMEEPROMSnapshot;
 private:
     void _init(void);
+    void _alloc(void);
+    /** true if we allocated _data and have to free it */
     bool _free = false;
+    /** true if we allocated _dirty and have to free it */
+    bool _freeDirty = false;
+    /** true if we created _backend and have to delete it */
+    bool _freeBackend = false;
+    void _attach(RAMEEPROMBackend *backend);
 public:
-    RAMEEPROMClass(void *nothing, size_t size, uint8_t blockSize = 0);
+    RAMEEPROMClass(void *buffer, size_t size, uint8_t blockSize = 0);
     RAMEEPROMClass(unsigned int address, size_t size, uint8_t blockSize = 0);
+#if RAM_EEPROM_POSIX
+    RAMEEPROMClass(const char *filename, size_t size, uint8_t blockSize = 0);
+#endif
+    RAMEEPROMClass(RAMEEPROMBackend &backend, size_t size, uint8_t blockSize = 0);
     ~RAMEEPROMClass();
 
     void begin(void);
     uint8_t read(int address);
     void write(int address, uint8_t val);
+    void update(int address, uint8_t val);
     bool commit(void);
     bool flush(void);
     void end(void);
+    void erase(void);
+#if RAM_EEPROM_STATS
+    void stats(RAMEEPROMStats &stats);
+    void clearStats(void);
+    uint16_t pageWrites(size_t page);
+#endif
+#if RAM_EEPROM_POSIX
+    bool concurrent(bool enable = true);
+    /**
+     * Counts the writes made in concurrent mode, by every E2 sharing the
+     * locks.  It goes up after the write can be read, so a reader can poll
+     * this and only read again when it has moved.
+     *
+     * @return The count, or 0 if not in concurrent mode
+     */
+    uint64_t changes(void)
+    {
+        return (_shared != NULL) ? __atomic_load_n(&_shared->changes, __ATOMIC_ACQUIRE) : 0;
+    }
+    bool async(bool enable = true, size_t limit = RAM_EEPROM_ASYNC_LIMIT,
+        RAMEEPROMCommitCallback callback = NULL, void *arg = NULL);
+    uint64_t lastCommit(void);
+    uint64_t committed(void);
+#endif
+    RAMEEPROMSnapshot *snapshot(void);
+    bool flash(const RAMEEPROMFlashConfig &config);
+    bool eraseSector(int sector);
+    void flashStats(RAMEEPROMFlashStats &stats);
+    void clearFlashStats(void);
+    bool checksums(bool enable = true);
+    void verifyReads(bool enable = true);
+    uint32_t pageCrc(size_t page);
+    uint32_t digest(void);
+
+    bool readBytes(int address, void *buffer, size_t length);
+    bool writeBytes(int address, const void *buffer, size_t length);
+    bool fillBytes(int address, uint8_t value, size_t length);
+    bool compareBytes(int address, const void *buffer, size_t length);
+
+    bool isDirty(int address);
+    bool nextDirty(int &address, size_t &length);
+    void clearDirty(void);
 
     bool readBlock(int block, uint8_t *buffer);
     bool writeBlock(int block, uint8_t *data);
     bool copyBlock(int dest, int src);
+    bool readBlocks(int first, int count, uint8_t *buffer);
+    bool writeBlocks(int first, int count, const uint8_t *buffer);
+    bool moveBlocks(int dest, int src, int count);
+    bool fillBlocks(int first, int count, uint8_t value);
+    bool eraseBlocks(int first, int count);
 
     size_t size() {
         return _size;
@@ -53,16 +288,53 @@ public:
     size_t blockSize() {
         return _blockSize;
     }
+    /**
+     * The number of whole blocks in the E2
+     */
+    size_t blocks() {
+        return (_blockSize > 0) ? _size / _blockSize : 0;
+    }
     uint16_t pages() {
         return _size;
     }
+    /**
+     * The backend behind the E2, or NULL if it is in RAM it owns
+     */
+    RAMEEPROMBackend *backend() {
+        return _backend;
+    }
+    /**
+     * The number of bytes of storage actually allocated.  In sparse mode
+     * this only counts pages that have been written.
+     */
+    size_t residentBytes() {
+        return (_pages != NULL) ? _resident * RAM_EEPROM_SPARSE_PAGE_SIZE : _size;
+    }
+    /**
+     * The granularity of dirty tracking.  This is the block size, or
+     * RAM_EEPROM_PAGE_SIZE if the block size is 0.
+     */
+    size_t pageSize() {
+        return _pageSize;
+    }
+    /**
+     * The number of erase sectors in flash mode, counting a partial one at
+     * the end.  0 if flash mode is off.
+     */
+    size_t sectors() {
+        if (_flash == NULL) {
+            return 0;
+        }
+        return (_size + _flash->config.sectorSize - 1) / _flash->config.sectorSize;
+    }
     template<typename T> 
     T &get(int address, T &t) {
         if (!_goodAddress(address, sizeof(T))) {
             return t;
         }
 
-        memcpy((uint8_t*) &t, _data + address, sizeof(T));
+        RAM_EEPROM_COUNT(gets, 1);
+        _load(address, (uint8_t*) &t, sizeof(T));
         return t;
     }
 
@@ -71,23 +343,503 @@ public:
         if (!_goodAddress(address, sizeof(T))) {
             return t;
         }
-        memcpy(_data + address, (const uint8_t*) &t, sizeof(T));
+        RAM_EEPROM_COUNT(puts, 1);
+        _store(address, (const uint8_t*) &t, sizeof(T));
         return t;
     }
 
+    /**
+     * Adds value to the T at address and stores the old value in previous
+     *
+     * T is an integer of 1, 2, 4 or 8 bytes and address has to be a
+     * multiple of its size.  The add is a single atomic instruction, so
+     * threads can count in the same cell without a mutex.  Adding 0 just
+     * reads the cell, atomically, and doesn't mark it dirty.
+     *
+     * @return true on success, false if the cell is out of range, not
+     *         aligned or the E2 is in flash mode
+     */
+    template<typename T>
+    bool fetchAdd(int address, T value, T *previous = NULL) {
+        uint64_t old = 0;
+        _atomicSize<T>();
+        if (!_atomic(_atomicAdd, address, sizeof(T), (uint64_t)value, old)) {
+            return false;
+        }
+        if (previous != NULL) {
+            *previous = (T)old;
+        }
+        return true;
+    }
+
+    /**
+     * Stores value in the T at address and the old value in previous
+     *
+     * @return true on success, false as for fetchAdd()
+     */
+    template<typename T>
+    bool exchange(int address, T value, T *previous = NULL) {
+        uint64_t old = 0;
+        _atomicSize<T>();
+        if (!_atomic(_atomicExchange, address, sizeof(T), (uint64_t)value, old)) {
+            return false;
+        }
+        if (previous != NULL) {
+            *previous = (T)old;
+        }
+        return true;
+    }
+
+    /**
+     * Stores desired in the T at address if it holds expected
+     *
+     * If it doesn't, expected is set to what it does hold, so the usual
+     * retry loop works.
+     *
+     * @return true if desired was stored, false if the cell held something
+     *         else or is bad as for fetchAdd()
+     */
+    template<typename T>
+    bool compareExchange(int address, T &expected, T desired) {
+        uint64_t old = (uint64_t)expected;
+        _atomicSize<T>();
+        if (!_atomic(_atomicCompare, address, sizeof(T), (uint64_t)desired, old)) {
+            return false;
+        }
+        if ((T)old != expected) {
+            expected = (T)old;
+            return false;
+        }
+        return true;
+    }
+
 protected:
+    /** Picks the sparse constructor */
+    struct _Sparse {};
+
+    RAMEEPROMClass(uint8_t *data, uint32_t *dirty, size_t size, uint8_t blockSize, uint16_t *wear = NULL);
+    RAMEEPROMClass(const _Sparse &sparse, size_t size, uint8_t blockSize);
+
     uint8_t *_data = NULL;
     size_t _size = 0;
     size_t _blockSize = 0;
+    size_t _pageSize = 0;
+    size_t _pageCount = 0;
+    uint32_t *_dirty = NULL;
+    /** The sparse mode page table.  Missing and stale pages read as 0xFF */
+    uint8_t **_pages = NULL;
+    /** The generation each page in _pages was last erased in */
+    uint32_t *_pageGen = NULL;
+    uint32_t _generation = 0;
+    size_t _mapPages = 0;
+    size_t _resident = 0;
+    /** The backend, or NULL for RAM.  If it has data() that is _data. */
+    RAMEEPROMBackend *_backend = NULL;
+    /** Set when a backend read or write fails, until commit() reports it */
+    bool _backendError = false;
+    /** The open snapshots, newest first */
+    RAMEEPROMSnapshot *_snapshots = NULL;
+    /** The snapshot generation each snapshot page was last copied in */
+    uint32_t *_snapPageGen = NULL;
+    uint32_t _snapGeneration = 0;
+    size_t _snapPages = 0;
+    /** Keeps writers in different stripes from copying the same page */
+    uint32_t _snapLock = 0;
 
+    void _preserve(size_t address, size_t length);
+    void _release(RAMEEPROMSnapshot *snapshot);
 
-    bool _goodAddress(int address, size_t size = 0)
+    /** The flash mode settings and counters, NULL outside of flash mode */
+    struct _Flash {
+        RAMEEPROMFlashConfig config;
+        RAMEEPROMFlashStats stats;
+    };
+    _Flash *_flash = NULL;
+
+    /** The CRC32C of each page, NULL unless checksums() is on */
+    uint32_t *_crcs = NULL;
+    /** The CRC32C of a whole erased page */
+    uint32_t _erasedCrc = 0;
+    bool _verifyReads = false;
+
+    void _crcUpdate(size_t first, size_t last);
+    bool _verifiedLoad(size_t address, uint8_t *buffer, size_t length);
+
+    void _flashCharge(size_t address, size_t length);
+    void _flashProgram(size_t address, const uint8_t *buffer, uint8_t value, size_t length);
+    void _flashMove(size_t dest, size_t src, size_t length);
+
+    void _markDirtyPages(size_t first, size_t last);
+#if RAM_EEPROM_STATS
+    RAMEEPROMStats _stats = RAMEEPROMStats();
+    /** Saturating write counts for each page */
+    uint16_t *_wear = NULL;
+    bool _freeWear = false;
+
+    /*
+     * A single writer just needs the counters to never be seen torn, which
+     * a relaxed load and store gives without a locked instruction.  In
+     * concurrent mode there can be several writers, so it has to add
+     * atomically.
+     */
+    void _count(uint32_t &counter, uint32_t n)
+    {
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+            return;
+        }
+#endif
+        __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+
+    void _count(uint64_t &counter, uint64_t n)
+    {
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+            return;
+        }
+#endif
+        __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Bumps the write counts of pages first through last.  Writers of a
+     * page normally hold its stripe, but fetchAdd() and friends don't, so
+     * in concurrent mode the count is added with a compare and swap.
+     */
+    void _countWear(size_t first, size_t last)
+    {
+        for (; first <= last; first++) {
+            uint16_t count = __atomic_load_n(&_wear[first], __ATOMIC_RELAXED);
+#if RAM_EEPROM_POSIX
+            if (_locks != NULL) {
+                while ((count != 0xFFFF) && !__atomic_compare_exchange_n(&_wear[first], &count,
+                    (uint16_t)(count + 1), true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                }
+                continue;
+            }
+#endif
+            if (count != 0xFFFF) {
+                __atomic_store_n(&_wear[first], (uint16_t)(count + 1), __ATOMIC_RELAXED);
+            }
+        }
+    }
+#endif
+    uint8_t *_sparsePage(size_t index, bool create);
+    void _sparseDrop(size_t index);
+    void _sparseLoad(size_t address, uint8_t *buffer, size_t length);
+    void _sparseStore(size_t address, const uint8_t *buffer, size_t length);
+    void _sparseSet(size_t address, uint8_t value, size_t length);
+    void _sparseMove(size_t dest, size_t src, size_t length);
+    bool _sparseSame(size_t address, const uint8_t *buffer, size_t length);
+    void _backendLoad(size_t address, uint8_t *buffer, size_t length);
+    void _backendStore(size_t address, const uint8_t *buffer, size_t length);
+    void _backendSet(size_t address, uint8_t value, size_t length);
+    void _backendMove(size_t dest, size_t src, size_t length);
+    bool _backendSame(size_t address, const uint8_t *buffer, size_t length);
+
+    /*
+     * Storage that isn't one flat buffer is either sparse pages or a
+     * backend without data()
+     */
+    void _indirectLoad(size_t address, uint8_t *buffer, size_t length)
+    {
+        if (_pages != NULL) {
+            _sparseLoad(address, buffer, length);
+        } else {
+            _backendLoad(address, buffer, length);
+        }
+    }
+
+    void _indirectStore(size_t address, const uint8_t *buffer, size_t length)
+    {
+        if (_pages != NULL) {
+            _sparseStore(address, buffer, length);
+        } else {
+            _backendStore(address, buffer, length);
+        }
+    }
+
+    void _indirectSet(size_t address, uint8_t value, size_t length)
+    {
+        if (_pages != NULL) {
+            _sparseSet(address, value, length);
+        } else {
+            _backendSet(address, value, length);
+        }
+    }
+
+    void _indirectMove(size_t dest, size_t src, size_t length)
+    {
+        if (_pages != NULL) {
+            _sparseMove(dest, src, length);
+        } else {
+            _backendMove(dest, src, length);
+        }
+    }
+
+    bool _indirectSame(size_t address, const uint8_t *buffer, size_t length)
+    {
+        if (_pages != NULL) {
+            return _sparseSame(address, buffer, length);
+        }
+        return _backendSame(address, buffer, length);
+    }
+
+    /**
+     * true if there is storage behind the E2
+     */
+    bool _ready(void)
+    {
+        return (_data != NULL) || (_pages != NULL) || (_backend != NULL);
+    }
+
+#if RAM_EEPROM_POSIX
+    /** A seqlock, padded out to its own cache line */
+    struct _Stripe {
+        uint32_t seq;
+        uint8_t pad[60];
+    };
+    /** What concurrent mode shares, laid out as RAM_EEPROM_SHARED_SIZE */
+    struct _Shared {
+        uint64_t changes;
+        /**
+         * The page size << 8 | RAM_EEPROM_STRIPES of the E2 that set this up,
+         * or 0.  Every E2 sharing it has to stripe the same way.
+         */
+        uint64_t geometry;
+        uint8_t pad[48];
+        _Stripe stripes[RAM_EEPROM_STRIPES];
+    };
+    static_assert(sizeof(_Shared) == RAM_EEPROM_SHARED_SIZE, "RAM_EEPROM_SHARED_SIZE is wrong");
+    _Shared *_shared = NULL;
+    /** true if _shared is ours, not the backend's */
+    bool _freeShared = false;
+    /** The seqlock stripes in concurrent mode, NULL otherwise */
+    _Stripe *_locks = NULL;
+
+    uint64_t _stripeMask(size_t address, size_t length);
+    void _readBegin(uint64_t mask, uint32_t *seq);
+    bool _readRetry(uint64_t mask, const uint32_t *seq);
+    void _writeLock(uint64_t mask);
+    void _writeUnlock(uint64_t mask);
+    void _lockedLoad(size_t address, void *buffer, size_t length);
+    bool _lockedSame(size_t address, const void *buffer, size_t length);
+    void _markDirtyAtomic(size_t first, size_t last);
+
+    /** The flusher thread and its queue in async mode, NULL otherwise */
+    struct _Async;
+    _Async *_async = NULL;
+    bool _asyncCommit(void);
+    static void *_flusher(void *arg);
+#endif
+
+    /*
+     * These do the actual work on the storage for all of the public calls.
+     * The range must already have been checked.  In concurrent mode the
+     * reads retry until they see a stable copy and the writes hold the
+     * stripes they touch.  Otherwise the flat buffer case is inline so it
+     * stays a plain memcpy.
+     */
+    void _load(size_t address, void *buffer, size_t length)
+    {
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            _lockedLoad(address, buffer, length);
+            return;
+        }
+#endif
+        _rawLoad(address, buffer, length);
+    }
+
+    void _store(size_t address, const void *buffer, size_t length)
+    {
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            uint64_t mask = _stripeMask(address, length);
+            _writeLock(mask);
+            _rawStore(address, buffer, length);
+            _writeUnlock(mask);
+            return;
+        }
+#endif
+        _rawStore(address, buffer, length);
+    }
+
+    void _set(size_t address, uint8_t value, size_t length)
+    {
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            uint64_t mask = _stripeMask(address, length);
+            _writeLock(mask);
+            _rawSet(address, value, length);
+            _writeUnlock(mask);
+            return;
+        }
+#endif
+        _rawSet(address, value, length);
+    }
+
+    void _move(size_t dest, size_t src, size_t length)
+    {
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            // The source is locked too, so it can't change under us
+            uint64_t mask = _stripeMask(dest, length) | _stripeMask(src, length);
+            _writeLock(mask);
+            _rawMove(dest, src, length);
+            _writeUnlock(mask);
+            return;
+        }
+#endif
+        _rawMove(dest, src, length);
+    }
+
+    bool _same(size_t address, const void *buffer, size_t length)
+    {
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            return _lockedSame(address, buffer, length);
+        }
+#endif
+        return _rawSame(address, buffer, length);
+    }
+
+    void _rawLoad(size_t address, void *buffer, size_t length)
+    {
+        RAM_EEPROM_COUNT(bytesRead, length);
+        if (_data != NULL) {
+            memcpy(buffer, &_data[address], length);
+        } else {
+            _indirectLoad(address, (uint8_t *)buffer, length);
+        }
+    }
+
+    void _rawStore(size_t address, const void *buffer, size_t length)
+    {
+        if (_snapshots != NULL) {
+            _preserve(address, length);
+        }
+        RAM_EEPROM_COUNT(bytesWritten, length);
+        if (_flash != NULL) {
+            _flashCharge(address, length);
+            _flashProgram(address, (const uint8_t *)buffer, 0, length);
+        } else if (_data != NULL) {
+            memcpy(&_data[address], buffer, length);
+        } else {
+            _indirectStore(address, (const uint8_t *)buffer, length);
+        }
+        _markDirty(address, length);
+    }
+
+    void _rawSet(size_t address, uint8_t value, size_t length)
+    {
+        if (_snapshots != NULL) {
+            _preserve(address, length);
+        }
+        RAM_EEPROM_COUNT(bytesWritten, length);
+        if (_flash != NULL) {
+            _flashCharge(address, length);
+            _flashProgram(address, NULL, value, length);
+        } else if (_data != NULL) {
+            memset(&_data[address], value, length);
+        } else {
+            _indirectSet(address, value, length);
+        }
+        _markDirty(address, length);
+    }
+
+    void _rawMove(size_t dest, size_t src, size_t length)
+    {
+        if (_snapshots != NULL) {
+            _preserve(dest, length);
+        }
+        RAM_EEPROM_COUNT(bytesRead, length);
+        RAM_EEPROM_COUNT(bytesWritten, length);
+        if (_flash != NULL) {
+            _flashMove(dest, src, length);
+        } else if (_data != NULL) {
+            memmove(&_data[dest], &_data[src], length);
+        } else {
+            _indirectMove(dest, src, length);
+        }
+        _markDirty(dest, length);
+    }
+
+    bool _rawSame(size_t address, const void *buffer, size_t length)
+    {
+        RAM_EEPROM_COUNT(bytesRead, length);
+        if (_data != NULL) {
+            return memcmp(&_data[address], buffer, length) == 0;
+        }
+        return _indirectSame(address, (const uint8_t *)buffer, length);
+    }
+
+    /**
+     * Marks the pages under [address, address + length) as dirty.  The
+     * range must already have been checked.
+     */
+    void _markDirty(size_t address, size_t length)
+    {
+        if (length == 0) {
+            return;
+        }
+        size_t first = address / _pageSize;
+        size_t last = (address + length - 1) / _pageSize;
+        if (_crcs != NULL) {
+            _crcUpdate(first, last);
+        }
+#if RAM_EEPROM_STATS
+        _countWear(first, last);
+#endif
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            // Other stripes share the bitmap words
+            _markDirtyAtomic(first, last);
+            __atomic_fetch_add(&_shared->changes, 1, __ATOMIC_RELEASE);
+            return;
+        }
+#endif
+        if (first == last) {
+            _dirty[first >> 5] |= (uint32_t)1 << (first & 31);
+        } else {
+            _markDirtyPages(first, last);
+        }
+    }
+
+    /**
+     * true if RAMEEPROM<> can write its storage directly, without locking,
+     * copying pages for snapshots, flash rules or checksums
+     */
+    bool _direct(void)
     {
-        if (_data == NULL) {
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
             return false;
         }
-        int addr = address + size;
-        return !((address < 0) || ((size_t)addr >= _size));
+#endif
+        return (_snapshots == NULL) && (_flash == NULL) && (_crcs == NULL);
+    }
+
+    bool _goodAddress(int address, size_t size = 0)
+    {
+        return _goodRange(address, (size == 0) ? 1 : size);
+    }
+
+    /**
+     * Checks that [address, address + length) is inside the E2.  This is
+     * done without forming address + length, so it can't overflow.
+     */
+    bool _goodRange(int address, size_t length)
+    {
+        if (_ready() && (address >= 0) && ((size_t)address <= _size)
+            && (length <= (_size - (size_t)address))) {
+            return true;
+        }
+        RAM_EEPROM_COUNT(rejected, 1);
+        return false;
     }
 
     int _blockAddress(int block)
@@ -95,6 +847,38 @@ protected:
         return block * _blockSize;
     }
 
+    /**
+     * Checks that blocks [first, first + count) are all inside the E2
+     */
+    bool _goodBlocks(int first, int count)
+    {
+        size_t total = blocks();
+        if (_ready() && (first >= 0) && (count >= 0)
+            && ((size_t)first < total) && ((size_t)count <= total - first)) {
+            return true;
+        }
+        RAM_EEPROM_COUNT(rejected, 1);
+        return false;
+    }
+
+    /** The operations _atomic() does */
+    static const uint8_t _atomicAdd = 0;
+    static const uint8_t _atomicExchange = 1;
+    static const uint8_t _atomicCompare = 2;
+
+    template<typename T>
+    static void _atomicSize(void)
+    {
+        static_assert((sizeof(T) == 1) || (sizeof(T) == 2) || (sizeof(T) == 4) || (sizeof(T) == 8),
+            "Atomic cells are 1, 2, 4 or 8 bytes");
+        static_assert((T)3 / (T)2 == (T)1,
+            "Atomic cells are integers");
+    }
+    bool _atomic(uint8_t op, int address, size_t size, uint64_t value, uint64_t &old);
+    static bool _atomicSized(uint8_t *cell, size_t size, uint8_t op, uint64_t value, uint64_t &old);
+    template<typename T>
+    static bool _atomicCell(uint8_t *cell, uint8_t op, uint64_t value, uint64_t &old);
+
     /**
      * Copying not allowed
      */
@@ -111,5 +895,210 @@ protected:
 
 };
 
+/**
+ * A read only copy of an E2 as it was when snapshot() was called
+ *
+ * Creating one doesn't copy anything.  The snapshot shares the E2's
+ * storage until a page is written, and the page is copied into the
+ * snapshot just before that first write, so it costs one
+ * RAM_EEPROM_SNAPSHOT_PAGE_SIZE page for each page changed since.  Reading
+ * a snapshot never holds up writers to the E2, even in concurrent mode.
+ *
+ * Delete it when done.  Snapshots of an E2 that has been deleted fail
+ * every read.
+ */
+class RAMEEPROMSnapshot {
+    friend class RAMEEPROMClass;
+public:
+    ~RAMEEPROMSnapshot();
+
+    uint8_t read(int address);
+    bool readBytes(int address, void *buffer, size_t length);
+    bool readBlock(int block, uint8_t *buffer);
+
+    size_t size() {
+        return _size;
+    }
+    /**
+     * The number of pages copied into this snapshot so far
+     */
+    size_t copiedPages() {
+        return _copied;
+    }
+    template<typename T>
+    T &get(int address, T &t) {
+        readBytes(address, &t, sizeof(T));
+        return t;
+    }
+
+protected:
+    RAMEEPROMSnapshot(RAMEEPROMClass *owner);
+
+    RAMEEPROMClass *_owner;
+    /** The next older snapshot of _owner */
+    RAMEEPROMSnapshot *_next = NULL;
+    uint32_t _generation = 0;
+    size_t _size;
+    /** The pages copied out of _owner, allocated on the first copy */
+    uint8_t **_copies = NULL;
+    size_t _copied = 0;
+
+    uint8_t *_copy(size_t page);
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMSnapshot(const RAMEEPROMSnapshot &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMSnapshot &operator=(const RAMEEPROMSnapshot &other);
+};
+
+/**
+ * An E2 that only allocates the pages that have been written
+ *
+ * The E2 is split into RAM_EEPROM_SPARSE_PAGE_SIZE pages that are allocated
+ * on their first write.  Pages that were never written, or that have been
+ * erased, read back as 0xFF.  Construction and erase() don't touch the
+ * pages, so a device of many megabytes is as cheap to set up and wipe as a
+ * small one, and residentBytes() follows what has actually been written.
+ *
+ * Everything in RAMEEPROMClass works the same on it.
+ */
+class RAMEEPROMSparseClass : public RAMEEPROMClass {
+public:
+    RAMEEPROMSparseClass(size_t size, uint8_t blockSize = 0)
+     : RAMEEPROMClass(_Sparse(), size, blockSize)
+    {
+    }
+};
+
+/**
+ * An E2 whose size and block size are fixed at compile time
+ *
+ * The storage lives inside the object, so nothing is allocated, and the
+ * address checks are constant expressions.  get() and put() with the
+ * address as a template argument are checked with static_assert and
+ * compile down to a plain load or store:
+ *
+ * @code
+ * RAMEEPROM<1024, 32> EEPROM;
+ * EEPROM.put<16>(bootCount);
+ * @endcode
+ *
+ * Everything else in RAMEEPROMClass works the same on it.
+ */
+template<size_t Size, uint8_t BlockSize = 0>
+class RAMEEPROM : public RAMEEPROMClass {
+public:
+    static_assert(Size > 0, "RAMEEPROM needs a size");
+    static_assert(BlockSize <= Size, "The block size can't be bigger than the E2");
+
+    /** The dirty tracking granularity */
+    static const size_t PageSize = (BlockSize > 0) ? BlockSize : RAM_EEPROM_PAGE_SIZE;
+
+#if RAM_EEPROM_STATS
+    RAMEEPROM() : RAMEEPROMClass(_storage, _bitmap, Size, BlockSize, _wearCounts)
+#else
+    RAMEEPROM() : RAMEEPROMClass(_storage, _bitmap, Size, BlockSize)
+#endif
+    {
+        memset(_storage, 0xFF, Size);
+    }
+
+    /**
+     * Checks that [address, address + length) is inside the E2
+     */
+    static constexpr bool goodAddress(int address, size_t length)
+    {
+        return (address >= 0) && ((size_t)address <= Size)
+            && (length <= Size - (size_t)address);
+    }
+
+    template<typename T>
+    T &get(int address, T &t) {
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            return RAMEEPROMClass::get(address, t);
+        }
+#endif
+        if (goodAddress(address, sizeof(T))) {
+            RAM_EEPROM_COUNT(gets, 1);
+            RAM_EEPROM_COUNT(bytesRead, sizeof(T));
+            memcpy((uint8_t*) &t, _storage + address, sizeof(T));
+        } else {
+            RAM_EEPROM_COUNT(rejected, 1);
+        }
+        return t;
+    }
+
+    template<typename T>
+    const T &put(int address, const T &t) {
+        if (!_direct()) {
+            return RAMEEPROMClass::put(address, t);
+        }
+        if (goodAddress(address, sizeof(T))) {
+            RAM_EEPROM_COUNT(puts, 1);
+            RAM_EEPROM_COUNT(bytesWritten, sizeof(T));
+            memcpy(_storage + address, (const uint8_t*) &t, sizeof(T));
+            _markDirtyStatic(address, sizeof(T));
+        } else {
+            RAM_EEPROM_COUNT(rejected, 1);
+        }
+        return t;
+    }
+
+    template<int Address, typename T>
+    T &get(T &t) {
+        static_assert(goodAddress(Address, sizeof(T)), "get() address is outside of the E2");
+#if RAM_EEPROM_POSIX
+        if (_locks != NULL) {
+            return RAMEEPROMClass::get(Address, t);
+        }
+#endif
+        RAM_EEPROM_COUNT(gets, 1);
+        RAM_EEPROM_COUNT(bytesRead, sizeof(T));
+        memcpy((uint8_t*) &t, _storage + Address, sizeof(T));
+        return t;
+    }
+
+    template<int Address, typename T>
+    const T &put(const T &t) {
+        static_assert(goodAddress(Address, sizeof(T)), "put() address is outside of the E2");
+        if (!_direct()) {
+            return RAMEEPROMClass::put(Address, t);
+        }
+        RAM_EEPROM_COUNT(puts, 1);
+        RAM_EEPROM_COUNT(bytesWritten, sizeof(T));
+        memcpy(_storage + Address, (const uint8_t*) &t, sizeof(T));
+        _markDirtyStatic(Address, sizeof(T));
+        return t;
+    }
+
+private:
+    static const size_t _words = (((Size + PageSize - 1) / PageSize) + 31) / 32;
+
+    alignas(8) uint8_t _storage[Size];
+    uint32_t _bitmap[_words];
+#if RAM_EEPROM_STATS
+    uint16_t _wearCounts[(Size + PageSize - 1) / PageSize];
+#endif
+
+    void _markDirtyStatic(size_t address, size_t length)
+    {
+        size_t first = address / PageSize;
+        size_t last = (address + length - 1) / PageSize;
+#if RAM_EEPROM_STATS
+        _countWear(first, last);
+#endif
+        if (first == last) {
+            _bitmap[first >> 5] |= (uint32_t)1 << (first & 31);
+        } else {
+            _markDirtyPages(first, last);
+        }
+    }
+};
+
 #endif // RAM_EEPROM_H
 
@@ -0,0 +1,333 @@
+/*
+  RAM_EEPROM_Allocator.cpp - Bitmap block allocator for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "RAM_EEPROM_Allocator.h"
+
+/*
+ * The bitmap is kept in the E2 exactly as the words are in RAM, so it
+ * can be read and written with memcpy, and on a little endian machine bit
+ * n is bit n % 8 of byte n / 8.  Bits past the last block are 0 in RAM,
+ * so nothing ever finds them free.
+ */
+
+/** Bits p..p+count-1 of word are all set for every bit p set in the result */
+static uint64_t _runs(uint64_t word, size_t count)
+{
+    size_t have = 1;
+    while ((have < count) && (word != 0)) {
+        size_t shift = (count - have < have) ? count - have : have;
+        word &= word >> shift;
+        have += shift;
+    }
+    return word;
+}
+
+/** The number of set bits at the bottom of word */
+static size_t _low(uint64_t word)
+{
+    return (~word == 0) ? 64 : __builtin_ctzll(~word);
+}
+
+/** The number of set bits at the top of word */
+static size_t _high(uint64_t word)
+{
+    return (~word == 0) ? 64 : __builtin_clzll(~word);
+}
+
+/**
+ * Sets up an allocator on blocks of eeprom
+ *
+ * Nothing is touched until begin().
+ *
+ * @param eeprom The E2.  It has to have a block size.
+ * @param first  The first block to use
+ * @param count  The number of blocks to use, 0 for the rest of the E2
+ */
+RAMEEPROMAllocator::RAMEEPROMAllocator(RAMEEPROMClass &eeprom, int first, int count)
+ : _eeprom(eeprom), _first(first), _count(count), _words(), _offset()
+{
+}
+
+RAMEEPROMAllocator::~RAMEEPROMAllocator()
+{
+    delete [] _bits;
+}
+
+/**
+ * Reads the bitmap and builds the summaries
+ *
+ * @return true on success, false if the block range isn't in the E2 or is
+ *         too small for the bitmap and a block
+ */
+bool RAMEEPROMAllocator::begin(void) {
+    size_t blockSize = _eeprom.blockSize();
+    size_t blocks = _eeprom.blocks();
+    size_t total, bytes, words, i;
+
+    delete [] _bits;
+    _bits = NULL;
+    _blocks = 0;
+    _free = 0;
+    _runHint = 0;
+    if ((blockSize == 0) || (_first < 0) || ((size_t)_first >= blocks)) {
+        return false;
+    }
+    total = (_count > 0) ? (size_t)_count : blocks - _first;
+    if (_first + total > blocks) {
+        return false;
+    }
+    // b bitmap blocks cover (total - b) blocks, so b = total / (8 * size + 1)
+    _bitmapBlocks = (total + 8 * blockSize) / (8 * blockSize + 1);
+    if (_bitmapBlocks >= total) {
+        return false;
+    }
+    _blocks = total - _bitmapBlocks;
+    _words[0] = (_blocks + 63) / 64;
+    _offset[0] = 0;
+    words = _words[0];
+    for (_levels = 0; (_words[_levels] > 1) && (_levels < _maxLevels); _levels++) {
+        _offset[_levels + 1] = words;
+        _words[_levels + 1] = (_words[_levels] + 63) / 64;
+        words += _words[_levels + 1];
+    }
+    _bits = new uint64_t[words]();
+    bytes = (_blocks + 7) / 8;
+    if (!_eeprom.readBytes(_first * blockSize, _bits, bytes)) {
+        delete [] _bits;
+        _bits = NULL;
+        return false;
+    }
+    // Nothing past the end is free
+    if (_blocks % 64 != 0) {
+        _bits[_words[0] - 1] &= ((uint64_t)1 << (_blocks % 64)) - 1;
+    }
+    for (i = 0; i < _words[0]; i++) {
+        _free += __builtin_popcountll(_bits[i]);
+        _summarize(i);
+    }
+    return true;
+}
+
+/**
+ * Takes the lowest free block
+ *
+ * @return The block number, or -1 if there are none
+ */
+int RAMEEPROMAllocator::allocate(void) {
+    size_t level, word = 0;
+    if ((_bits == NULL) || (_free == 0)) {
+        return -1;
+    }
+    // Follow the lowest set bit from the top summary down to the bitmap
+    for (level = _levels + 1; level-- > 0;) {
+        word = word * 64 + __builtin_ctzll(_level(level)[word]);
+    }
+    size_t bit = word;
+    _mark(bit, 1, false);
+    if (!_save(bit, 1)) {
+        _mark(bit, 1, true);
+        return -1;
+    }
+    return firstBlock() + (int)bit;
+}
+
+/**
+ * Takes the lowest run of count free blocks
+ *
+ * @return The first block of the run, or -1 if there isn't one that long
+ */
+int RAMEEPROMAllocator::allocate(size_t count) {
+    size_t run = 0, start = 0, bit = 0, i;
+    bool found = false;
+    if (count <= 1) {
+        return (count == 1) ? allocate() : -1;
+    }
+    if ((_bits == NULL) || (count > _free)) {
+        return -1;
+    }
+    for (i = _runHint; (i < _words[0]) && !found; i++) {
+        uint64_t word = _bits[i];
+        if ((i == _runHint) && ((word >> 63) == 0) && (_runs(word, 2) == 0)) {
+            // No two free blocks in a row start here, so no run ever will
+            // until something is freed
+            _runHint++;
+            continue;
+        }
+        if (run == 0) {
+            start = i * 64;
+        }
+        if (~word == 0) {
+            run += 64;
+            found = (run >= count);
+            bit = start;
+            continue;
+        }
+        if (run + _low(word) >= count) {
+            found = true;
+            bit = start;
+        } else if ((count <= 64) && (_runs(word, count) != 0)) {
+            found = true;
+            bit = i * 64 + __builtin_ctzll(_runs(word, count));
+        } else {
+            run = _high(word);
+            start = (i + 1) * 64 - run;
+        }
+    }
+    if (!found) {
+        return -1;
+    }
+    _mark(bit, count, false);
+    if (!_save(bit, count)) {
+        _mark(bit, count, true);
+        return -1;
+    }
+    return firstBlock() + (int)bit;
+}
+
+/**
+ * Gives back count blocks from block
+ *
+ * @return true on success, false if any of them weren't allocated
+ */
+bool RAMEEPROMAllocator::free(int block, size_t count) {
+    size_t i;
+    if (!_good(block, count)) {
+        return false;
+    }
+    size_t bit = block - firstBlock();
+    for (i = bit; i < bit + count; i++) {
+        if ((_bits[i / 64] >> (i % 64)) & 1) {
+            return false;
+        }
+    }
+    _mark(bit, count, true);
+    if (!_save(bit, count)) {
+        _mark(bit, count, false);
+        return false;
+    }
+    // This could join up with the top of the word before
+    if (bit / 64 < _runHint + 1) {
+        _runHint = (bit / 64 > 0) ? bit / 64 - 1 : 0;
+    }
+    return true;
+}
+
+/**
+ * @return true if block is one of ours and isn't allocated
+ */
+bool RAMEEPROMAllocator::isFree(int block) {
+    if (!_good(block, 1)) {
+        return false;
+    }
+    size_t bit = block - firstBlock();
+    return (_bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+/**
+ * Counts the free runs
+ *
+ * This reads the whole bitmap.
+ */
+void RAMEEPROMAllocator::allocStats(RAMEEPROMAllocStats &stats) {
+    uint64_t carry = 0;
+    size_t run = 0, largest = 0, i;
+    memset(&stats, 0, sizeof(stats));
+    if (_bits == NULL) {
+        return;
+    }
+    for (i = 0; i < _words[0]; i++) {
+        uint64_t word = _bits[i];
+        // A run starts at every set bit with a clear bit below it
+        stats.freeRuns += __builtin_popcountll(word & ~((word << 1) | carry));
+        carry = word >> 63;
+        if (~word == 0) {
+            run += 64;
+            continue;
+        }
+        run += _low(word);
+        if (run > largest) {
+            largest = run;
+        }
+        // The runs inside the word, shifting each one out
+        uint64_t rest = word >> _low(word);
+        while (rest != 0) {
+            rest >>= __builtin_ctzll(rest);
+            size_t ones = _low(rest);
+            if (ones > largest) {
+                largest = ones;
+            }
+            rest = (ones < 64) ? rest >> ones : 0;
+        }
+        run = _high(word);
+    }
+    if (run > largest) {
+        largest = run;
+    }
+    stats.freeBlocks = _free;
+    stats.largestRun = largest;
+    stats.fragmentation = (_free > 0) ? 100 - (100 * largest) / _free : 0;
+}
+
+/**
+ * Sets the summary bit for word of the bitmap, and the ones above it
+ */
+void RAMEEPROMAllocator::_summarize(size_t word) {
+    size_t level;
+    bool any = _bits[word] != 0;
+    for (level = 1; level <= _levels; level++) {
+        uint64_t *summary = &_level(level)[word / 64];
+        uint64_t mask = (uint64_t)1 << (word % 64);
+        if (((*summary & mask) != 0) == any) {
+            return;
+        }
+        *summary ^= mask;
+        any = *summary != 0;
+        word /= 64;
+    }
+}
+
+/**
+ * Sets or clears count bits from bit, keeping the summaries and free count
+ */
+void RAMEEPROMAllocator::_mark(size_t bit, size_t count, bool free) {
+    size_t end = bit + count;
+    while (bit < end) {
+        size_t word = bit / 64;
+        size_t shift = bit % 64;
+        size_t bits = (64 - shift < end - bit) ? 64 - shift : end - bit;
+        uint64_t mask = (bits == 64) ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1) << shift;
+        if (free) {
+            _bits[word] |= mask;
+            _free += bits;
+        } else {
+            _bits[word] &= ~mask;
+            _free -= bits;
+        }
+        _summarize(word);
+        bit += bits;
+    }
+}
+
+/**
+ * Writes the bytes of the bitmap holding count bits from bit
+ */
+bool RAMEEPROMAllocator::_save(size_t bit, size_t count) {
+    size_t first = bit / 8;
+    size_t last = (bit + count - 1) / 8;
+    return _eeprom.writeBytes(_first * _eeprom.blockSize() + first, &((uint8_t *)_bits)[first], last - first + 1);
+}
@@ -0,0 +1,123 @@
+/*
+  RAM_EEPROM_Allocator.h - Bitmap block allocator for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RAM_EEPROM_ALLOCATOR_h
+#define RAM_EEPROM_ALLOCATOR_h
+
+#include "RAM_EEPROM.h"
+
+/**
+ * Free space counts from RAMEEPROMAllocator::allocStats()
+ */
+struct RAMEEPROMAllocStats {
+    uint32_t freeBlocks;    //!< Blocks not allocated
+    uint32_t freeRuns;      //!< Runs of free blocks with used ones between them
+    uint32_t largestRun;    //!< The biggest allocate(count) that would work
+    uint8_t fragmentation;  //!< The percent of free blocks not in the largest run
+};
+
+/**
+ * Hands out blocks of an E2 and keeps track of which are in use
+ *
+ * @code
+ * RAMEEPROMAllocator blocks(EEPROM);
+ * blocks.begin();
+ * int node = blocks.allocate();
+ * int table = blocks.allocate(4);   // 4 blocks in a row
+ * blocks.free(node);
+ * @endcode
+ *
+ * The first blocks of the range hold a bitmap of the rest, one bit a
+ * block, with a 1 for free, so an erased E2 is all free.  Every allocate()
+ * and free() writes the bytes of the bitmap it changed straight away.
+ *
+ * In RAM there is a summary over the bitmap, a bit for each 64 bit word
+ * saying it has a free block, and a summary over that, and so on up to one
+ * word.  A single block is found by following the lowest set bit down
+ * from the top, so it takes a few count trailing zeros however big the E2
+ * is.  Runs are found by scanning the words for enough 1s in a row,
+ * starting after the words that don't have two free blocks together.
+ */
+class RAMEEPROMAllocator {
+public:
+    RAMEEPROMAllocator(RAMEEPROMClass &eeprom, int first = 0, int count = 0);
+    ~RAMEEPROMAllocator();
+
+    bool begin(void);
+    int allocate(void);
+    int allocate(size_t count);
+    bool free(int block, size_t count = 1);
+    bool isFree(int block);
+    void allocStats(RAMEEPROMAllocStats &stats);
+
+    /**
+     * The number of blocks it hands out
+     */
+    size_t blocks(void) {
+        return _blocks;
+    }
+    /**
+     * The first block it hands out.  The bitmap is in the blocks before it.
+     */
+    int firstBlock(void) {
+        return _first + (int)_bitmapBlocks;
+    }
+    size_t freeBlocks(void) {
+        return _free;
+    }
+
+protected:
+    /** The most summary levels above the bitmap, enough for 2^32 blocks */
+    static const size_t _maxLevels = 6;
+
+    RAMEEPROMClass &_eeprom;
+    int _first;
+    int _count;
+    size_t _bitmapBlocks = 0;
+    size_t _blocks = 0;
+    size_t _free = 0;
+    /** The bitmap, then each summary level */
+    uint64_t *_bits = NULL;
+    size_t _words[_maxLevels + 1];
+    size_t _offset[_maxLevels + 1];
+    size_t _levels = 0;
+    /** No run of two free blocks starts in a word before this one */
+    size_t _runHint = 0;
+
+    uint64_t *_level(size_t level) {
+        return &_bits[_offset[level]];
+    }
+    bool _good(int block, size_t count) {
+        return (_bits != NULL) && (block >= firstBlock()) && (count > 0)
+            && ((size_t)(block - firstBlock()) + count <= _blocks);
+    }
+    void _summarize(size_t word);
+    void _mark(size_t bit, size_t count, bool free);
+    bool _save(size_t bit, size_t count);
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMAllocator(const RAMEEPROMAllocator &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMAllocator &operator=(const RAMEEPROMAllocator &other);
+};
+
+#endif // RAM_EEPROM_ALLOCATOR_h
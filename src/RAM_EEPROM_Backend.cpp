@@ -0,0 +1,684 @@
+/*
+  RAM_EEPROM_Backend.cpp - Storage backends for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "RAM_EEPROM_Backend.h"
+#if RAM_EEPROM_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define RAM_EEPROM_URING 1
+#endif
+#endif
+#endif
+#ifndef RAM_EEPROM_URING
+#define RAM_EEPROM_URING 0
+#endif
+
+RAMEEPROMRamBackend::~RAMEEPROMRamBackend()
+{
+    close();
+}
+
+/**
+ * Allocates size bytes, erased to 0xFF
+ */
+bool RAMEEPROMRamBackend::open(size_t size) {
+    close();
+    _data = new uint8_t[size];
+    _size = size;
+    memset(_data, 0xFF, size);
+    return true;
+}
+
+void RAMEEPROMRamBackend::close(void) {
+    delete [] _data;
+    _data = NULL;
+    _size = 0;
+}
+
+bool RAMEEPROMRamBackend::read(size_t address, void *buffer, size_t length) {
+    if ((_data == NULL) || (address > _size) || (length > _size - address)) {
+        return false;
+    }
+    memcpy(buffer, &_data[address], length);
+    return true;
+}
+
+bool RAMEEPROMRamBackend::write(size_t address, const void *buffer, size_t length) {
+    if ((_data == NULL) || (address > _size) || (length > _size - address)) {
+        return false;
+    }
+    memcpy(&_data[address], buffer, length);
+    return true;
+}
+
+#if RAM_EEPROM_POSIX
+RAMEEPROMMappedBackend::~RAMEEPROMMappedBackend()
+{
+    close();
+}
+
+/**
+ * Maps size bytes of fd, growing it if it is shorter.  The new part is
+ * erased to 0xFF.  fd is closed if this fails.
+ *
+ * If extra isn't 0, that many more bytes are mapped from _extra(size) on.
+ * Those start out as 0.
+ */
+bool RAMEEPROMMappedBackend::_map(int fd, size_t size, size_t extra) {
+    size_t length = (extra > 0) ? _extra(size) + extra : size;
+    struct stat st;
+    void *data;
+    if ((fstat(fd, &st) != 0)
+        || (((size_t)st.st_size < length) && (ftruncate(fd, length) != 0))) {
+        ::close(fd);
+        return false;
+    }
+    data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+    _fd = fd;
+    _data = (uint8_t *)data;
+    _size = size;
+    _length = length;
+    if ((size_t)st.st_size < size) {
+        memset(&_data[st.st_size], 0xFF, size - st.st_size);
+    }
+    return true;
+}
+
+void RAMEEPROMMappedBackend::close(void) {
+    if (_fd >= 0) {
+        munmap(_data, _length);
+        ::close(_fd);
+        _fd = -1;
+        _data = NULL;
+        _size = 0;
+        _length = 0;
+    }
+}
+
+bool RAMEEPROMMappedBackend::read(size_t address, void *buffer, size_t length) {
+    if ((_data == NULL) || (address > _size) || (length > _size - address)) {
+        return false;
+    }
+    memcpy(buffer, &_data[address], length);
+    return true;
+}
+
+bool RAMEEPROMMappedBackend::write(size_t address, const void *buffer, size_t length) {
+    if ((_data == NULL) || (address > _size) || (length > _size - address)) {
+        return false;
+    }
+    memcpy(&_data[address], buffer, length);
+    return true;
+}
+
+bool RAMEEPROMMmapBackend::open(size_t size) {
+    int fd;
+    close();
+    if ((_filename == NULL) || (size == 0)) {
+        return false;
+    }
+    fd = ::open(_filename, O_RDWR | O_CREAT, 0666);
+    return (fd >= 0) && _map(fd, size);
+}
+
+/**
+ * Writes the ranges back to the file
+ */
+bool RAMEEPROMMmapBackend::sync(const RAMEEPROMRange *ranges, size_t count) {
+    size_t mask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+    bool ret = true;
+    for (size_t i = 0; i < count; i++) {
+        // msync() wants a page aligned start
+        size_t start = ranges[i].address & ~mask;
+        if (msync(&_data[start], ranges[i].address + ranges[i].length - start, MS_SYNC) != 0) {
+            ret = false;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @param name The shared memory object, like "/eeprom".  It is copied.
+ */
+RAMEEPROMShmBackend::RAMEEPROMShmBackend(const char *name)
+{
+    if (name != NULL) {
+        _name = new char[strlen(name) + 1];
+        strcpy(_name, name);
+    }
+}
+
+RAMEEPROMShmBackend::~RAMEEPROMShmBackend()
+{
+    close();
+    delete [] _name;
+}
+
+/**
+ * Opens the object, creating it if it doesn't exist.  Everything that opens
+ * it has to use the same size, or they won't agree on where shared() is.
+ */
+bool RAMEEPROMShmBackend::open(size_t size) {
+    int fd;
+    close();
+    if ((_name == NULL) || (size == 0)) {
+        return false;
+    }
+    fd = shm_open(_name, O_RDWR | O_CREAT, 0666);
+    return (fd >= 0) && _map(fd, size, RAM_EEPROM_SHARED_SIZE);
+}
+
+/**
+ * Removes the object.  Anything that has it open keeps it until it closes.
+ *
+ * @return true on success
+ */
+bool RAMEEPROMShmBackend::unlink(void) {
+    return (_name != NULL) && (shm_unlink(_name) == 0);
+}
+
+/**
+ * The rings shared with the kernel, mapped from the io_uring fd
+ */
+struct RAMEEPROMFileBackend::_Ring {
+#if RAM_EEPROM_URING
+    int fd;
+    void *sq;
+    size_t sqSize;
+    void *cq;
+    size_t cqSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    struct iovec iov[RAM_EEPROM_FILE_QUEUE];
+#endif
+};
+
+/**
+ * @param filename The image file.  It is created if it doesn't exist, and
+ *                 only used by open().
+ * @param direct   Open it O_DIRECT, if the filesystem can
+ * @param uring    Use io_uring, if the kernel has it
+ */
+RAMEEPROMFileBackend::RAMEEPROMFileBackend(const char *filename, bool direct, bool uring)
+    : _filename(filename), _wantDirect(direct), _wantUring(uring), _spans()
+{
+}
+
+RAMEEPROMFileBackend::~RAMEEPROMFileBackend()
+{
+    close();
+}
+
+/**
+ * Opens the file and reads it in.  If it is shorter than size, the rest
+ * is erased to 0xFF, in the file too.
+ */
+bool RAMEEPROMFileBackend::open(size_t size) {
+    int flags = O_RDWR | O_CREAT;
+    struct stat st;
+    void *data;
+    size_t have = 0;
+    close();
+    if ((_filename == NULL) || (size == 0)) {
+        return false;
+    }
+#ifdef O_DIRECT
+    if (_wantDirect) {
+        _fd = ::open(_filename, flags | O_DIRECT, 0666);
+        _direct = (_fd >= 0);
+    }
+#endif
+    if (_fd < 0) {
+        _fd = ::open(_filename, flags, 0666);
+    }
+    _length = _direct ? (size + RAM_EEPROM_FILE_ALIGN - 1) & ~(size_t)(RAM_EEPROM_FILE_ALIGN - 1) : size;
+    if ((_fd < 0) || (fstat(_fd, &st) != 0)
+        || (posix_memalign(&data, RAM_EEPROM_FILE_ALIGN, _length) != 0)) {
+        close();
+        return false;
+    }
+    _data = (uint8_t *)data;
+    _size = size;
+    // O_DIRECT reads have to be whole aligned blocks, and _length is
+    while (have < _length) {
+        ssize_t got = pread(_fd, &_data[have], _length - have, have);
+        if ((got < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        have += got;
+    }
+    if (have < _length) {
+        memset(&_data[have], 0xFF, _length - have);
+    }
+    if ((size_t)st.st_size < size) {
+        size_t start = (size_t)st.st_size;
+        if (_direct) {
+            start &= ~(size_t)(RAM_EEPROM_FILE_ALIGN - 1);
+        }
+        if (!_pwrite(start, _length - start)) {
+            close();
+            return false;
+        }
+    }
+    if (_wantUring) {
+        _ringOpen();
+    }
+    return true;
+}
+
+void RAMEEPROMFileBackend::close(void) {
+    _ringClose();
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    free(_data);
+    _data = NULL;
+    _size = 0;
+    _length = 0;
+    _direct = false;
+}
+
+bool RAMEEPROMFileBackend::read(size_t address, void *buffer, size_t length) {
+    if ((_data == NULL) || (address > _size) || (length > _size - address)) {
+        return false;
+    }
+    memcpy(buffer, &_data[address], length);
+    return true;
+}
+
+bool RAMEEPROMFileBackend::write(size_t address, const void *buffer, size_t length) {
+    if ((_data == NULL) || (address > _size) || (length > _size - address)) {
+        return false;
+    }
+    memcpy(&_data[address], buffer, length);
+    return true;
+}
+
+/**
+ * Snapshots the counters.  This is safe while the flusher thread of an
+ * async E2 is in sync().
+ */
+void RAMEEPROMFileBackend::fileStats(RAMEEPROMFileStats &stats) {
+    stats.syncs = __atomic_load_n(&_stats.syncs, __ATOMIC_RELAXED);
+    stats.writes = __atomic_load_n(&_stats.writes, __ATOMIC_RELAXED);
+    stats.syscalls = __atomic_load_n(&_stats.syscalls, __ATOMIC_RELAXED);
+    stats.bytes = __atomic_load_n(&_stats.bytes, __ATOMIC_RELAXED);
+}
+
+void RAMEEPROMFileBackend::clearFileStats(void) {
+    __atomic_store_n(&_stats.syncs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&_stats.writes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&_stats.syscalls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&_stats.bytes, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Writes the ranges to the file, joined up, then fdatasync()s it
+ *
+ * The ranges are expected in address order, as commit() gives them.
+ */
+bool RAMEEPROMFileBackend::sync(const RAMEEPROMRange *ranges, size_t count) {
+    const size_t most = sizeof(_spans) / sizeof(_spans[0]);
+    size_t spans = 0;
+    bool ret = true;
+    if (_data == NULL) {
+        return false;
+    }
+    _count(_stats.syncs, 1);
+    for (size_t i = 0; i < count; i++) {
+        size_t start = ranges[i].address;
+        size_t end = start + ranges[i].length;
+        if ((start > _size) || (ranges[i].length > _size - start)) {
+            ret = false;
+            continue;
+        }
+        if (_direct) {
+            start &= ~(size_t)(RAM_EEPROM_FILE_ALIGN - 1);
+            end = (end + RAM_EEPROM_FILE_ALIGN - 1) & ~(size_t)(RAM_EEPROM_FILE_ALIGN - 1);
+        }
+        if (spans > 0) {
+            RAMEEPROMRange &last = _spans[spans - 1];
+            size_t lastEnd = last.address + last.length;
+            if ((start >= last.address) && (start <= lastEnd + RAM_EEPROM_FILE_GAP)) {
+                if (end > lastEnd) {
+                    last.length = end - last.address;
+                }
+                continue;
+            }
+            if (spans == most) {
+                ret = _write(spans, false) && ret;
+                spans = 0;
+            }
+        }
+        _spans[spans].address = start;
+        _spans[spans].length = end - start;
+        spans++;
+    }
+    if (spans > 0) {
+        ret = _write(spans, true) && ret;
+    }
+    return ret;
+}
+
+/**
+ * Makes the first count writes in _spans, and fdatasync()s the file after
+ * them if datasync is set
+ */
+bool RAMEEPROMFileBackend::_write(size_t count, bool datasync) {
+    bool ret = true;
+    for (size_t i = 0; i < count; i++) {
+        _count(_stats.writes, 1);
+        _count(_stats.bytes, _spans[i].length);
+    }
+    if (_ring != NULL) {
+        return _ringWrite(count, datasync);
+    }
+    for (size_t i = 0; i < count; i++) {
+        ret = _pwrite(_spans[i].address, _spans[i].length) && ret;
+    }
+    if (datasync) {
+        _count(_stats.syscalls, 1);
+        ret = (fdatasync(_fd) == 0) && ret;
+    }
+    return ret;
+}
+
+/**
+ * Writes length bytes of _data at address, however many calls it takes
+ *
+ * With O_DIRECT a partial write is only counted to the last whole
+ * RAM_EEPROM_FILE_ALIGN block, so the next call is aligned too.
+ */
+bool RAMEEPROMFileBackend::_pwrite(size_t address, size_t length) {
+    while (length > 0) {
+        ssize_t done = pwrite(_fd, &_data[address], length, address);
+        _count(_stats.syscalls, 1);
+        if ((done < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (_direct && (done > 0)) {
+            done &= ~(ssize_t)(RAM_EEPROM_FILE_ALIGN - 1);
+        }
+        if (done <= 0) {
+            return false;
+        }
+        address += done;
+        length -= done;
+    }
+    return true;
+}
+
+#if RAM_EEPROM_URING
+/**
+ * Sets up an io_uring.  If the kernel won't, sync() uses pwrite().
+ *
+ * @return true if there is a ring
+ */
+bool RAMEEPROMFileBackend::_ringOpen(void) {
+    struct io_uring_params params;
+    _Ring *ring;
+    int fd;
+    memset(&params, 0, sizeof(params));
+    fd = (int)syscall(__NR_io_uring_setup, RAM_EEPROM_FILE_QUEUE, &params);
+    if (fd < 0) {
+        return false;
+    }
+    ring = new _Ring();
+    ring->fd = fd;
+    ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqSize > ring->sqSize) {
+            ring->sqSize = ring->cqSize;
+        }
+        ring->cqSize = 0;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq = (ring->cqSize == 0) ? ring->sq
+        : mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    _ring = ring;
+    if ((ring->sq == MAP_FAILED) || (ring->cq == MAP_FAILED) || (ring->sqes == MAP_FAILED)) {
+        _ringClose();
+        return false;
+    }
+    uint8_t *sq = (uint8_t *)ring->sq;
+    uint8_t *cq = (uint8_t *)ring->cq;
+    ring->sqTail = (unsigned *)&sq[params.sq_off.tail];
+    ring->sqMask = (unsigned *)&sq[params.sq_off.ring_mask];
+    ring->sqArray = (unsigned *)&sq[params.sq_off.array];
+    ring->cqHead = (unsigned *)&cq[params.cq_off.head];
+    ring->cqTail = (unsigned *)&cq[params.cq_off.tail];
+    ring->cqMask = (unsigned *)&cq[params.cq_off.ring_mask];
+    ring->cqes = (struct io_uring_cqe *)&cq[params.cq_off.cqes];
+    return true;
+}
+
+void RAMEEPROMFileBackend::_ringClose(void) {
+    if (_ring == NULL) {
+        return;
+    }
+    if ((_ring->sqes != NULL) && (_ring->sqes != MAP_FAILED)) {
+        munmap(_ring->sqes, _ring->sqesSize);
+    }
+    if ((_ring->cq != NULL) && (_ring->cq != MAP_FAILED) && (_ring->cq != _ring->sq)) {
+        munmap(_ring->cq, _ring->cqSize);
+    }
+    if ((_ring->sq != NULL) && (_ring->sq != MAP_FAILED)) {
+        munmap(_ring->sq, _ring->sqSize);
+    }
+    ::close(_ring->fd);
+    delete _ring;
+    _ring = NULL;
+}
+
+/**
+ * Queues the writes, and the fdatasync() to run after all of them, and
+ * makes one io_uring_enter() to submit them and wait for them.
+ *
+ * A short write is finished off with pwrite() once everything in the ring
+ * is done.  The fdatasync() in the ring has already run by then, so it
+ * doesn't cover what pwrite() wrote, and a second fdatasync() is made.  If
+ * io_uring_enter() fails, the ring is dropped and every write that hasn't
+ * completed goes the same way.
+ */
+bool RAMEEPROMFileBackend::_ringWrite(size_t count, bool datasync) {
+    unsigned tail = *_ring->sqTail;
+    unsigned mask = *_ring->sqMask;
+    unsigned submit = (unsigned)count + (datasync ? 1 : 0);
+    unsigned done = 0;
+    // What is still to be written of each span
+    size_t left[RAM_EEPROM_FILE_QUEUE];
+    bool more = false;
+    bool synced = !datasync;
+    bool ret = true;
+    for (size_t i = 0; i < submit; i++, tail++) {
+        unsigned index = tail & mask;
+        struct io_uring_sqe *sqe = &_ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = _fd;
+        sqe->user_data = i;
+        if (i < count) {
+            left[i] = _spans[i].length;
+            _ring->iov[i].iov_base = &_data[_spans[i].address];
+            _ring->iov[i].iov_len = _spans[i].length;
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->addr = (uint64_t)(uintptr_t)&_ring->iov[i];
+            sqe->len = 1;
+            sqe->off = _spans[i].address;
+        } else {
+            // Not started until the writes are done
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->flags = IOSQE_IO_DRAIN;
+        }
+        _ring->sqArray[index] = index;
+    }
+    __atomic_store_n(_ring->sqTail, tail, __ATOMIC_RELEASE);
+    unsigned toSubmit = submit;
+    unsigned head = *_ring->cqHead;
+    while (done < submit) {
+        if (head == __atomic_load_n(_ring->cqTail, __ATOMIC_ACQUIRE)) {
+            long entered = syscall(__NR_io_uring_enter, _ring->fd, toSubmit, submit - done, IORING_ENTER_GETEVENTS, NULL, 0);
+            _count(_stats.syscalls, 1);
+            if (entered < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Give up on the ring.  Writing again what the kernel may
+                // still have in flight only puts the same bytes there.
+                _ringClose();
+                break;
+            }
+            toSubmit -= (unsigned)entered;
+            continue;
+        }
+        struct io_uring_cqe *cqe = &_ring->cqes[head & *_ring->cqMask];
+        size_t i = (size_t)cqe->user_data;
+        if (i >= count) {
+            synced = true;
+        }
+        if (cqe->res < 0) {
+            ret = false;
+            if (i < count) {
+                left[i] = 0;
+            }
+        } else if (i < count) {
+            size_t written = (size_t)cqe->res;
+            if (_direct) {
+                // The rest has to start on a block too
+                written &= ~(size_t)(RAM_EEPROM_FILE_ALIGN - 1);
+            }
+            left[i] = (written < left[i]) ? left[i] - written : 0;
+        }
+        head++;
+        done++;
+        __atomic_store_n(_ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (left[i] > 0) {
+            more = true;
+            ret = _pwrite(_spans[i].address + _spans[i].length - left[i], left[i]) && ret;
+        }
+    }
+    if (!synced || (datasync && more)) {
+        _count(_stats.syscalls, 1);
+        ret = (fdatasync(_fd) == 0) && ret;
+    }
+    return ret;
+}
+#else
+bool RAMEEPROMFileBackend::_ringOpen(void) {
+    return false;
+}
+
+void RAMEEPROMFileBackend::_ringClose(void) {
+}
+
+bool RAMEEPROMFileBackend::_ringWrite(size_t count, bool datasync) {
+    return false;
+}
+#endif
+#endif
+
+RAMEEPROMSlowBackend::~RAMEEPROMSlowBackend()
+{
+    close();
+}
+
+/**
+ * Sets up a device of size bytes, erased to 0xFF
+ */
+bool RAMEEPROMSlowBackend::open(size_t size) {
+    close();
+    _memory = new uint8_t[size];
+    _size = size;
+    memset(_memory, 0xFF, size);
+    return true;
+}
+
+void RAMEEPROMSlowBackend::close(void) {
+    delete [] _memory;
+    _memory = NULL;
+    _size = 0;
+}
+
+/**
+ * One read command, then length bytes
+ */
+bool RAMEEPROMSlowBackend::read(size_t address, void *buffer, size_t length) {
+    if (!_good(address, length)) {
+        return false;
+    }
+    _stats.reads++;
+    _stats.bytesRead += length;
+    _stats.time += _config.commandTime + (uint64_t)length * _config.byteTime;
+    memcpy(buffer, &_memory[address], length);
+    return true;
+}
+
+/**
+ * A write command and a write cycle for each page touched
+ */
+bool RAMEEPROMSlowBackend::write(size_t address, const void *buffer, size_t length) {
+    const uint8_t *data = (const uint8_t *)buffer;
+    if (!_good(address, length)) {
+        return false;
+    }
+    while (length > 0) {
+        size_t count = length;
+        if (_config.pageSize > 0) {
+            size_t room = _config.pageSize - (address % _config.pageSize);
+            count = (room < length) ? room : length;
+        }
+        _stats.writes++;
+        _stats.bytesWritten += count;
+        _stats.time += _config.commandTime + (uint64_t)count * _config.byteTime + _config.writeTime;
+        memcpy(&_memory[address], data, count);
+        address += count;
+        data += count;
+        length -= count;
+    }
+    return true;
+}
@@ -0,0 +1,357 @@
+/*
+  RAM_EEPROM_Backend.h - Storage backends for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RAM_EEPROM_BACKEND_h
+#define RAM_EEPROM_BACKEND_h
+
+#include "RAM_EEPROM.h"
+
+/**
+ * Plain RAM
+ *
+ * This is what RAMEEPROMClass does on its own.  It is here for the places
+ * that want a backend object, like a cache in front of it.
+ */
+class RAMEEPROMRamBackend final : public RAMEEPROMBackend {
+public:
+    RAMEEPROMRamBackend() {}
+    ~RAMEEPROMRamBackend();
+
+    bool open(size_t size) override;
+    void close(void) override;
+    uint8_t *data(void) override {
+        return _data;
+    }
+    bool read(size_t address, void *buffer, size_t length) override;
+    bool write(size_t address, const void *buffer, size_t length) override;
+
+protected:
+    uint8_t *_data = NULL;
+    size_t _size = 0;
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMRamBackend(const RAMEEPROMRamBackend &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMRamBackend &operator=(const RAMEEPROMRamBackend &other);
+};
+
+#if RAM_EEPROM_POSIX
+/**
+ * Anything that can be mapped from a file descriptor
+ */
+class RAMEEPROMMappedBackend : public RAMEEPROMBackend {
+public:
+    RAMEEPROMMappedBackend() {}
+    ~RAMEEPROMMappedBackend();
+
+    void close(void) override;
+    uint8_t *data(void) override {
+        return _data;
+    }
+    bool read(size_t address, void *buffer, size_t length) override;
+    bool write(size_t address, const void *buffer, size_t length) override;
+
+protected:
+    int _fd = -1;
+    uint8_t *_data = NULL;
+    size_t _size = 0;
+    /** The whole mapping, which can go past _size */
+    size_t _length = 0;
+
+    bool _map(int fd, size_t size, size_t extra = 0);
+    /** Where the extra bytes _map() was asked for start */
+    static size_t _extra(size_t size) {
+        return (size + 63) & ~(size_t)63;
+    }
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMMappedBackend(const RAMEEPROMMappedBackend &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMMappedBackend &operator=(const RAMEEPROMMappedBackend &other);
+};
+
+/**
+ * An image file, mapped
+ *
+ * Nothing is read at startup and pages are faulted in as they are touched.
+ * sync() msync()s the ranges it is given.
+ */
+class RAMEEPROMMmapBackend final : public RAMEEPROMMappedBackend {
+public:
+    /**
+     * @param filename The image file.  It is created if it doesn't exist,
+     *                 and only used by open().
+     */
+    RAMEEPROMMmapBackend(const char *filename) : _filename(filename) {}
+
+    bool open(size_t size) override;
+    bool sync(const RAMEEPROMRange *ranges, size_t count) override;
+
+protected:
+    const char *_filename;
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMMmapBackend(const RAMEEPROMMmapBackend &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMMmapBackend &operator=(const RAMEEPROMMmapBackend &other);
+};
+
+/**
+ * A POSIX shared memory object, so E2s in different processes can map the
+ * same bytes
+ *
+ * @code
+ * RAMEEPROMShmBackend shared("/eeprom");
+ * RAMEEPROMClass EEPROM(shared, 4096, 32);
+ * EEPROM.concurrent();
+ * @endcode
+ *
+ * The object has RAM_EEPROM_SHARED_SIZE bytes after the E2 for shared(),
+ * so E2s in concurrent mode take the same seqlocks whatever process they
+ * are in, and get() and put() are never torn across processes.  A process
+ * that dies while it holds a stripe leaves it held.
+ *
+ * The object stays around after the last process closes it, until
+ * unlink() is called.
+ */
+class RAMEEPROMShmBackend final : public RAMEEPROMMappedBackend {
+public:
+    RAMEEPROMShmBackend(const char *name);
+    ~RAMEEPROMShmBackend();
+
+    bool open(size_t size) override;
+    uint8_t *shared(void) override {
+        return (_data != NULL) ? &_data[_extra(_size)] : NULL;
+    }
+    bool unlink(void);
+
+protected:
+    char *_name = NULL;
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMShmBackend(const RAMEEPROMShmBackend &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMShmBackend &operator=(const RAMEEPROMShmBackend &other);
+};
+
+#ifndef RAM_EEPROM_FILE_GAP
+/** Dirty ranges of a RAMEEPROMFileBackend closer than this are written as one */
+#define RAM_EEPROM_FILE_GAP 256
+#endif
+#ifndef RAM_EEPROM_FILE_ALIGN
+/** The buffer and write alignment of a RAMEEPROMFileBackend with O_DIRECT */
+#define RAM_EEPROM_FILE_ALIGN 4096
+#endif
+/** The most writes a RAMEEPROMFileBackend submits to io_uring at once */
+#define RAM_EEPROM_FILE_QUEUE 32
+
+/**
+ * Counters from RAMEEPROMFileBackend::fileStats()
+ */
+struct RAMEEPROMFileStats {
+    uint32_t syncs;         //!< sync() calls
+    uint32_t writes;        //!< Writes to the file, after joining ranges
+    uint32_t syscalls;      //!< System calls sync() made
+    uint64_t bytes;         //!< Bytes written to the file
+};
+
+/**
+ * An image file, read into RAM by open() and written back by sync()
+ *
+ * @code
+ * RAMEEPROMFileBackend file("eeprom.bin");
+ * RAMEEPROMClass EEPROM(file, 65536, 64);
+ * @endcode
+ *
+ * data() is the copy in RAM, so the E2 works at the speed of RAM.  sync()
+ * joins ranges less than RAM_EEPROM_FILE_GAP apart into one write, clean
+ * bytes and all, as they are the same in the file.  Where Linux has
+ * io_uring the writes and an fdatasync() behind them go to the kernel in
+ * one io_uring_enter().  Otherwise it is a pwrite() for each write, then
+ * fdatasync().
+ *
+ * With direct the file is opened O_DIRECT, so writes skip the page cache.
+ * The buffer is aligned to RAM_EEPROM_FILE_ALIGN and writes are rounded out
+ * to it, so no bounce buffer is needed.  If the filesystem won't do
+ * O_DIRECT it is opened without it, and direct() says so.
+ */
+class RAMEEPROMFileBackend final : public RAMEEPROMBackend {
+public:
+    RAMEEPROMFileBackend(const char *filename, bool direct = false, bool uring = true);
+    ~RAMEEPROMFileBackend();
+
+    bool open(size_t size) override;
+    void close(void) override;
+    uint8_t *data(void) override {
+        return _data;
+    }
+    bool read(size_t address, void *buffer, size_t length) override;
+    bool write(size_t address, const void *buffer, size_t length) override;
+    bool sync(const RAMEEPROMRange *ranges, size_t count) override;
+
+    /**
+     * true if the file is open O_DIRECT
+     */
+    bool direct(void) {
+        return _direct;
+    }
+    /**
+     * true if sync() is using io_uring
+     */
+    bool uring(void) {
+        return _ring != NULL;
+    }
+    void fileStats(RAMEEPROMFileStats &stats);
+    void clearFileStats(void);
+
+protected:
+    struct _Ring;
+
+    const char *_filename;
+    bool _wantDirect;
+    bool _wantUring;
+    bool _direct = false;
+    int _fd = -1;
+    uint8_t *_data = NULL;
+    size_t _size = 0;
+    /** _size, rounded up to RAM_EEPROM_FILE_ALIGN with O_DIRECT */
+    size_t _length = 0;
+    _Ring *_ring = NULL;
+    RAMEEPROMFileStats _stats = RAMEEPROMFileStats();
+    /** The writes sync() has joined up and not made yet */
+    RAMEEPROMRange _spans[RAM_EEPROM_FILE_QUEUE - 1];
+
+    /*
+     * In async mode sync() runs on the flusher thread while fileStats() and
+     * clearFileStats() can be called from any other, so the counters are
+     * only touched atomically.
+     */
+    void _count(uint32_t &counter, uint32_t n)
+    {
+        __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+    }
+    void _count(uint64_t &counter, uint64_t n)
+    {
+        __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+    }
+
+    bool _write(size_t count, bool datasync);
+    bool _pwrite(size_t address, size_t length);
+    bool _ringOpen(void);
+    void _ringClose(void);
+    bool _ringWrite(size_t count, bool datasync);
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMFileBackend(const RAMEEPROMFileBackend &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMFileBackend &operator=(const RAMEEPROMFileBackend &other);
+};
+#endif
+
+/**
+ * The timing of the device in RAMEEPROMSlowBackend
+ */
+struct RAMEEPROMSlowConfig {
+    size_t pageSize;        //!< A write can't cross a page.  0 for no pages.
+    uint32_t commandTime;   //!< Virtual time for each read or write command
+    uint32_t byteTime;      //!< Virtual time for each byte on the bus
+    uint32_t writeTime;     //!< Virtual time for each page write cycle
+};
+
+/**
+ * Counters from RAMEEPROMSlowBackend::slowStats()
+ */
+struct RAMEEPROMSlowStats {
+    uint32_t reads;         //!< Read commands
+    uint32_t writes;        //!< Write commands, one for each page written
+    uint64_t bytesRead;     //!< Bytes read over the bus
+    uint64_t bytesWritten;  //!< Bytes written over the bus
+    uint64_t time;          //!< Virtual time spent on the bus and writing
+};
+
+/**
+ * A simulated serial E2, like a 24LC256 on I2C
+ *
+ * It has no data(), so every access the E2 makes is a command on the
+ * bus, and writes are split at page boundaries, with a write cycle for
+ * each page.  Time is counted, not spent, the same way as flash mode.
+ *
+ * @code
+ * RAMEEPROMSlowConfig config = { 64, 100, 25, 5000 };
+ * RAMEEPROMSlowBackend device(config);
+ * RAMEEPROMClass EEPROM(device, 32768, 64);
+ * @endcode
+ */
+class RAMEEPROMSlowBackend final : public RAMEEPROMBackend {
+public:
+    RAMEEPROMSlowBackend(const RAMEEPROMSlowConfig &config) : _config(config) {}
+    ~RAMEEPROMSlowBackend();
+
+    bool open(size_t size) override;
+    void close(void) override;
+    bool read(size_t address, void *buffer, size_t length) override;
+    bool write(size_t address, const void *buffer, size_t length) override;
+
+    void slowStats(RAMEEPROMSlowStats &stats) {
+        stats = _stats;
+    }
+    void clearSlowStats(void) {
+        _stats = RAMEEPROMSlowStats();
+    }
+
+protected:
+    RAMEEPROMSlowConfig _config;
+    RAMEEPROMSlowStats _stats = RAMEEPROMSlowStats();
+    uint8_t *_memory = NULL;
+    size_t _size = 0;
+
+    bool _good(size_t address, size_t length) {
+        return (_memory != NULL) && (address <= _size) && (length <= _size - address);
+    }
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMSlowBackend(const RAMEEPROMSlowBackend &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMSlowBackend &operator=(const RAMEEPROMSlowBackend &other);
+};
+
+#endif // RAM_EEPROM_BACKEND_h
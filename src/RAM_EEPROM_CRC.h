@@ -0,0 +1,40 @@
+/*
+  RAM_EEPROM_CRC.h - CRC32C for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RAM_EEPROM_CRC_h
+#define RAM_EEPROM_CRC_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC32C (Castagnoli) of length bytes of data
+ *
+ * Pass the CRC of what came before as crc to continue it, so
+ * RAMEEPROMCrc32c(b, n, RAMEEPROMCrc32c(a, m)) is the CRC of a then b.
+ * This uses the SSE4.2 or ARMv8 crc32 instructions when the CPU has them,
+ * and slicing-by-8 tables otherwise.
+ */
+uint32_t RAMEEPROMCrc32c(const void *data, size_t length, uint32_t crc = 0);
+
+/**
+ * true if RAMEEPROMCrc32c() is using CRC instructions
+ */
+bool RAMEEPROMCrc32cHardware(void);
+
+#endif // RAM_EEPROM_CRC_h
@@ -0,0 +1,326 @@
+/*
+  RAM_EEPROM_Cache.cpp - Write-back block cache in front of a backend
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdlib.h>
+#include "RAM_EEPROM_Cache.h"
+
+/** The fewest lines sync() will join into one write() */
+#define RAM_EEPROM_CACHE_JOIN 8
+
+/**
+ * @param backend  What is being cached.  It is opened and closed with this.
+ * @param lines    The number of lines kept in RAM
+ * @param lineSize The bytes in a line.  The E2 block size, or the page size
+ *                 of the device, is a good choice.
+ * @param prefetch The lines to read ahead of a sequential run.  0 turns it
+ *                 off.  It is held to half the lines.
+ */
+RAMEEPROMCacheBackend::RAMEEPROMCacheBackend(RAMEEPROMBackend &backend, size_t lines, size_t lineSize, size_t prefetch)
+    : _backend(backend), _lines(lines), _lineSize(lineSize), _prefetch(prefetch)
+{
+    if (_prefetch > _lines / 2) {
+        _prefetch = _lines / 2;
+    }
+}
+
+RAMEEPROMCacheBackend::~RAMEEPROMCacheBackend()
+{
+    close();
+}
+
+/**
+ * Opens the backend and sets up the lines, all empty
+ */
+bool RAMEEPROMCacheBackend::open(size_t size) {
+    close();
+    if ((_lines == 0) || (_lineSize == 0) || (size == 0) || !_backend.open(size)) {
+        return false;
+    }
+    _size = size;
+    _count = (size + _lineSize - 1) / _lineSize;
+    _slotOf = new uint32_t[_count];
+    for (size_t line = 0; line < _count; line++) {
+        _slotOf[line] = _none;
+    }
+    _slots = new _Slot[_lines]();
+    _data = new uint8_t[_lines * _lineSize];
+    _bounceLines = (_prefetch > RAM_EEPROM_CACHE_JOIN) ? _prefetch : RAM_EEPROM_CACHE_JOIN;
+    _bounce = new uint8_t[_bounceLines * _lineSize];
+    _order = new size_t[_lines];
+    _hand = 0;
+    _last = _none;
+    _run = 0;
+    return true;
+}
+
+/**
+ * Writes back anything dirty, then closes the backend
+ */
+void RAMEEPROMCacheBackend::close(void) {
+    if (_slots == NULL) {
+        return;
+    }
+    _flush();
+    _backend.close();
+    delete [] _slotOf;
+    delete [] _slots;
+    delete [] _data;
+    delete [] _bounce;
+    delete [] _order;
+    _slotOf = NULL;
+    _slots = NULL;
+    _data = NULL;
+    _bounce = NULL;
+    _order = NULL;
+    _size = 0;
+    _count = 0;
+}
+
+bool RAMEEPROMCacheBackend::read(size_t address, void *buffer, size_t length) {
+    uint8_t *out = (uint8_t *)buffer;
+    if ((_slots == NULL) || (address > _size) || (length > _size - address)) {
+        return false;
+    }
+    while (length > 0) {
+        size_t line = address / _lineSize;
+        size_t offset = address % _lineSize;
+        size_t count = (_lineSize - offset < length) ? _lineSize - offset : length;
+        bool ok = true;
+        uint32_t slot = _find(line, true, ok);
+        if (!ok) {
+            return false;
+        }
+        memcpy(out, &_line(slot)[offset], count);
+        _used(line, true);
+        address += count;
+        out += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Only changes the cached lines.  They are written back by sync(), or when
+ * they are evicted.
+ */
+bool RAMEEPROMCacheBackend::write(size_t address, const void *buffer, size_t length) {
+    const uint8_t *in = (const uint8_t *)buffer;
+    if ((_slots == NULL) || (address > _size) || (length > _size - address)) {
+        return false;
+    }
+    while (length > 0) {
+        size_t line = address / _lineSize;
+        size_t offset = address % _lineSize;
+        size_t count = (_lineSize - offset < length) ? _lineSize - offset : length;
+        // A line that is all overwritten doesn't need reading first
+        bool whole = (offset == 0) && (count == _length(line));
+        bool ok = true;
+        uint32_t slot = _find(line, !whole, ok);
+        if (!ok) {
+            return false;
+        }
+        memcpy(&_line(slot)[offset], in, count);
+        _slots[slot].dirty = true;
+        _used(line, !whole);
+        address += count;
+        in += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Writes back every dirty line, then passes the ranges on to the backend
+ */
+bool RAMEEPROMCacheBackend::sync(const RAMEEPROMRange *ranges, size_t count) {
+    if (_slots == NULL) {
+        return false;
+    }
+    bool ret = _flush();
+    return _backend.sync(ranges, count) && ret;
+}
+
+/**
+ * Writes back the dirty lines in address order, joining neighbours
+ *
+ * @return true if every write worked
+ */
+bool RAMEEPROMCacheBackend::_flush(void) {
+    size_t dirty = 0;
+    bool ret = true;
+    for (size_t slot = 0; slot < _lines; slot++) {
+        if (_slots[slot].valid && _slots[slot].dirty) {
+            _order[dirty++] = _slots[slot].line;
+        }
+    }
+    qsort(_order, dirty, sizeof(size_t), _compare);
+    for (size_t i = 0; i < dirty;) {
+        size_t count = 1;
+        while ((i + count < dirty) && (count < _bounceLines)
+            && (_order[i + count] == _order[i] + count)) {
+            count++;
+        }
+        ret = _writeBack(_order[i], count) && ret;
+        i += count;
+    }
+    return ret;
+}
+
+int RAMEEPROMCacheBackend::_compare(const void *a, const void *b) {
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Writes count cached lines, starting at line, with one write()
+ */
+bool RAMEEPROMCacheBackend::_writeBack(size_t line, size_t count) {
+    const uint8_t *data = _line(_slotOf[line]);
+    size_t length = 0;
+    if (count > 1) {
+        for (size_t i = 0; i < count; i++) {
+            memcpy(&_bounce[length], _line(_slotOf[line + i]), _length(line + i));
+            length += _length(line + i);
+        }
+        data = _bounce;
+    } else {
+        length = _length(line);
+    }
+    _stats.writeBacks++;
+    if (!_backend.write(line * _lineSize, data, length)) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        _slots[_slotOf[line + i]].dirty = false;
+    }
+    return true;
+}
+
+/**
+ * Finds the slot holding line, making room for it if it isn't cached
+ *
+ * @param line The line of the E2
+ * @param fill Read the line from the backend if it isn't cached
+ * @param ok   Set to false if a read or write back failed
+ *
+ * @return The slot
+ */
+uint32_t RAMEEPROMCacheBackend::_find(size_t line, bool fill, bool &ok) {
+    uint32_t slot = _slotOf[line];
+    if (slot != _none) {
+        _stats.hits++;
+        if (_slots[slot].prefetched) {
+            _stats.prefetchHits++;
+            _slots[slot].prefetched = false;
+        }
+        _slots[slot].used = true;
+        return slot;
+    }
+    _stats.misses++;
+    slot = _victim(ok);
+    if (!ok) {
+        return _none;
+    }
+    if (fill && !_backend.read(line * _lineSize, _line(slot), _length(line))) {
+        ok = false;
+        return _none;
+    }
+    _slots[slot].line = line;
+    _slots[slot].valid = true;
+    _slots[slot].dirty = false;
+    _slots[slot].used = true;
+    _slots[slot].prefetched = false;
+    _slotOf[line] = slot;
+    return slot;
+}
+
+/**
+ * Moves the hand round to a slot that is empty or hasn't been used since
+ * the hand last passed it, and empties it
+ */
+uint32_t RAMEEPROMCacheBackend::_victim(bool &ok) {
+    for (;;) {
+        uint32_t slot = (uint32_t)_hand;
+        _Slot &victim = _slots[slot];
+        _hand = (_hand + 1) % _lines;
+        if (!victim.valid) {
+            return slot;
+        }
+        if (victim.used) {
+            victim.used = false;
+            continue;
+        }
+        if (victim.dirty && !_writeBack(victim.line, 1)) {
+            ok = false;
+            return _none;
+        }
+        _slotOf[victim.line] = _none;
+        victim.valid = false;
+        _stats.evictions++;
+        return slot;
+    }
+}
+
+/**
+ * Keeps track of sequential runs, and reads ahead of them
+ *
+ * When two lines in a row have been used and the next one isn't cached,
+ * the lines after it that aren't cached are read in one read().
+ *
+ * @param line      The line just used
+ * @param readAhead false if this use doesn't need reading ahead for
+ */
+void RAMEEPROMCacheBackend::_used(size_t line, bool readAhead) {
+    if (line == _last) {
+        return;
+    }
+    _run = ((_last != _none) && (line == _last + 1)) ? _run + 1 : 0;
+    _last = line;
+    size_t first = line + 1;
+    if (!readAhead || (_run == 0) || (_prefetch == 0)
+        || (first >= _count) || (_slotOf[first] != _none)) {
+        return;
+    }
+    size_t count = 1;
+    while ((count < _prefetch) && (first + count < _count) && (_slotOf[first + count] == _none)) {
+        count++;
+    }
+    size_t end = first + count - 1;
+    size_t length = end * _lineSize + _length(end) - first * _lineSize;
+    // A failed read ahead costs nothing but the time
+    if (!_backend.read(first * _lineSize, _bounce, length)) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        bool ok = true;
+        uint32_t slot = _victim(ok);
+        if (!ok) {
+            return;
+        }
+        memcpy(_line(slot), &_bounce[i * _lineSize], _length(first + i));
+        _slots[slot].line = first + i;
+        _slots[slot].valid = true;
+        _slots[slot].dirty = false;
+        // Or the hand could come round to it before the rest are in
+        _slots[slot].used = true;
+        _slots[slot].prefetched = true;
+        _slotOf[first + i] = slot;
+        _stats.prefetches++;
+    }
+}
@@ -0,0 +1,138 @@
+/*
+  RAM_EEPROM_Cache.h - Write-back block cache in front of a backend
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RAM_EEPROM_CACHE_h
+#define RAM_EEPROM_CACHE_h
+
+#include "RAM_EEPROM.h"
+
+/**
+ * Counters from RAMEEPROMCacheBackend::cacheStats()
+ *
+ * The hit rate is hits / (hits + misses).  A prefetch that was never used
+ * before it was evicted is prefetches - prefetchHits.
+ */
+struct RAMEEPROMCacheStats {
+    uint32_t hits;          //!< Line lookups that found the line
+    uint32_t misses;        //!< Line lookups that had to read or allocate it
+    uint32_t prefetches;    //!< Lines read ahead of a sequential run
+    uint32_t prefetchHits;  //!< Prefetched lines that were used
+    uint32_t evictions;     //!< Lines thrown out to make room
+    uint32_t writeBacks;    //!< write() calls made to the backend behind
+};
+
+/**
+ * Keeps lines of a slow backend in RAM, and writes them back later
+ *
+ * @code
+ * RAMEEPROMSlowBackend device(config);
+ * RAMEEPROMCacheBackend cache(device, 32, 64);    // 32 lines of 64 bytes
+ * RAMEEPROMClass EEPROM(cache, 32768, 64);
+ * @endcode
+ *
+ * Reads and writes work on whole lines.  A line that isn't cached is read
+ * from the backend, unless a write covers all of it.  Writes only change
+ * the cached line, so many writes to the same line cost one write back.
+ * Dirty lines go back to the backend when they are evicted and on sync(),
+ * which the E2 calls from commit().  sync() writes them in address order
+ * and joins neighbouring lines into one write().
+ *
+ * Eviction is CLOCK: each line has a bit that is set when it is used, and
+ * the hand goes round clearing them until it finds a line that hasn't been
+ * used since it last went past.  When lines are used one after another,
+ * the next few are read ahead in a single read(), so a sequential scan
+ * mostly hits.  Read ahead lines start with their bit set, the same as a
+ * line that was just used.
+ *
+ * It has no data(), so the E2 can't use concurrent() with it.
+ */
+class RAMEEPROMCacheBackend final : public RAMEEPROMBackend {
+public:
+    RAMEEPROMCacheBackend(RAMEEPROMBackend &backend, size_t lines, size_t lineSize, size_t prefetch = 4);
+    ~RAMEEPROMCacheBackend();
+
+    bool open(size_t size) override;
+    void close(void) override;
+    bool read(size_t address, void *buffer, size_t length) override;
+    bool write(size_t address, const void *buffer, size_t length) override;
+    bool sync(const RAMEEPROMRange *ranges, size_t count) override;
+
+    void cacheStats(RAMEEPROMCacheStats &stats) {
+        stats = _stats;
+    }
+    void clearCacheStats(void) {
+        _stats = RAMEEPROMCacheStats();
+    }
+
+protected:
+    /** Marks a line of the E2 that isn't cached */
+    static const uint32_t _none = 0xFFFFFFFF;
+
+    struct _Slot {
+        size_t line;
+        bool valid;
+        bool dirty;
+        bool used;
+        bool prefetched;
+    };
+
+    RAMEEPROMBackend &_backend;
+    size_t _lines;
+    size_t _lineSize;
+    size_t _prefetch;
+    size_t _size = 0;
+    RAMEEPROMCacheStats _stats = RAMEEPROMCacheStats();
+    _Slot *_slots = NULL;
+    uint8_t *_data = NULL;
+    /** The slot holding each line of the E2, or _none */
+    uint32_t *_slotOf = NULL;
+    size_t _count = 0;
+    size_t _hand = 0;
+    /** The last line used and how many were used in a row before it */
+    size_t _last = 0;
+    size_t _run = 0;
+    /** Where read ahead and joined write backs are put together */
+    uint8_t *_bounce = NULL;
+    size_t _bounceLines = 0;
+    /** The dirty lines, sorted by sync() */
+    size_t *_order = NULL;
+
+    size_t _length(size_t line) {
+        return (_size - line * _lineSize < _lineSize) ? _size - line * _lineSize : _lineSize;
+    }
+    uint8_t *_line(uint32_t slot) {
+        return &_data[(size_t)slot * _lineSize];
+    }
+    uint32_t _find(size_t line, bool fill, bool &ok);
+    uint32_t _victim(bool &ok);
+    void _used(size_t line, bool readAhead);
+    bool _writeBack(size_t line, size_t count);
+    bool _flush(void);
+    static int _compare(const void *a, const void *b);
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMCacheBackend(const RAMEEPROMCacheBackend &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMCacheBackend &operator=(const RAMEEPROMCacheBackend &other);
+};
+
+#endif // RAM_EEPROM_CACHE_h
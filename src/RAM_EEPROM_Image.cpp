@@ -0,0 +1,327 @@
+/*
+  RAM_EEPROM_Image.cpp - Image file import and export for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "RAM_EEPROM_Image.h"
+
+#ifndef RAM_EEPROM_IMAGE_CHUNK
+/** How much of the file to work on at once */
+#define RAM_EEPROM_IMAGE_CHUNK 4096
+#endif
+
+/** The longest HEX line: ':', 5 header bytes, 255 data bytes, CR LF */
+#define RAM_EEPROM_HEX_LINE (1 + 2 * (5 + 255) + 2)
+/** Erased runs at least this long are left out of HEX files */
+#define RAM_EEPROM_HEX_SKIP 8
+#define RAM_EEPROM_HEX_RECORD 16
+
+static const char _hexDigits[] = "0123456789ABCDEF";
+
+/** The value of each hex digit, and 0xFF for anything else */
+static const uint8_t _hexValue[256] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+bool RAMEEPROMLoadBinary(RAMEEPROMClass &eeprom, FILE *file, int address)
+{
+    uint8_t chunk[RAM_EEPROM_IMAGE_CHUNK];
+    size_t size = eeprom.size();
+    size_t at;
+    if ((file == NULL) || (address < 0) || ((size_t)address > size)) {
+        return false;
+    }
+    for (at = address; at < size;) {
+        size_t want = (size - at < sizeof(chunk)) ? size - at : sizeof(chunk);
+        size_t got = fread(chunk, 1, want, file);
+        if ((got > 0) && !eeprom.writeBytes(at, chunk, got)) {
+            return false;
+        }
+        at += got;
+        if (got < want) {
+            return !ferror(file);
+        }
+    }
+    // Full, so there had better not be any more
+    return (fgetc(file) == EOF) && !ferror(file);
+}
+
+bool RAMEEPROMSaveBinary(RAMEEPROMClass &eeprom, FILE *file, int address, size_t length)
+{
+    uint8_t chunk[RAM_EEPROM_IMAGE_CHUNK];
+    size_t size = eeprom.size();
+    if ((file == NULL) || (address < 0) || ((size_t)address > size)) {
+        return false;
+    }
+    if (length == 0) {
+        length = size - address;
+    }
+    if (length > size - address) {
+        return false;
+    }
+    while (length > 0) {
+        size_t count = (length < sizeof(chunk)) ? length : sizeof(chunk);
+        if (!eeprom.readBytes(address, chunk, count) || (fwrite(chunk, 1, count, file) != count)) {
+            return false;
+        }
+        address += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Collects the data from back to back records, so they go to the E2 in
+ * one writeBytes()
+ */
+struct _HexRun {
+    uint32_t address;
+    size_t length;
+    uint8_t data[RAM_EEPROM_IMAGE_CHUNK];
+};
+
+static bool _hexFlush(RAMEEPROMClass &eeprom, _HexRun &run)
+{
+    bool good = (run.length == 0) || eeprom.writeBytes(run.address, run.data, run.length);
+    run.length = 0;
+    return good;
+}
+
+/**
+ * Decodes and checks one line, then acts on it
+ *
+ * @return 1 to go on, 0 at the end of file record, -1 on an error
+ */
+static int _hexLine(RAMEEPROMClass &eeprom, _HexRun &run, uint32_t &base, const char *line, size_t length)
+{
+    uint8_t record[5 + 255];
+    uint8_t sum = 0;
+    size_t count, i;
+    while ((length > 0) && ((line[length - 1] == '\r') || (line[length - 1] == ' ') || (line[length - 1] == '\t'))) {
+        length--;
+    }
+    if (length == 0) {
+        return 1;
+    }
+    if ((line[0] != ':') || ((length & 1) == 0) || (length < 11) || (length > RAM_EEPROM_HEX_LINE - 2)) {
+        return -1;
+    }
+    count = (length - 1) / 2;
+    for (i = 0; i < count; i++) {
+        uint8_t high = _hexValue[(uint8_t)line[1 + 2 * i]];
+        uint8_t low = _hexValue[(uint8_t)line[2 + 2 * i]];
+        if ((high | low) > 0xF) {
+            return -1;
+        }
+        record[i] = (high << 4) | low;
+        sum += record[i];
+    }
+    if ((sum != 0) || (record[0] + 5U != count)) {
+        return -1;
+    }
+    switch (record[3]) {
+    case 0: {
+        uint32_t address = base + (((uint32_t)record[1] << 8) | record[2]);
+        size_t size = record[0];
+        if ((address > eeprom.size()) || (size > eeprom.size() - address)) {
+            return -1;
+        }
+        if ((run.length > 0) && ((address != run.address + run.length)
+            || (size > sizeof(run.data) - run.length))) {
+            if (!_hexFlush(eeprom, run)) {
+                return -1;
+            }
+        }
+        if (run.length == 0) {
+            run.address = address;
+        }
+        memcpy(&run.data[run.length], &record[4], size);
+        run.length += size;
+        return 1;
+    }
+    case 1:
+        return 0;
+    case 2:
+    case 4:
+        if (record[0] != 2) {
+            return -1;
+        }
+        base = ((uint32_t)record[4] << 8) | record[5];
+        base <<= (record[3] == 2) ? 4 : 16;
+        return 1;
+    case 3:
+    case 5:
+        // Start addresses mean nothing to an E2
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+bool RAMEEPROMLoadHex(RAMEEPROMClass &eeprom, FILE *file)
+{
+    char input[RAM_EEPROM_IMAGE_CHUNK + RAM_EEPROM_HEX_LINE];
+    _HexRun *run = new _HexRun();
+    uint32_t base = 0;
+    size_t have = 0;
+    int state = 1;
+    if (file == NULL) {
+        delete run;
+        return false;
+    }
+    while (state > 0) {
+        size_t got = fread(&input[have], 1, sizeof(input) - have, file);
+        size_t pos = 0;
+        have += got;
+        while (state > 0) {
+            const char *end = (const char *)memchr(&input[pos], '\n', have - pos);
+            if (end == NULL) {
+                if (got > 0) {
+                    break;
+                }
+                // The last line doesn't have to end in a newline
+                end = &input[have];
+            }
+            state = _hexLine(eeprom, *run, base, &input[pos], end - &input[pos]);
+            pos = (end - input) + 1;
+            if (pos >= have) {
+                pos = have;
+                break;
+            }
+        }
+        memmove(input, &input[pos], have - pos);
+        have -= pos;
+        if ((have > RAM_EEPROM_HEX_LINE) || ferror(file)) {
+            state = -1;
+        }
+        if ((got == 0) && (have == 0)) {
+            break;
+        }
+    }
+    if ((state >= 0) && !_hexFlush(eeprom, *run)) {
+        state = -1;
+    }
+    delete run;
+    return state >= 0;
+}
+
+/**
+ * Adds a record to out
+ *
+ * @return The number of characters added
+ */
+static size_t _hexRecord(char *out, uint8_t type, uint16_t address, const uint8_t *data, size_t length)
+{
+    uint8_t header[4] = { (uint8_t)length, (uint8_t)(address >> 8), (uint8_t)address, type };
+    uint8_t sum = 0;
+    size_t used = 0;
+    size_t i;
+    out[used++] = ':';
+    for (i = 0; i < sizeof(header); i++) {
+        out[used++] = _hexDigits[header[i] >> 4];
+        out[used++] = _hexDigits[header[i] & 0xF];
+        sum += header[i];
+    }
+    for (i = 0; i < length; i++) {
+        out[used++] = _hexDigits[data[i] >> 4];
+        out[used++] = _hexDigits[data[i] & 0xF];
+        sum += data[i];
+    }
+    sum = -sum;
+    out[used++] = _hexDigits[sum >> 4];
+    out[used++] = _hexDigits[sum & 0xF];
+    out[used++] = '\n';
+    return used;
+}
+
+bool RAMEEPROMSaveHex(RAMEEPROMClass &eeprom, FILE *file)
+{
+    uint8_t chunk[RAM_EEPROM_IMAGE_CHUNK];
+    char out[RAM_EEPROM_IMAGE_CHUNK + RAM_EEPROM_HEX_LINE];
+    size_t size = eeprom.size();
+    size_t used = 0;
+    uint32_t upper = 0;
+    if (file == NULL) {
+        return false;
+    }
+    for (size_t at = 0; at < size; at += sizeof(chunk)) {
+        size_t count = (size - at < sizeof(chunk)) ? size - at : sizeof(chunk);
+        size_t i = 0;
+        if (!eeprom.readBytes(at, chunk, count)) {
+            return false;
+        }
+        while (i < count) {
+            if (chunk[i] == 0xFF) {
+                i++;
+                continue;
+            }
+            // A record stops at 16 bytes, a 64k boundary or a long erased run
+            size_t start = i;
+            size_t last = start + 1;
+            size_t limit = start + RAM_EEPROM_HEX_RECORD;
+            size_t boundary = start + (0x10000 - ((at + start) & 0xFFFF));
+            if (limit > boundary) {
+                limit = boundary;
+            }
+            if (limit > count) {
+                limit = count;
+            }
+            for (i = start + 1; i < limit; i++) {
+                if (chunk[i] != 0xFF) {
+                    last = i + 1;
+                } else if (i + RAM_EEPROM_HEX_SKIP <= count) {
+                    size_t j = i;
+                    while ((j < i + RAM_EEPROM_HEX_SKIP) && (chunk[j] == 0xFF)) {
+                        j++;
+                    }
+                    if (j == i + RAM_EEPROM_HEX_SKIP) {
+                        break;
+                    }
+                }
+            }
+            uint32_t address = at + start;
+            if ((address >> 16) != upper) {
+                uint8_t segment[2] = { (uint8_t)(address >> 24), (uint8_t)(address >> 16) };
+                upper = address >> 16;
+                used += _hexRecord(&out[used], 4, 0, segment, sizeof(segment));
+            }
+            used += _hexRecord(&out[used], 0, address & 0xFFFF, &chunk[start], last - start);
+            if (used > RAM_EEPROM_IMAGE_CHUNK) {
+                if (fwrite(out, 1, used, file) != used) {
+                    return false;
+                }
+                used = 0;
+            }
+        }
+    }
+    used += _hexRecord(&out[used], 1, 0, NULL, 0);
+    return fwrite(out, 1, used, file) == used;
+}
@@ -0,0 +1,70 @@
+/*
+  RAM_EEPROM_Image.h - Image file import and export for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RAM_EEPROM_IMAGE_h
+#define RAM_EEPROM_IMAGE_h
+
+#include <cstdio>
+#include "RAM_EEPROM.h"
+
+/*
+ * These stream through a small buffer, so no copy of the whole image is
+ * ever made, and write with writeBytes() a run at a time rather than a
+ * byte at a time.
+ */
+
+/**
+ * Reads a raw binary image from file into the E2, starting at address
+ *
+ * @return true on success, false on a read error or if the file doesn't
+ *         fit.  Whatever fit has been written.
+ */
+bool RAMEEPROMLoadBinary(RAMEEPROMClass &eeprom, FILE *file, int address = 0);
+
+/**
+ * Writes length bytes of the E2, starting at address, to file as raw
+ * binary.  A length of 0 means to the end of the E2.
+ *
+ * @return true on success, false on a bad range or write error
+ */
+bool RAMEEPROMSaveBinary(RAMEEPROMClass &eeprom, FILE *file, int address = 0, size_t length = 0);
+
+/**
+ * Reads an Intel HEX file into the E2
+ *
+ * Only the bytes in data records are written, so anything the file
+ * doesn't cover is left alone.  Extended segment and linear address
+ * records are followed.  It stops at the end of file record.
+ *
+ * @return true on success, false on a malformed record, bad checksum, or
+ *         data outside the E2.  Records before the bad one have been
+ *         written.
+ */
+bool RAMEEPROMLoadHex(RAMEEPROMClass &eeprom, FILE *file);
+
+/**
+ * Writes the E2 to file as Intel HEX
+ *
+ * Runs of erased (0xFF) bytes are left out, so loading the file into an
+ * erased E2 gives the same image back.
+ *
+ * @return true on success, false on a write error
+ */
+bool RAMEEPROMSaveHex(RAMEEPROMClass &eeprom, FILE *file);
+
+#endif // RAM_EEPROM_IMAGE_h
@@ -0,0 +1,336 @@
+/*
+  RAM_EEPROM_Journal.cpp - Redo journal and transactions for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "RAM_EEPROM_Journal.h"
+
+/*
+ * The journal region is an 8 byte header followed by records:
+ *
+ *   header:  magic (4), epoch (4)
+ *   record:  epoch (4), address (4), length (2), type (1), 0 (1), data
+ *
+ * A transaction is its data records followed by a commit record, whose
+ * data is the hash of every byte of the transaction before it.  Records
+ * only count if they carry the epoch in the header, which goes up every
+ * time the journal is emptied, so whatever was left behind from before
+ * ends the scan.
+ */
+
+/**
+ * Keeps a journal in length bytes of eeprom starting at address
+ *
+ * Nothing is touched until begin().  Nothing else should write to the
+ * journal region.
+ *
+ * @param eeprom  The E2 to journal
+ * @param address The start of the journal region
+ * @param length  The size of the journal region.  This is also the most a
+ *                group of transactions can hold.
+ * @param group   The number of transactions to collect before writing them
+ */
+RAMEEPROMJournal::RAMEEPROMJournal(RAMEEPROMClass &eeprom, int address, size_t length, uint16_t group)
+ : _eeprom(eeprom), _address(address), _length(length), _group(group ? group : 1)
+{
+}
+
+/**
+ * Waiting transactions are dropped, not flushed.
+ */
+RAMEEPROMJournal::~RAMEEPROMJournal()
+{
+    delete [] _buffer;
+}
+
+/**
+ * Sets up the journal, replaying anything a crash left in it
+ *
+ * Every whole transaction in the journal is written to the E2 again, and
+ * the journal is emptied.  A region without a journal header is formatted.
+ *
+ * @return true on success, false if the region isn't usable
+ */
+bool RAMEEPROMJournal::begin(void) {
+    uint8_t header[_headerSize];
+    uint32_t magic;
+    size_t capacity = _length - _headerSize;
+    size_t offset = 0, txStart = 0;
+    uint32_t hash = _hash(NULL, 0);
+
+    if ((_address < 0) || (_length < _headerSize + (2 * _recordSize) + 4)
+        || (_length > _eeprom.size()) || ((size_t)_address > _eeprom.size() - _length)) {
+        return false;
+    }
+    if (!_eeprom.readBytes(_address, header, sizeof(header))) {
+        return false;
+    }
+    if (_buffer == NULL) {
+        _buffer = new uint8_t[capacity];
+    }
+    _used = 0;
+    _txStart = 0;
+    _open = false;
+    _waiting = 0;
+    _recovered = 0;
+    memcpy(&magic, header, sizeof(magic));
+    if (magic != _magic) {
+        _epoch = 0;
+        _eeprom.fillBytes(_address + _headerSize, 0xFF, capacity);
+        return _checkpoint();
+    }
+    memcpy(&_epoch, &header[4], sizeof(_epoch));
+    // Only as far as the records go, so this costs what is in the journal
+    while (offset + _recordSize <= capacity) {
+        uint8_t *record = &_buffer[offset];
+        uint32_t epoch, address;
+        uint16_t length;
+        _eeprom.readBytes(_address + _headerSize + offset, record, _recordSize);
+        memcpy(&epoch, record, sizeof(epoch));
+        memcpy(&address, &record[4], sizeof(address));
+        memcpy(&length, &record[8], sizeof(length));
+        if ((epoch != _epoch) || (length > capacity - offset - _recordSize)) {
+            break;
+        }
+        _eeprom.readBytes(_address + _headerSize + offset + _recordSize, &record[_recordSize], length);
+        if (record[10] == _typeData) {
+            hash = _hash(record, _recordSize + length, hash);
+        } else if ((record[10] == _typeCommit) && (length == sizeof(hash))) {
+            if (memcmp(&record[_recordSize], &hash, sizeof(hash)) != 0) {
+                break;
+            }
+            txStart = offset + _recordSize + length;
+            hash = _hash(NULL, 0);
+            _recovered++;
+        } else {
+            break;
+        }
+        offset += _recordSize + length;
+    }
+    if (offset == 0) {
+        return true;
+    }
+    return _apply(_buffer, txStart) && _checkpoint();
+}
+
+/**
+ * Opens a transaction
+ *
+ * @return true on success, false if one is already open or begin() failed
+ */
+bool RAMEEPROMJournal::start(void) {
+    if ((_buffer == NULL) || _open) {
+        return false;
+    }
+    _open = true;
+    return true;
+}
+
+/**
+ * Adds writing length bytes from buffer at address to the open transaction
+ *
+ * @return true on success, false if no transaction is open, the range is
+ *         bad or overlaps the journal, or the transaction won't fit
+ */
+bool RAMEEPROMJournal::write(int address, const void *buffer, size_t length) {
+    if (!_open || (buffer == NULL) || (address < 0) || (length == 0) || (length > 0xFFFF)) {
+        return false;
+    }
+    if ((length > _eeprom.size()) || ((size_t)address > _eeprom.size() - length)) {
+        return false;
+    }
+    if (((size_t)address < _address + _length) && ((size_t)_address < address + length)) {
+        return false;
+    }
+    return _append(_typeData, address, buffer, length);
+}
+
+/**
+ * Adds writing a whole block to the open transaction
+ *
+ * @return true on success, false if block isn't in the E2 or write() fails
+ */
+bool RAMEEPROMJournal::writeBlock(int block, const uint8_t *data) {
+    size_t blockSize = _eeprom.blockSize();
+    if ((blockSize == 0) || (block < 0) || ((size_t)block >= _eeprom.size() / blockSize)) {
+        return false;
+    }
+    return write(block * blockSize, data, blockSize);
+}
+
+/**
+ * Commits the open transaction
+ *
+ * The transaction is durable once this returns, unless the group size is
+ * above 1.  Then it is durable after the flush() that writes its group.
+ *
+ * @return true on success, false if nothing is open or writing failed
+ */
+bool RAMEEPROMJournal::commit(void) {
+    uint32_t hash = 0;
+    if (!_open) {
+        return false;
+    }
+    if (_used == _txStart) {
+        _open = false;
+        return true;
+    }
+    // The hash is filled in when the records are written
+    if (!_append(_typeCommit, 0, &hash, sizeof(hash))) {
+        return false;
+    }
+    _txStart = _used;
+    _open = false;
+    _waiting++;
+    if (_waiting >= _group) {
+        return flush();
+    }
+    return true;
+}
+
+/**
+ * Drops the open transaction
+ */
+void RAMEEPROMJournal::abort(void) {
+    _used = _txStart;
+    _open = false;
+}
+
+/**
+ * Writes every committed transaction to the journal, then to the E2
+ *
+ * An open transaction stays open.  Each step is committed before the next
+ * starts, so if commit() fails the records aren't written in place, and
+ * the transactions stay waiting for the next flush().
+ *
+ * @return true on success, false if the E2 couldn't be written or committed
+ */
+bool RAMEEPROMJournal::flush(void) {
+    if (_txStart == 0) {
+        return true;
+    }
+    if (!_writeJournal() || !_apply(_buffer, _txStart) || !_checkpoint()) {
+        return false;
+    }
+    memmove(_buffer, &_buffer[_txStart], _used - _txStart);
+    _used -= _txStart;
+    _txStart = 0;
+    _waiting = 0;
+    return true;
+}
+
+/**
+ * Adds a record to the end of _buffer
+ *
+ * If it doesn't fit the waiting transactions are flushed to make room.
+ * Data records also leave room for the commit record.
+ */
+bool RAMEEPROMJournal::_append(uint8_t type, uint32_t address, const void *data, uint16_t length) {
+    size_t capacity = _length - _headerSize;
+    size_t need = _recordSize + length;
+    uint8_t *record;
+    if (type == _typeData) {
+        need += _recordSize + sizeof(uint32_t);
+    }
+    if ((need > capacity - _used) && (_txStart > 0)) {
+        if (!flush()) {
+            return false;
+        }
+    }
+    if (need > capacity - _used) {
+        return false;
+    }
+    record = &_buffer[_used];
+    memset(record, 0, _recordSize);
+    memcpy(&record[4], &address, sizeof(address));
+    memcpy(&record[8], &length, sizeof(length));
+    record[10] = type;
+    memcpy(&record[_recordSize], data, length);
+    _used += _recordSize + length;
+    return true;
+}
+
+/**
+ * Stamps and hashes the committed records, and writes them to the journal
+ */
+bool RAMEEPROMJournal::_writeJournal(void) {
+    uint32_t hash = _hash(NULL, 0);
+    size_t offset = 0;
+    while (offset < _txStart) {
+        uint8_t *record = &_buffer[offset];
+        uint16_t length;
+        memcpy(record, &_epoch, sizeof(_epoch));
+        memcpy(&length, &record[8], sizeof(length));
+        if (record[10] == _typeCommit) {
+            memcpy(&record[_recordSize], &hash, sizeof(hash));
+            hash = _hash(NULL, 0);
+        } else {
+            hash = _hash(record, _recordSize + length, hash);
+        }
+        offset += _recordSize + length;
+    }
+    if (!_eeprom.writeBytes(_address + _headerSize, _buffer, _txStart)) {
+        return false;
+    }
+    return _eeprom.commit();
+}
+
+/**
+ * Writes the data records in records to where they belong
+ */
+bool RAMEEPROMJournal::_apply(const uint8_t *records, size_t length) {
+    size_t offset = 0;
+    while (offset < length) {
+        const uint8_t *record = &records[offset];
+        uint32_t address;
+        uint16_t size;
+        memcpy(&address, &record[4], sizeof(address));
+        memcpy(&size, &record[8], sizeof(size));
+        if ((record[10] == _typeData)
+            && !_eeprom.writeBytes(address, &record[_recordSize], size)) {
+            return false;
+        }
+        offset += _recordSize + size;
+    }
+    return _eeprom.commit();
+}
+
+/**
+ * Empties the journal by moving to the next epoch
+ */
+bool RAMEEPROMJournal::_checkpoint(void) {
+    uint8_t header[_headerSize];
+    uint32_t magic = _magic;
+    _epoch++;
+    memcpy(header, &magic, sizeof(magic));
+    memcpy(&header[4], &_epoch, sizeof(_epoch));
+    if (!_eeprom.writeBytes(_address, header, sizeof(header))) {
+        return false;
+    }
+    return _eeprom.commit();
+}
+
+/**
+ * FNV-1a, which is plenty to spot a torn transaction
+ */
+uint32_t RAMEEPROMJournal::_hash(const uint8_t *data, size_t length, uint32_t hash) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
@@ -0,0 +1,117 @@
+/*
+  RAM_EEPROM_Journal.h - Redo journal and transactions for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RAM_EEPROM_JOURNAL_h
+#define RAM_EEPROM_JOURNAL_h
+
+#include "RAM_EEPROM.h"
+
+/**
+ * Crash safe transactions on a RAMEEPROMClass
+ *
+ * A transaction is a group of writes that either all land or none do:
+ *
+ * @code
+ * RAMEEPROMJournal journal(EEPROM, 3584, 512);
+ * journal.begin();          // Finishes anything a crash interrupted
+ * journal.start();
+ * journal.put(0, config);
+ * journal.put(64, checksum);
+ * journal.commit();
+ * @endcode
+ *
+ * Committed transactions are written to a redo journal in a reserved part
+ * of the E2 first, and only then to their real addresses.  If the program
+ * dies part way through, begin() replays every transaction that made it
+ * into the journal whole and ignores the rest.  The journal is emptied
+ * after every flush, so the scan at begin() only reads what was in it.
+ *
+ * With a group size above 1, committed transactions collect in RAM and are
+ * written to the journal together once there are group of them (or on
+ * flush()), which costs one journal write and E2 commit() for all of them.
+ * Until then they aren't durable and aren't visible in the E2.
+ */
+class RAMEEPROMJournal {
+public:
+    RAMEEPROMJournal(RAMEEPROMClass &eeprom, int address, size_t length, uint16_t group = 1);
+    ~RAMEEPROMJournal();
+
+    bool begin(void);
+    bool start(void);
+    bool write(int address, const void *buffer, size_t length);
+    bool writeBlock(int block, const uint8_t *data);
+    bool commit(void);
+    void abort(void);
+    bool flush(void);
+
+    template<typename T>
+    bool put(int address, const T &t) {
+        return write(address, &t, sizeof(T));
+    }
+    /**
+     * The number of committed transactions waiting for flush()
+     */
+    uint16_t waiting(void) {
+        return _waiting;
+    }
+    /**
+     * The number of transactions begin() replayed
+     */
+    uint32_t recovered(void) {
+        return _recovered;
+    }
+
+protected:
+    /** Journal header magic, "RJNL" */
+    static const uint32_t _magic = 0x4C4E4A52;
+    static const size_t _headerSize = 8;
+    static const size_t _recordSize = 12;
+    static const uint8_t _typeData = 1;
+    static const uint8_t _typeCommit = 2;
+
+    RAMEEPROMClass &_eeprom;
+    int _address;
+    size_t _length;
+    uint16_t _group;
+    uint32_t _epoch = 0;
+    /** The records of the waiting transactions, laid out as in the journal */
+    uint8_t *_buffer = NULL;
+    size_t _used = 0;
+    /** Where the open transaction starts in _buffer */
+    size_t _txStart = 0;
+    bool _open = false;
+    uint16_t _waiting = 0;
+    uint32_t _recovered = 0;
+
+    bool _append(uint8_t type, uint32_t address, const void *data, uint16_t length);
+    bool _writeJournal(void);
+    bool _apply(const uint8_t *records, size_t length);
+    bool _checkpoint(void);
+    static uint32_t _hash(const uint8_t *data, size_t length, uint32_t hash = 2166136261UL);
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMJournal(const RAMEEPROMJournal &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMJournal &operator=(const RAMEEPROMJournal &other);
+};
+
+#endif // RAM_EEPROM_JOURNAL_h
@@ -0,0 +1,619 @@
+/*
+  RAM_EEPROM_KV.cpp - Log structured key/value store for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdlib.h>
+#include "RAM_EEPROM_KV.h"
+
+/*
+ * The blocks are split into segments of segmentBlocks blocks.  A segment is
+ * erased (0xFF), or
+ *
+ *   magic (4), sequence (4), records
+ *
+ * and a record is
+ *
+ *   key length (1), 0 (1), value length (2), hash (4), key, value
+ *
+ * The records end at the first key length of 0xFF.  The hash is over the
+ * whole record except itself.  Segments are replayed oldest sequence
+ * first, so the last record for a key wins, and a value length of 0xFFFF
+ * says the key was removed.
+ */
+
+/** Sorts segments by sequence, which is in the top half */
+static int _compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/**
+ * Sets up a store on blocks of eeprom
+ *
+ * Nothing is touched until begin().
+ *
+ * @param eeprom        The E2.  It has to have a block size.
+ * @param first         The first block to use
+ * @param count         The number of blocks to use, 0 for the rest of the E2
+ * @param segmentBlocks The blocks in a segment.  A record can't be bigger
+ *                      than a segment.
+ */
+RAMEEPROMKV::RAMEEPROMKV(RAMEEPROMClass &eeprom, int first, int count, size_t segmentBlocks)
+ : _eeprom(eeprom), _first(first), _count(count), _segmentBlocks(segmentBlocks), _stats()
+{
+}
+
+RAMEEPROMKV::~RAMEEPROMKV()
+{
+    delete [] _segments;
+    delete [] _slots;
+    delete [] _record;
+    delete [] _copy;
+}
+
+/**
+ * Replays the log into the index
+ *
+ * Segments that aren't erased and don't have a good header are erased.
+ *
+ * @return true on success, false if the blocks don't make at least two
+ *         segments
+ */
+bool RAMEEPROMKV::begin(void) {
+    size_t blockSize = _eeprom.blockSize();
+    size_t blocks = _eeprom.blocks();
+    size_t total, used = 0;
+    uint64_t *order;
+    size_t i, j;
+
+    delete [] _segments;
+    delete [] _slots;
+    delete [] _record;
+    delete [] _copy;
+    _segments = NULL;
+    _slots = NULL;
+    _record = NULL;
+    _copy = NULL;
+    _stats = RAMEEPROMKVStats();
+    _capacity = 0;
+    _used = 0;
+    _keys = 0;
+    _free = 0;
+    _tail = -1;
+    _sequence = 0;
+    if ((blockSize == 0) || (_segmentBlocks == 0) || (_first < 0) || ((size_t)_first >= blocks)) {
+        return false;
+    }
+    total = (_count > 0) ? (size_t)_count : blocks - _first;
+    if (_first + total > blocks) {
+        return false;
+    }
+    _segmentSize = _segmentBlocks * blockSize;
+    _segmentCount = total / _segmentBlocks;
+    if ((_segmentCount < 2) || (_segmentSize <= _headerSize + _recordSize)) {
+        return false;
+    }
+    _segments = new _Segment[_segmentCount]();
+    _record = new uint8_t[_segmentSize];
+    _copy = new uint8_t[_segmentSize];
+    _capacity = 64;
+    _slots = new _Slot[_capacity];
+    for (i = 0; i < _capacity; i++) {
+        _slots[i].address = _empty;
+    }
+
+    order = new uint64_t[_segmentCount];
+    for (i = 0; i < _segmentCount; i++) {
+        uint32_t header[2];
+        if (!_eeprom.readBytes(_address(i), header, sizeof(header))) {
+            delete [] order;
+            return false;
+        }
+        if ((header[0] == _magic) && (header[1] != 0)) {
+            _segments[i].sequence = header[1];
+            order[used++] = ((uint64_t)header[1] << 32) | i;
+            continue;
+        }
+        // Anything we didn't finish erasing gets erased now
+        _eeprom.readBytes(_address(i), _copy, _segmentSize);
+        for (j = 0; (j < _segmentSize) && (_copy[j] == 0xFF); j++) {
+        }
+        if (j < _segmentSize) {
+            _erase(i);
+        } else {
+            _free++;
+        }
+    }
+    qsort(order, used, sizeof(order[0]), _compare);
+    for (i = 0; i < used; i++) {
+        size_t segment = order[i] & 0xFFFFFFFF;
+        // A torn record can only be at the end of the newest one, and
+        // nothing more is appended after it
+        _tail = _scan(segment) ? (int)segment : -1;
+        _sequence = _segments[segment].sequence;
+    }
+    delete [] order;
+    return true;
+}
+
+/**
+ * Indexes the records in segment
+ *
+ * @return false if it ends in a bad record
+ */
+bool RAMEEPROMKV::_scan(size_t segment) {
+    size_t offset = _headerSize;
+    _segments[segment].used = offset;
+    while (offset + _recordSize <= _segmentSize) {
+        int address = _address(segment) + offset;
+        uint32_t check;
+        size_t size;
+        if (!_eeprom.readBytes(address, _copy, _recordSize)) {
+            return false;
+        }
+        if (_copy[0] == 0xFF) {
+            break;
+        }
+        size = _size(_copy);
+        if ((_copy[0] == 0) || (_copy[1] != 0) || (size > _segmentSize - offset)) {
+            return false;
+        }
+        if (!_eeprom.readBytes(address + _recordSize, &_copy[_recordSize], size - _recordSize)) {
+            return false;
+        }
+        memcpy(&check, &_copy[4], sizeof(check));
+        if (check != _hash(&_copy[_recordSize], size - _recordSize, _hash(_copy, 4))) {
+            return false;
+        }
+        uint32_t hash = _hash(&_copy[_recordSize], _copy[0]);
+        _Slot *slot = _find((const char *)&_copy[_recordSize], _copy[0], hash);
+        if (slot == NULL) {
+            slot = _insert(hash);
+        }
+        _point(slot, hash, address, size, _copy[2] == 0xFF && _copy[3] == 0xFF);
+        offset += size;
+        _segments[segment].used = offset;
+    }
+    return true;
+}
+
+/**
+ * Stores length bytes of value under key
+ *
+ * @param key    A string 1 to 254 characters long
+ * @param value  The value
+ * @param length Its length, up to maxValue()
+ *
+ * @return true on success, false if the key or value is too big or there
+ *         is no room left after compacting
+ */
+bool RAMEEPROMKV::put(const char *key, const void *value, size_t length) {
+    size_t keyLength = (key != NULL) ? strlen(key) : 0;
+    uint32_t address, check;
+    uint16_t size16 = length;
+    if ((_segments == NULL) || (keyLength == 0) || (keyLength >= 0xFF) || (length > maxValue(keyLength))
+        || (length >= _tombstone) || ((value == NULL) && (length > 0))) {
+        return false;
+    }
+    size_t size = _recordSize + keyLength + length;
+    _record[0] = keyLength;
+    _record[1] = 0;
+    memcpy(&_record[2], &size16, sizeof(size16));
+    memcpy(&_record[_recordSize], key, keyLength);
+    if (length > 0) {
+        memcpy(&_record[_recordSize + keyLength], value, length);
+    }
+    check = _hash(&_record[_recordSize], size - _recordSize, _hash(_record, 4));
+    memcpy(&_record[4], &check, sizeof(check));
+    if (!_append(_record, size, address, false)) {
+        return false;
+    }
+    uint32_t hash = _hash((const uint8_t *)key, keyLength);
+    _Slot *slot = _find(key, keyLength, hash);
+    if (slot == NULL) {
+        slot = _insert(hash);
+    }
+    _point(slot, hash, address, size, false);
+    _stats.userBytes += keyLength + length;
+    return true;
+}
+
+/**
+ * Reads the value of key
+ *
+ * @param key    The key
+ * @param buffer Where to put the value.  Can be NULL if length is 0.
+ * @param length The size of buffer.  Only this much of the value is read.
+ *
+ * @return The length of the value, or -1 if key isn't there
+ */
+int RAMEEPROMKV::get(const char *key, void *buffer, size_t length) {
+    size_t keyLength = (key != NULL) ? strlen(key) : 0;
+    uint8_t header[_recordSize];
+    uint16_t size;
+    if ((_slots == NULL) || (keyLength == 0) || (keyLength >= 0xFF)) {
+        return -1;
+    }
+    _Slot *slot = _find(key, keyLength, _hash((const uint8_t *)key, keyLength));
+    if ((slot == NULL) || !_eeprom.readBytes(slot->address, header, sizeof(header))) {
+        return -1;
+    }
+    memcpy(&size, &header[2], sizeof(size));
+    if (size == _tombstone) {
+        return -1;
+    }
+    if (length > size) {
+        length = size;
+    }
+    if ((length > 0) && !_eeprom.readBytes(slot->address + _recordSize + keyLength, buffer, length)) {
+        return -1;
+    }
+    return size;
+}
+
+/**
+ * Removes key
+ *
+ * @return true if it was there and is now gone
+ */
+bool RAMEEPROMKV::remove(const char *key) {
+    size_t keyLength = (key != NULL) ? strlen(key) : 0;
+    uint16_t size16 = _tombstone;
+    uint32_t address, check;
+    if (!contains(key)) {
+        return false;
+    }
+    size_t size = _recordSize + keyLength;
+    _record[0] = keyLength;
+    _record[1] = 0;
+    memcpy(&_record[2], &size16, sizeof(size16));
+    memcpy(&_record[_recordSize], key, keyLength);
+    check = _hash(&_record[_recordSize], keyLength, _hash(_record, 4));
+    memcpy(&_record[4], &check, sizeof(check));
+    if (!_append(_record, size, address, false)) {
+        return false;
+    }
+    uint32_t hash = _hash((const uint8_t *)key, keyLength);
+    _point(_find(key, keyLength, hash), hash, address, size, true);
+    _stats.userBytes += keyLength;
+    return true;
+}
+
+/**
+ * Compacts up to segments segments that are at least half garbage
+ *
+ * This is for calling when there is nothing else to do, so put() doesn't
+ * have to stop and compact.
+ *
+ * @return true if it compacted as many as asked for, false if it ran out
+ *         of segments worth compacting
+ */
+bool RAMEEPROMKV::compact(size_t segments) {
+    size_t i;
+    if (_segments == NULL) {
+        return false;
+    }
+    for (i = 0; i < segments; i++) {
+        // Unless there is a spare to copy into this could fail half done
+        if ((_free == 0) || !_compactOne((_segmentSize - _headerSize) / 2)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Gets the write counters
+ */
+void RAMEEPROMKV::kvStats(RAMEEPROMKVStats &stats) {
+    size_t i;
+    stats = _stats;
+    stats.liveBytes = 0;
+    stats.freeSegments = _free;
+    for (i = 0; i < _segmentCount; i++) {
+        stats.liveBytes += _segments[i].live;
+    }
+}
+
+/**
+ * Finds the slot for key
+ *
+ * @return The slot, or NULL if key isn't in the index
+ */
+RAMEEPROMKV::_Slot *RAMEEPROMKV::_find(const char *key, size_t keyLength, uint32_t hash) {
+    uint8_t record[_recordSize + 0xFF];
+    size_t mask = _capacity - 1;
+    size_t i;
+    for (i = hash & mask; _slots[i].address != _empty; i = (i + 1) & mask) {
+        if ((_slots[i].address == _deleted) || (_slots[i].hash != hash)) {
+            continue;
+        }
+        // One read.  If the key lengths differ it doesn't matter what we got.
+        if (_eeprom.readBytes(_slots[i].address, record, _recordSize + keyLength)
+            && (record[0] == keyLength) && (memcmp(&record[_recordSize], key, keyLength) == 0)) {
+            return &_slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Takes a slot for a new key, growing the index if it is getting full
+ *
+ * Slots aren't moved by anything else, so a slot from _find() stays good
+ * until the next _insert().
+ */
+RAMEEPROMKV::_Slot *RAMEEPROMKV::_insert(uint32_t hash) {
+    size_t mask, i;
+    if ((_used + 1) * 4 > _capacity * 3) {
+        _grow();
+    }
+    mask = _capacity - 1;
+    for (i = hash & mask; (_slots[i].address != _empty) && (_slots[i].address != _deleted); i = (i + 1) & mask) {
+    }
+    if (_slots[i].address == _empty) {
+        _used++;
+    }
+    _slots[i].hash = hash;
+    return &_slots[i];
+}
+
+/**
+ * Rebuilds the index at twice the size of what is in it, dropping the
+ * deleted slots
+ */
+bool RAMEEPROMKV::_grow(void) {
+    _Slot *old = _slots;
+    size_t count = _capacity;
+    size_t live = 0;
+    size_t i, j;
+    for (i = 0; i < count; i++) {
+        if ((old[i].address != _empty) && (old[i].address != _deleted)) {
+            live++;
+        }
+    }
+    _capacity = 64;
+    while (_capacity < (live + 1) * 2) {
+        _capacity *= 2;
+    }
+    _slots = new _Slot[_capacity];
+    for (i = 0; i < _capacity; i++) {
+        _slots[i].address = _empty;
+    }
+    for (i = 0; i < count; i++) {
+        if ((old[i].address == _empty) || (old[i].address == _deleted)) {
+            continue;
+        }
+        for (j = old[i].hash & (_capacity - 1); _slots[j].address != _empty; j = (j + 1) & (_capacity - 1)) {
+        }
+        _slots[j] = old[i];
+    }
+    _used = live;
+    delete [] old;
+    return true;
+}
+
+/**
+ * Points slot at the record at address, moving the live byte counts
+ */
+void RAMEEPROMKV::_point(_Slot *slot, uint32_t hash, uint32_t address, size_t size, bool tombstone) {
+    uint8_t header[_recordSize];
+    if ((slot->address != _empty) && (slot->address != _deleted)
+        && _eeprom.readBytes(slot->address, header, sizeof(header))) {
+        _Segment &old = _segments[_segmentOf(slot->address)];
+        old.live -= _size(header);
+        if ((header[2] != 0xFF) || (header[3] != 0xFF)) {
+            _keys--;
+        } else {
+            old.tombstones -= _size(header);
+        }
+    }
+    if (!tombstone) {
+        _keys++;
+    } else {
+        _segments[_segmentOf(address)].tombstones += size;
+    }
+    slot->hash = hash;
+    slot->address = address;
+    _segments[_segmentOf(address)].live += size;
+}
+
+/**
+ * Adds a record to the end of the log
+ *
+ * @param record     The record
+ * @param size       Its size
+ * @param address    Set to where it went
+ * @param compacting true if this is compaction copying a record.  Only
+ *                   compaction can take the last erased segment.
+ *
+ * @return true on success, false if there is no room
+ */
+bool RAMEEPROMKV::_append(const uint8_t *record, size_t size, uint32_t &address, bool compacting) {
+    size_t tries = 0;
+    while ((_tail < 0) || (_segments[_tail].used + size > _segmentSize)) {
+        if ((_free > 1) || (compacting && (_free > 0))) {
+            if (!_open()) {
+                return false;
+            }
+        } else if (compacting || (tries++ >= _segmentCount) || !_compactOne(1)) {
+            return false;
+        }
+    }
+    address = _address(_tail) + _segments[_tail].used;
+    if (!_write(address, record, size)) {
+        return false;
+    }
+    _segments[_tail].used += size;
+    _stats.logBytes += size;
+    return true;
+}
+
+/**
+ * Starts a new segment on the next erased one
+ */
+bool RAMEEPROMKV::_open(void) {
+    size_t i, segment = 0;
+    uint32_t header[2];
+    for (i = 1; i <= _segmentCount; i++) {
+        // Going round from the tail spreads the wear
+        segment = (_tail + i) % _segmentCount;
+        if (_segments[segment].sequence == 0) {
+            break;
+        }
+    }
+    if (_segments[segment].sequence != 0) {
+        return false;
+    }
+    header[0] = _magic;
+    header[1] = ++_sequence;
+    if (!_write(_address(segment), (const uint8_t *)header, sizeof(header))) {
+        return false;
+    }
+    _segments[segment].sequence = header[1];
+    _segments[segment].used = _headerSize;
+    _segments[segment].live = 0;
+    _free--;
+    _tail = segment;
+    return true;
+}
+
+/**
+ * Writes data past the end of the log
+ *
+ * The segment is erased there, so only data is written.  Records already
+ * in the block aren't written again, and a reset part way through can
+ * only tear this one.
+ */
+bool RAMEEPROMKV::_write(int address, const uint8_t *data, size_t length) {
+    if (!_eeprom.writeBytes(address, data, length)) {
+        return false;
+    }
+    _stats.writtenBytes += length;
+    return true;
+}
+
+/**
+ * Copies the live records of the segment with the most garbage to the end
+ * of the log and erases it
+ *
+ * Removed keys have to stay removed, so their records are copied too
+ * unless the segment is the oldest, when there is nothing older left for
+ * them to hide.  That makes them garbage in the oldest segment.
+ *
+ * @param garbage The least garbage worth compacting for
+ *
+ * @return true if a segment was erased
+ */
+bool RAMEEPROMKV::_compactOne(size_t garbage) {
+    size_t usable = _segmentSize - _headerSize;
+    size_t i, victim = _segmentCount, oldest = _segmentCount;
+    for (i = 0; i < _segmentCount; i++) {
+        if ((_segments[i].sequence != 0)
+            && ((oldest == _segmentCount) || (_segments[i].sequence < _segments[oldest].sequence))) {
+            oldest = i;
+        }
+    }
+    for (i = 0; i < _segmentCount; i++) {
+        if ((_segments[i].sequence == 0) || ((int)i == _tail)) {
+            continue;
+        }
+        if ((victim == _segmentCount) || (_kept(i, oldest) < _kept(victim, oldest))) {
+            victim = i;
+        }
+    }
+    if ((victim == _segmentCount) || (_kept(victim, oldest) + garbage > usable)) {
+        return false;
+    }
+    size_t offset = _headerSize;
+    while (offset < _segments[victim].used) {
+        uint32_t address = _address(victim) + offset;
+        uint32_t moved;
+        if (!_eeprom.readBytes(address, _copy, _recordSize)) {
+            return false;
+        }
+        size_t size = _size(_copy);
+        bool tombstone = (_copy[2] == 0xFF) && (_copy[3] == 0xFF);
+        offset += size;
+        if (!_eeprom.readBytes(address + _recordSize, &_copy[_recordSize], _copy[0])) {
+            return false;
+        }
+        _Slot *slot = _find((const char *)&_copy[_recordSize], _copy[0], _hash(&_copy[_recordSize], _copy[0]));
+        if ((slot == NULL) || (slot->address != address)) {
+            continue;
+        }
+        _segments[victim].live -= size;
+        if (tombstone) {
+            _segments[victim].tombstones -= size;
+            if (victim == oldest) {
+                slot->address = _deleted;
+                continue;
+            }
+        }
+        if (!_eeprom.readBytes(address, _copy, size) || !_append(_copy, size, moved, true)) {
+            return false;
+        }
+        slot->address = moved;
+        _segments[_segmentOf(moved)].live += size;
+        if (tombstone) {
+            _segments[_segmentOf(moved)].tombstones += size;
+        }
+    }
+    _stats.compactions++;
+    return _erase(victim);
+}
+
+/**
+ * Erases segment, header first so a reset part way leaves it dead
+ */
+bool RAMEEPROMKV::_erase(size_t segment) {
+    int block = _first + segment * _segmentBlocks;
+    if (!_eeprom.eraseBlocks(block, 1)
+        || ((_segmentBlocks > 1) && !_eeprom.eraseBlocks(block + 1, _segmentBlocks - 1))) {
+        return false;
+    }
+    _stats.writtenBytes += _segmentSize;
+    _segments[segment].sequence = 0;
+    _segments[segment].used = 0;
+    _segments[segment].live = 0;
+    _segments[segment].tombstones = 0;
+    _free++;
+    return true;
+}
+
+/**
+ * The size of the record that starts with the header record
+ */
+size_t RAMEEPROMKV::_size(const uint8_t *record) {
+    uint16_t length;
+    memcpy(&length, &record[2], sizeof(length));
+    return _recordSize + record[0] + ((length == _tombstone) ? 0 : length);
+}
+
+/**
+ * FNV-1a
+ */
+uint32_t RAMEEPROMKV::_hash(const uint8_t *data, size_t length, uint32_t hash) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
@@ -0,0 +1,189 @@
+/*
+  RAM_EEPROM_KV.h - Log structured key/value store for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RAM_EEPROM_KV_h
+#define RAM_EEPROM_KV_h
+
+#include "RAM_EEPROM.h"
+
+/**
+ * Counters from RAMEEPROMKV::kvStats()
+ *
+ * writtenBytes / userBytes is the write amplification: how many bytes went
+ * to the E2 for every byte of keys and values put.
+ */
+struct RAMEEPROMKVStats {
+    uint64_t userBytes;     //!< Key and value bytes given to put() and remove()
+    uint64_t logBytes;      //!< Record bytes appended, including copies made by compaction
+    uint64_t writtenBytes;  //!< Bytes written to the E2, counting erased ones
+    uint32_t compactions;   //!< Segments compacted
+    uint32_t liveBytes;     //!< Bytes of records still in use
+    uint32_t freeSegments;  //!< Erased segments
+};
+
+/**
+ * Named values kept in a log of records on the blocks of an E2
+ *
+ * Every put() or remove() appends a record to the newest segment (a run of
+ * erased blocks) and writes only the bytes of that record, so a value is
+ * never written over in place.  begin() replays the log into a hash
+ * table in RAM, so get() finds a key with one probe and one read.
+ *
+ * @code
+ * RAMEEPROMKV settings(EEPROM);
+ * settings.begin();
+ * settings.put("volume", volume);
+ * settings.get("volume", volume);
+ * @endcode
+ *
+ * Old values and removed keys are garbage that compaction gets back: the
+ * segment with the least live data is copied to the end of the log and
+ * erased.  put() compacts a segment when it needs room, and compact() can
+ * be called when the program is idle so that put() seldom has to.  One
+ * erased segment is always kept for compaction to copy into.
+ *
+ * Each record has a hash over it, so a record torn by a reset is thrown
+ * away by begin() and the key keeps the value it had.  It isn't thread
+ * safe.
+ */
+class RAMEEPROMKV {
+public:
+    RAMEEPROMKV(RAMEEPROMClass &eeprom, int first = 0, int count = 0, size_t segmentBlocks = 4);
+    ~RAMEEPROMKV();
+
+    bool begin(void);
+    bool put(const char *key, const void *value, size_t length);
+    int get(const char *key, void *buffer, size_t length);
+    bool remove(const char *key);
+    bool compact(size_t segments = 1);
+    void kvStats(RAMEEPROMKVStats &stats);
+
+    /**
+     * Stores a value of any type under key
+     */
+    template<typename T>
+    bool put(const char *key, const T &value) {
+        return put(key, &value, sizeof(T));
+    }
+    /**
+     * Reads a value of any type
+     *
+     * @return true if key is there and its value is sizeof(T) long
+     */
+    template<typename T>
+    bool get(const char *key, T &value) {
+        return get(key, &value, sizeof(T)) == (int)sizeof(T);
+    }
+    bool contains(const char *key) {
+        return get(key, NULL, 0) >= 0;
+    }
+    /**
+     * The number of keys stored
+     */
+    size_t count(void) {
+        return _keys;
+    }
+    /**
+     * The biggest value that fits with a key keyLength long
+     */
+    size_t maxValue(size_t keyLength) {
+        size_t room = _segmentSize - _headerSize - _recordSize;
+        return (keyLength < room) ? room - keyLength : 0;
+    }
+
+protected:
+    /** Segment header magic, "RKVS" */
+    static const uint32_t _magic = 0x53564B52;
+    /** magic (4), sequence (4) */
+    static const size_t _headerSize = 8;
+    /** key length (1), 0 (1), value length (2), hash (4) */
+    static const size_t _recordSize = 8;
+    /** The value length of a removed key */
+    static const uint16_t _tombstone = 0xFFFF;
+    static const uint32_t _empty = 0xFFFFFFFF;
+    static const uint32_t _deleted = 0xFFFFFFFE;
+
+    struct _Segment {
+        uint32_t sequence;  //!< 0 if it's erased
+        uint32_t used;      //!< Bytes used, including the header
+        uint32_t live;      //!< Bytes of records the index points at
+        uint32_t tombstones; //!< The part of live that is removed keys
+    };
+    struct _Slot {
+        uint32_t hash;
+        uint32_t address;   //!< The record, _empty or _deleted
+    };
+
+    RAMEEPROMClass &_eeprom;
+    int _first;
+    int _count;
+    size_t _segmentBlocks;
+    size_t _segmentSize = 0;
+    size_t _segmentCount = 0;
+    _Segment *_segments = NULL;
+    size_t _free = 0;
+    /** The segment being appended to, or -1 */
+    int _tail = -1;
+    uint32_t _sequence = 0;
+    _Slot *_slots = NULL;
+    size_t _capacity = 0;
+    /** Slots in use, counting _deleted ones */
+    size_t _used = 0;
+    size_t _keys = 0;
+    /** One record, for put() and remove() */
+    uint8_t *_record = NULL;
+    /** One record, for compaction and replay */
+    uint8_t *_copy = NULL;
+    RAMEEPROMKVStats _stats;
+
+    int _address(size_t segment) {
+        return (_first + (int)(segment * _segmentBlocks)) * (int)_eeprom.blockSize();
+    }
+    size_t _segmentOf(uint32_t address) {
+        return (address / _eeprom.blockSize() - _first) / _segmentBlocks;
+    }
+    bool _scan(size_t segment);
+    _Slot *_find(const char *key, size_t keyLength, uint32_t hash);
+    _Slot *_insert(uint32_t hash);
+    bool _grow(void);
+    void _point(_Slot *slot, uint32_t hash, uint32_t address, size_t size, bool tombstone);
+    bool _append(const uint8_t *record, size_t size, uint32_t &address, bool compacting);
+    bool _open(void);
+    bool _write(int address, const uint8_t *data, size_t length);
+    bool _compactOne(size_t garbage);
+    /**
+     * The bytes compacting segment would have to copy
+     */
+    size_t _kept(size_t segment, size_t oldest) {
+        return _segments[segment].live - ((segment == oldest) ? _segments[segment].tombstones : 0);
+    }
+    bool _erase(size_t segment);
+    static size_t _size(const uint8_t *record);
+    static uint32_t _hash(const uint8_t *data, size_t length, uint32_t hash = 2166136261UL);
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMKV(const RAMEEPROMKV &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMKV &operator=(const RAMEEPROMKV &other);
+};
+
+#endif // RAM_EEPROM_KV_h
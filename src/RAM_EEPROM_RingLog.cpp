@@ -0,0 +1,345 @@
+/*
+  RAM_EEPROM_RingLog.cpp - Circular append log for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "RAM_EEPROM_RingLog.h"
+
+/*
+ * Every block of the ring is
+ *
+ *   sequence (4), hash (4), records, 0 padding
+ *
+ * and a record is a length (1), a check (2) and that many bytes.  A length
+ * of 0 ends the block.  The hash is of the sequence, and the check is the
+ * low 16 bits of the hash of the sequence, length and bytes, so a record
+ * left from the last time round doesn't pass, and a torn one only passes
+ * about once in 65536.  Block n of the ring holds
+ * sequence s + n until the newest block, and the blocks after it are from
+ * the last time round, s + n - count, or have never been written.
+ *
+ * A block is written whole when it is started, and after that only the
+ * records added to it, so a reset part way through a write can only tear
+ * the records that write was adding.
+ */
+
+/**
+ * Sets up a log on blocks of eeprom
+ *
+ * Nothing is touched until begin().
+ *
+ * @param eeprom The E2.  It has to have a block size of more than 11.
+ * @param first  The first block to use
+ * @param count  The number of blocks to use
+ * @param group  How many appends to collect before writing
+ */
+RAMEEPROMRingLog::RAMEEPROMRingLog(RAMEEPROMClass &eeprom, int first, int count, uint16_t group)
+ : _eeprom(eeprom), _first(first), _count(count), _group((group > 0) ? group : 1)
+{
+}
+
+RAMEEPROMRingLog::~RAMEEPROMRingLog()
+{
+    delete [] _block;
+    delete [] _read;
+}
+
+/**
+ * Finds the newest block
+ *
+ * @return true on success, false if the block range isn't in the E2
+ */
+bool RAMEEPROMRingLog::begin(void) {
+    size_t blockSize = _eeprom.blockSize();
+    uint32_t base, sequence;
+    size_t low, high;
+
+    delete [] _block;
+    delete [] _read;
+    _block = NULL;
+    _read = NULL;
+    _empty = true;
+    _waiting = 0;
+    _probes = 0;
+    if ((blockSize <= _headerSize + _recordHeader) || (_first < 0) || (_count < 1)
+        || ((size_t)(_first + _count) > _eeprom.blocks())) {
+        return false;
+    }
+    _block = new uint8_t[blockSize]();
+    _read = new uint8_t[blockSize];
+    // Block 0 is the newest if it was torn going round again, so then the
+    // sequence starts at block 1
+    for (low = 0; (low < 2) && (low < (size_t)_count); low++) {
+        if (_load(low, _read, base)) {
+            break;
+        }
+    }
+    if ((low < 2) && (low < (size_t)_count)) {
+        // The last block with base + n is the newest
+        base -= low;
+        high = _count - 1;
+        while (low < high) {
+            size_t middle = low + (high - low + 1) / 2;
+            if (_load(middle, _read, sequence) && (sequence == base + middle)) {
+                low = middle;
+            } else {
+                high = middle - 1;
+            }
+        }
+        _head = low;
+        _empty = false;
+    }
+    if (_empty) {
+        // The first append goes in block 0 with sequence 1
+        _head = _count - 1;
+        _sequence = 0;
+        _used = blockSize;
+    } else {
+        _load(_head, _block, _sequence);
+        // Appends go over anything torn after the last good record
+        _used = _end(_block, blockSize, _sequence);
+        memset(&_block[_used], 0, blockSize - _used);
+        _written = _used;
+    }
+    rewind();
+    return true;
+}
+
+/**
+ * Adds a record to the log
+ *
+ * @param data   The record
+ * @param length Its length, 1 to maxRecord()
+ *
+ * @return true on success, false if it is too long or the write failed
+ */
+bool RAMEEPROMRingLog::append(const void *data, size_t length) {
+    size_t blockSize = _eeprom.blockSize();
+    if ((_block == NULL) || (length == 0) || (length > maxRecord())) {
+        return false;
+    }
+    if (_used + _recordHeader + length > blockSize) {
+        // This block is full, so on to the oldest one
+        if ((_waiting > 0) && !_write()) {
+            return false;
+        }
+        _head = (_head + 1) % _count;
+        _sequence++;
+        memset(_block, 0, blockSize);
+        memcpy(_block, &_sequence, sizeof(_sequence));
+        uint32_t hash = _hash(_block, sizeof(_sequence));
+        memcpy(&_block[4], &hash, sizeof(hash));
+        _used = _headerSize;
+        _written = 0;
+    }
+    _block[_used] = length;
+    memcpy(&_block[_used + _recordHeader], data, length);
+    uint16_t check = _check(&_block[_used], _sequence);
+    memcpy(&_block[_used + 1], &check, sizeof(check));
+    _used += _recordHeader + length;
+    _empty = false;
+    _waiting++;
+    if ((_waiting >= _group) || (_used + _recordHeader + 1 > blockSize)) {
+        return _write();
+    }
+    return true;
+}
+
+/**
+ * Writes any appends that are waiting
+ *
+ * @return true on success, false if the write failed
+ */
+bool RAMEEPROMRingLog::flush(void) {
+    return (_waiting == 0) || _write();
+}
+
+/**
+ * Goes back to the oldest record for next()
+ */
+void RAMEEPROMRingLog::rewind(void) {
+    _step = 1;
+    _offset = _headerSize;
+}
+
+/**
+ * Reads the next record, oldest first, including ones not written yet
+ *
+ * @param buffer Where to put it
+ * @param length The size of buffer.  Only this much of the record is read.
+ *
+ * @return The length of the record, or -1 if there are no more
+ */
+int RAMEEPROMRingLog::next(void *buffer, size_t length) {
+    size_t blockSize = _eeprom.blockSize();
+    if ((_block == NULL) || _empty) {
+        return -1;
+    }
+    while (_step <= (size_t)_count) {
+        size_t block = (_head + _step) % _count;
+        uint8_t *data = (_step == (size_t)_count) ? _block : _read;
+        uint32_t expect = _sequence - (_count - _step);
+        if (_offset == _headerSize) {
+            uint32_t sequence;
+            // Skip anything that isn't part of this time round
+            if ((data == _read) && (!_load(block, _read, sequence)
+                || (sequence != expect))) {
+                _step++;
+                continue;
+            }
+        }
+        int size = _record(data, _offset, blockSize, expect);
+        if (size > 0) {
+            if (length > 0) {
+                memcpy(buffer, &data[_offset + _recordHeader], ((size_t)size < length) ? size : length);
+            }
+            _offset += _recordHeader + size;
+            return size;
+        }
+        _step++;
+        _offset = _headerSize;
+    }
+    return -1;
+}
+
+/**
+ * Reads the newest record
+ *
+ * If every record in the newest block was torn, it comes from the block
+ * before.
+ *
+ * @param buffer Where to put it
+ * @param length The size of buffer.  Only this much of the record is read.
+ *
+ * @return The length of the record, or -1 if the log is empty
+ */
+int RAMEEPROMRingLog::last(void *buffer, size_t length) {
+    size_t blockSize = _eeprom.blockSize();
+    const uint8_t *data = _block;
+    uint8_t *before = NULL;
+    int ret = -1;
+    if ((_block == NULL) || _empty) {
+        return -1;
+    }
+    if ((_used == _headerSize) && (_count > 1)) {
+        uint32_t sequence;
+        // Not _read, as that would move next()
+        before = new uint8_t[blockSize];
+        if (_load((_head + _count - 1) % _count, before, sequence) && (sequence == _sequence - 1)) {
+            data = before;
+        }
+    }
+    uint32_t sequence = (data == _block) ? _sequence : _sequence - 1;
+    size_t offset = _headerSize;
+    for (;;) {
+        int size = _record(data, offset, blockSize, sequence);
+        if (size < 0) {
+            break;
+        }
+        if (length > 0) {
+            memcpy(buffer, &data[offset + _recordHeader], ((size_t)size < length) ? size : length);
+        }
+        ret = size;
+        offset += _recordHeader + size;
+    }
+    delete [] before;
+    return ret;
+}
+
+/**
+ * Reads block and checks its header
+ *
+ * @return true if it has a good hash
+ */
+bool RAMEEPROMRingLog::_load(size_t block, uint8_t *buffer, uint32_t &sequence) {
+    uint32_t hash;
+    _probes++;
+    if (!_eeprom.readBlock(_first + block, buffer)) {
+        return false;
+    }
+    memcpy(&hash, &buffer[4], sizeof(hash));
+    memcpy(&sequence, buffer, sizeof(sequence));
+    return hash == _hash(buffer, sizeof(sequence));
+}
+
+/**
+ * Writes the newest block, or just the records added to it since it was
+ * last written and the 0 after them
+ */
+bool RAMEEPROMRingLog::_write(void) {
+    size_t blockSize = _eeprom.blockSize();
+    bool ok;
+    if (_written == 0) {
+        ok = _eeprom.writeBlock(_first + _head, _block);
+    } else {
+        size_t end = (_used < blockSize) ? _used + 1 : blockSize;
+        ok = _eeprom.writeBytes((int)((_first + _head) * blockSize + _written), &_block[_written], end - _written);
+    }
+    if (!ok) {
+        return false;
+    }
+    _written = _used;
+    _waiting = 0;
+    return true;
+}
+
+/**
+ * The length of the record at offset in block
+ *
+ * @return The length, or -1 if there isn't a good record there
+ */
+int RAMEEPROMRingLog::_record(const uint8_t *block, size_t offset, size_t size, uint32_t sequence) {
+    uint16_t check;
+    if ((offset + _recordHeader > size) || (block[offset] == 0)
+        || (offset + _recordHeader + block[offset] > size)) {
+        return -1;
+    }
+    memcpy(&check, &block[offset + 1], sizeof(check));
+    return (check == _check(&block[offset], sequence)) ? block[offset] : -1;
+}
+
+/**
+ * The check of the record starting at record
+ */
+uint16_t RAMEEPROMRingLog::_check(const uint8_t *record, uint32_t sequence) {
+    uint32_t hash = _hash((const uint8_t *)&sequence, sizeof(sequence));
+    hash = _hash(record, 1, hash);
+    return (uint16_t)_hash(&record[_recordHeader], record[0], hash);
+}
+
+/**
+ * Where the good records in block end
+ */
+size_t RAMEEPROMRingLog::_end(const uint8_t *block, size_t size, uint32_t sequence) {
+    size_t offset = _headerSize;
+    int length;
+    while ((length = _record(block, offset, size, sequence)) > 0) {
+        offset += _recordHeader + length;
+    }
+    return offset;
+}
+
+/**
+ * FNV-1a
+ */
+uint32_t RAMEEPROMRingLog::_hash(const uint8_t *data, size_t length, uint32_t hash) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
@@ -0,0 +1,140 @@
+/*
+  RAM_EEPROM_RingLog.h - Circular append log for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RAM_EEPROM_RINGLOG_h
+#define RAM_EEPROM_RINGLOG_h
+
+#include "RAM_EEPROM.h"
+
+/**
+ * Records appended round a range of blocks, the oldest written over first
+ *
+ * This is the "write at the next address and wrap at the end" pattern of
+ * the eeprom_write example, with records that know where they are:
+ *
+ * @code
+ * RAMEEPROMRingLog samples(EEPROM, 0, 64);
+ * samples.begin();         // Finds where it left off
+ * samples.append(&value, sizeof(value));
+ *
+ * samples.rewind();
+ * while (samples.next(&value, sizeof(value)) >= 0) {
+ *     ...
+ * }
+ * @endcode
+ *
+ * Records are packed into blocks and each block carries a sequence number
+ * one more than the block before it, and a hash.  The sequence numbers go
+ * up round the ring until the newest block, so begin() finds it with a
+ * binary search, reading about log2(blocks) of them instead of all of them.
+ * Records aren't numbered themselves; the number is the block's.  A block
+ * whose header was torn by a reset fails its hash and the log ends at the
+ * block before it.
+ *
+ * Once a block has been started, writes to it only add records after the
+ * ones already there, and each record has a 16 bit check, so a reset while
+ * appending loses that append and no more.
+ *
+ * With a group size above 1, appends collect in RAM and the newest block is
+ * written every group appends (or on flush()), so a burst of small records
+ * costs one write instead of one each.  A block is always written when it
+ * fills.  Appends that haven't been written are lost in a reset.
+ */
+class RAMEEPROMRingLog {
+public:
+    RAMEEPROMRingLog(RAMEEPROMClass &eeprom, int first, int count, uint16_t group = 1);
+    ~RAMEEPROMRingLog();
+
+    bool begin(void);
+    bool append(const void *data, size_t length);
+    bool flush(void);
+    void rewind(void);
+    int next(void *buffer, size_t length);
+    int last(void *buffer, size_t length);
+
+    /**
+     * The biggest record that fits in a block
+     */
+    size_t maxRecord(void) {
+        size_t size = _eeprom.blockSize();
+        return (size > _headerSize + _recordHeader) ? size - _headerSize - _recordHeader : 0;
+    }
+    /**
+     * The sequence number of the newest block, 0 if the log is empty.  It
+     * goes up by one for each block, not each record.
+     */
+    uint32_t sequence(void) {
+        return _empty ? 0 : _sequence;
+    }
+    /**
+     * The number of appends waiting for flush()
+     */
+    uint16_t waiting(void) {
+        return _waiting;
+    }
+    /**
+     * The blocks begin() read to find the newest one
+     */
+    size_t probes(void) {
+        return _probes;
+    }
+
+protected:
+    /** sequence (4), hash of the sequence (4) */
+    static const size_t _headerSize = 8;
+    /** length (1), check (2) */
+    static const size_t _recordHeader = 3;
+
+    RAMEEPROMClass &_eeprom;
+    int _first;
+    int _count;
+    uint16_t _group;
+    /** The newest block, as an offset from _first */
+    size_t _head = 0;
+    uint32_t _sequence = 0;
+    bool _empty = true;
+    /** The newest block, with the appends not written yet */
+    uint8_t *_block = NULL;
+    size_t _used = 0;
+    /** How much of _block is in the E2.  0 until it has been written once. */
+    size_t _written = 0;
+    uint16_t _waiting = 0;
+    /** Where next() is: blocks after the head, and bytes into it */
+    size_t _step = 0;
+    size_t _offset = 0;
+    uint8_t *_read = NULL;
+    size_t _probes = 0;
+
+    bool _load(size_t block, uint8_t *buffer, uint32_t &sequence);
+    bool _write(void);
+    static int _record(const uint8_t *block, size_t offset, size_t size, uint32_t sequence);
+    static uint16_t _check(const uint8_t *record, uint32_t sequence);
+    static size_t _end(const uint8_t *block, size_t size, uint32_t sequence);
+    static uint32_t _hash(const uint8_t *data, size_t length, uint32_t hash = 2166136261UL);
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMRingLog(const RAMEEPROMRingLog &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMRingLog &operator=(const RAMEEPROMRingLog &other);
+};
+
+#endif // RAM_EEPROM_RINGLOG_h
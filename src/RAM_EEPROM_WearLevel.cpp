@@ -0,0 +1,404 @@
+/*
+  RAM_EEPROM_WearLevel.cpp - Wear leveling block remap for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "RAM_EEPROM_WearLevel.h"
+
+/*
+ * The E2 blocks are the physical blocks, then two map slots.  A slot is
+ *
+ *   magic (4), sequence (4), hash (4), logical blocks (4),
+ *   map (4 per logical block), wear (4 per physical block)
+ *
+ * and the one with the higher sequence and a good hash is current.
+ */
+
+/**
+ * Sets up wear leveling on the blocks of eeprom
+ *
+ * Nothing is touched until begin().
+ *
+ * @param eeprom The E2.  It has to have a block size.
+ * @param spares The number of physical blocks to keep free
+ */
+RAMEEPROMWearLevel::RAMEEPROMWearLevel(RAMEEPROMClass &eeprom, size_t spares)
+ : _eeprom(eeprom), _spares(spares)
+{
+}
+
+RAMEEPROMWearLevel::~RAMEEPROMWearLevel()
+{
+    delete [] _map;
+    delete [] _wear;
+    delete [] _pool;
+    delete [] _pending;
+    delete [] _image;
+    delete [] _dirty;
+}
+
+/**
+ * Loads the map, or sets up a new one if there isn't a good one
+ *
+ * A new map puts every logical block on the physical block with the same
+ * number, so an E2 that was used without wear leveling keeps its data.
+ *
+ * @return true on success, false if the E2 is too small or has no blocks
+ */
+bool RAMEEPROMWearLevel::begin(void) {
+    size_t total = _eeprom.blocks();
+    size_t blockSize = _eeprom.blockSize();
+    size_t slot = 0;
+    uint32_t sequence[2];
+    bool good[2];
+    size_t i;
+
+    delete [] _map;
+    delete [] _wear;
+    delete [] _pool;
+    delete [] _pending;
+    delete [] _image;
+    delete [] _dirty;
+    _map = NULL;
+    _wear = NULL;
+    _pool = NULL;
+    _pending = NULL;
+    _image = NULL;
+    _dirty = NULL;
+    if ((blockSize == 0) || (_spares == 0)) {
+        return false;
+    }
+    if (_spares >= total) {
+        return false;
+    }
+    /*
+     * Each slot block taken is one less physical and logical block in the
+     * map, so the smallest slot that fits is s blocks, where
+     *   header + 4 * (2 * (total - 2 * s) - spares) <= s * blockSize
+     */
+    slot = (_headerSize + 4 * (2 * total - _spares) + blockSize + 16 - 1) / (blockSize + 16);
+    if (2 * slot + _spares >= total) {
+        return false;
+    }
+    _slotBlocks = slot;
+    _physical = total - 2 * slot;
+    _logical = _physical - _spares;
+    _map = new uint32_t[_logical];
+    _wear = new uint32_t[_physical]();
+    _pool = new uint32_t[_physical];
+    _pending = new uint32_t[_physical];
+    _image = new uint8_t[2 * _slotBlocks * blockSize]();
+    _dirty = new bool[_slotBlocks]();
+    _poolCount = 0;
+    _pendingCount = 0;
+    _remaps = 0;
+
+    good[0] = _load(0, sequence[0]);
+    good[1] = _load(1, sequence[1]);
+    if (good[0] && good[1]) {
+        // Whichever is newer, allowing for the sequence wrapping
+        slot = ((int32_t)(sequence[1] - sequence[0]) > 0) ? 1 : 0;
+    } else {
+        slot = good[1] ? 1 : 0;
+    }
+    if (!good[slot]) {
+        for (i = 0; i < _logical; i++) {
+            _map[i] = i;
+        }
+        memset(_wear, 0, _physical * sizeof(uint32_t));
+        for (i = _logical; i < _physical; i++) {
+            _push(i);
+        }
+        _sequence = 0;
+        return commit();
+    }
+    _sequence = sequence[slot];
+    memcpy(_map, &_slot(slot)[_headerSize], _logical * sizeof(uint32_t));
+    memcpy(_wear, &_slot(slot)[_headerSize + _logical * sizeof(uint32_t)], _physical * sizeof(uint32_t));
+    // Everything the map doesn't use is free
+    memset(_pending, 0, _physical * sizeof(uint32_t));
+    for (i = 0; i < _logical; i++) {
+        _pending[_map[i]] = 1;
+    }
+    for (i = 0; i < _physical; i++) {
+        if (_pending[i] == 0) {
+            _push(i);
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads map slot into its part of _image and checks it
+ *
+ * @return true if it is a good map for this geometry
+ */
+bool RAMEEPROMWearLevel::_load(size_t slot, uint32_t &sequence) {
+    uint8_t *image = _slot(slot);
+    uint32_t header[4];
+    size_t bytes = (_logical + _physical) * sizeof(uint32_t);
+    size_t i;
+    _known[slot] = _eeprom.readBlocks(_physical + slot * _slotBlocks, _slotBlocks, image);
+    if (!_known[slot]) {
+        return false;
+    }
+    memcpy(header, image, sizeof(header));
+    if ((header[0] != _magic) || (header[3] != _logical)
+        || (header[2] != _hash(&image[_headerSize], bytes))) {
+        return false;
+    }
+    // Every logical block has to be on its own physical block
+    memset(_pending, 0, _physical * sizeof(uint32_t));
+    for (i = 0; i < _logical; i++) {
+        uint32_t block;
+        memcpy(&block, &image[_headerSize + i * sizeof(uint32_t)], sizeof(block));
+        if ((block >= _physical) || (_pending[block] != 0)) {
+            return false;
+        }
+        _pending[block] = 1;
+    }
+    sequence = header[1];
+    return true;
+}
+
+/**
+ * Reads logical block into buffer
+ *
+ * @return true on success, false if block doesn't exist
+ */
+bool RAMEEPROMWearLevel::readBlock(int block, uint8_t *buffer) {
+    return _good(block) && _eeprom.readBlocks(_map[block], 1, buffer);
+}
+
+/**
+ * Writes data to logical block, on the least written free physical block
+ *
+ * @return true on success, false if block doesn't exist or the E2 failed
+ */
+bool RAMEEPROMWearLevel::writeBlock(int block, const uint8_t *data) {
+    if (!_good(block) || (data == NULL)) {
+        return false;
+    }
+    int physical = _allocate();
+    if (physical < 0) {
+        return false;
+    }
+    if (!_eeprom.writeBlocks(physical, 1, data)) {
+        _push(physical);
+        return false;
+    }
+    _remap(block, physical);
+    return true;
+}
+
+/**
+ * Copies logical block src to logical block dest
+ *
+ * @return true on success, false if either block doesn't exist
+ */
+bool RAMEEPROMWearLevel::copyBlock(int dest, int src) {
+    if (!_good(dest) || !_good(src)) {
+        return false;
+    }
+    if (dest == src) {
+        return true;
+    }
+    int physical = _allocate();
+    if (physical < 0) {
+        return false;
+    }
+    if (!_eeprom.copyBlock(physical, _map[src])) {
+        _push(physical);
+        return false;
+    }
+    _remap(dest, physical);
+    return true;
+}
+
+/**
+ * Saves the map and wear counts, and commits the E2
+ *
+ * The blocks written since the last commit() are only safe after this.
+ * Only the blocks of the slot that changed are written.  A reset part way
+ * leaves a slot with a bad hash, and the other one is still good.
+ *
+ * @return true on success, false if the map couldn't be written or the E2
+ *         couldn't be committed
+ */
+bool RAMEEPROMWearLevel::commit(void) {
+    size_t blockSize = _eeprom.blockSize();
+    size_t bytes = (_logical + _physical) * sizeof(uint32_t);
+    uint32_t header[4];
+    size_t slot, i, end;
+    if (_map == NULL) {
+        return false;
+    }
+    header[0] = _magic;
+    header[1] = _sequence + 1;
+    header[3] = _logical;
+    slot = header[1] & 1;
+    uint8_t *image = _slot(slot);
+    for (i = 0; i < _slotBlocks; i++) {
+        _dirty[i] = !_known[slot];
+    }
+    _update(image, _headerSize, _map, _logical * sizeof(uint32_t));
+    _update(image, _headerSize + _logical * sizeof(uint32_t), _wear, _physical * sizeof(uint32_t));
+    header[2] = _hash(&image[_headerSize], bytes);
+    memcpy(image, header, sizeof(header));
+    _dirty[0] = true;
+    // The other slot keeps the last map until this one is down
+    _known[slot] = false;
+    for (i = 0; i < _slotBlocks; i = end) {
+        for (end = i; (end < _slotBlocks) && _dirty[end]; end++) {
+        }
+        if ((end > i) && !_eeprom.writeBlocks(_physical + slot * _slotBlocks + i, end - i, &image[i * blockSize])) {
+            return false;
+        }
+        for (; (end < _slotBlocks) && !_dirty[end]; end++) {
+        }
+    }
+    _known[slot] = true;
+    if (!_eeprom.commit()) {
+        return false;
+    }
+    _sequence = header[1];
+    while (_pendingCount > 0) {
+        _push(_pending[--_pendingCount]);
+    }
+    return true;
+}
+
+/**
+ * Gets the wear spread over the blocks
+ */
+void RAMEEPROMWearLevel::wearStats(RAMEEPROMWearStats &stats) {
+    uint64_t total = 0;
+    stats = RAMEEPROMWearStats();
+    stats.remaps = _remaps;
+    if ((_wear == NULL) || (_physical == 0)) {
+        return;
+    }
+    // The first block of slot 1 has every odd sequence, and of slot 0
+    // every even one
+    stats.mapWear = (_sequence / 2) + (_sequence & 1);
+    stats.maxWear = stats.mapWear;
+    stats.minWear = _wear[0];
+    for (size_t i = 0; i < _physical; i++) {
+        if (_wear[i] < stats.minWear) {
+            stats.minWear = _wear[i];
+        }
+        if (_wear[i] > stats.maxWear) {
+            stats.maxWear = _wear[i];
+        }
+        total += _wear[i];
+    }
+    stats.meanWear = total / _physical;
+}
+
+/**
+ * Copies data into image at offset, marking the blocks that change dirty
+ */
+void RAMEEPROMWearLevel::_update(uint8_t *image, size_t offset, const void *data, size_t length) {
+    size_t blockSize = _eeprom.blockSize();
+    const uint8_t *bytes = (const uint8_t *)data;
+    while (length > 0) {
+        size_t count = blockSize - (offset % blockSize);
+        if (count > length) {
+            count = length;
+        }
+        if (memcmp(&image[offset], bytes, count) != 0) {
+            memcpy(&image[offset], bytes, count);
+            _dirty[offset / blockSize] = true;
+        }
+        offset += count;
+        bytes += count;
+        length -= count;
+    }
+}
+
+/**
+ * Takes the least written block out of the pool, committing first if the
+ * pool is empty
+ *
+ * @return The physical block, or -1 if there isn't one
+ */
+int RAMEEPROMWearLevel::_allocate(void) {
+    if ((_poolCount == 0) && (!commit() || (_poolCount == 0))) {
+        return -1;
+    }
+    uint32_t block = _pool[0];
+    uint32_t last = _pool[--_poolCount];
+    size_t i = 0;
+    // Sift the last block down from the top
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= _poolCount) {
+            break;
+        }
+        if ((child + 1 < _poolCount) && (_wear[_pool[child + 1]] < _wear[_pool[child]])) {
+            child++;
+        }
+        if (_wear[last] <= _wear[_pool[child]]) {
+            break;
+        }
+        _pool[i] = _pool[child];
+        i = child;
+    }
+    if (_poolCount > 0) {
+        _pool[i] = last;
+    }
+    return block;
+}
+
+/**
+ * Puts block in the pool
+ */
+void RAMEEPROMWearLevel::_push(uint32_t block) {
+    size_t i = _poolCount++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (_wear[_pool[parent]] <= _wear[block]) {
+            break;
+        }
+        _pool[i] = _pool[parent];
+        i = parent;
+    }
+    _pool[i] = block;
+}
+
+/**
+ * Points block at physical, which was just written
+ */
+void RAMEEPROMWearLevel::_remap(int block, uint32_t physical) {
+    if (_wear[physical] != 0xFFFFFFFF) {
+        _wear[physical]++;
+    }
+    _pending[_pendingCount++] = _map[block];
+    _map[block] = physical;
+    _remaps++;
+}
+
+/**
+ * FNV-1a over the map
+ */
+uint32_t RAMEEPROMWearLevel::_hash(const uint8_t *data, size_t length) {
+    uint32_t hash = 2166136261UL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
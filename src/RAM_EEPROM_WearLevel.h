@@ -0,0 +1,145 @@
+/*
+  RAM_EEPROM_WearLevel.h - Wear leveling block remap for RAMEEPROMClass
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RAM_EEPROM_WEARLEVEL_h
+#define RAM_EEPROM_WEARLEVEL_h
+
+#include "RAM_EEPROM.h"
+
+/**
+ * Wear counts from RAMEEPROMWearLevel::wearStats()
+ *
+ * The counts are writes to each block.  maxWear - meanWear is how far the
+ * worst block is ahead of the average, and the worst block can be the first
+ * block of a map slot, which every other commit() writes.
+ */
+struct RAMEEPROMWearStats {
+    uint32_t minWear;   //!< Writes to the least written physical block
+    uint32_t maxWear;   //!< Writes to the most written block, map slots included
+    uint32_t meanWear;  //!< The mean over the physical blocks, rounded down
+    uint32_t mapWear;   //!< Writes to the most written block of the map slots
+    uint32_t remaps;    //!< Logical blocks moved to a new physical block
+};
+
+/**
+ * Spreads block writes over the whole E2
+ *
+ * Logical blocks are mapped to physical blocks of the E2 it sits on.  Every
+ * writeBlock() or copyBlock() goes to the least written free physical
+ * block and the old one goes back in the free pool, so a few blocks that
+ * are written over and over wear the spares and each other instead of the
+ * same addresses.
+ *
+ * @code
+ * RAMEEPROMWearLevel blocks(EEPROM, 8);  // 8 spare blocks
+ * blocks.begin();
+ * blocks.writeBlock(0, config);
+ * blocks.commit();
+ * @endcode
+ *
+ * The map and the wear counts are kept in two slots at the end of the E2
+ * and written to the older one by commit(), so a crash while committing
+ * leaves the last map.  Blocks freed since the last commit() aren't reused
+ * until the map that moved them away is saved, so until then the old map
+ * still points at good data.  If the pool runs dry, writeBlock() commits by
+ * itself, so more spares means fewer commits.  commit() only writes the
+ * blocks of the slot that changed since that slot was last written, and
+ * the first one, which has the sequence and the hash.
+ */
+class RAMEEPROMWearLevel {
+public:
+    RAMEEPROMWearLevel(RAMEEPROMClass &eeprom, size_t spares);
+    ~RAMEEPROMWearLevel();
+
+    bool begin(void);
+    bool readBlock(int block, uint8_t *buffer);
+    bool writeBlock(int block, const uint8_t *data);
+    bool copyBlock(int dest, int src);
+    bool commit(void);
+    void wearStats(RAMEEPROMWearStats &stats);
+
+    /**
+     * The number of logical blocks
+     */
+    size_t blocks(void) {
+        return _logical;
+    }
+    size_t blockSize(void) {
+        return _eeprom.blockSize();
+    }
+    /**
+     * The physical block that logical block is in, or -1
+     */
+    int physical(int block) {
+        return _good(block) ? (int)_map[block] : -1;
+    }
+
+protected:
+    /** Map header magic, "RWLM" */
+    static const uint32_t _magic = 0x4D4C5752;
+    static const size_t _headerSize = 16;
+
+    RAMEEPROMClass &_eeprom;
+    size_t _spares;
+    size_t _logical = 0;
+    size_t _physical = 0;
+    /** The size of one map slot, in blocks */
+    size_t _slotBlocks = 0;
+    uint32_t _sequence = 0;
+    uint32_t _remaps = 0;
+    /** Logical to physical */
+    uint32_t *_map = NULL;
+    /** Writes to each physical block */
+    uint32_t *_wear = NULL;
+    /** Free blocks, a min heap on _wear */
+    uint32_t *_pool = NULL;
+    size_t _poolCount = 0;
+    /** Blocks freed since the last commit() */
+    uint32_t *_pending = NULL;
+    size_t _pendingCount = 0;
+    /** What is in each map slot, where commit() builds the next one */
+    uint8_t *_image = NULL;
+    /** false if a slot's part of _image might not match the E2 */
+    bool _known[2] = {false, false};
+    /** The blocks of the slot commit() has to write */
+    bool *_dirty = NULL;
+
+    bool _good(int block) {
+        return (_map != NULL) && (block >= 0) && ((size_t)block < _logical);
+    }
+    bool _load(size_t slot, uint32_t &sequence);
+    uint8_t *_slot(size_t slot) {
+        return &_image[slot * _slotBlocks * _eeprom.blockSize()];
+    }
+    void _update(uint8_t *image, size_t offset, const void *data, size_t length);
+    int _allocate(void);
+    void _push(uint32_t block);
+    void _remap(int block, uint32_t physical);
+    static uint32_t _hash(const uint8_t *data, size_t length);
+
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMWearLevel(const RAMEEPROMWearLevel &other);
+    /**
+     * Copying not allowed
+     */
+    RAMEEPROMWearLevel &operator=(const RAMEEPROMWearLevel &other);
+};
+
+#endif // RAM_EEPROM_WEARLEVEL_h
@@ -0,0 +1,641 @@
+/**
+ * @file       test/bench.cpp
+ * @brief   Microbenchmarks for the RAMEEPROMClass hot paths
+ * @details
+ *
+ * Times read(), write(), get<T>()/put<T>() for several sizes of T, and
+ * readBlock(), writeBlock() and copyBlock() for several block sizes, on
+ * several sizes of E2.  Each one is run a few times and the best time is
+ * kept, which is the least noisy number on a busy machine.
+ *
+ * Usage: run_bench [-o results.csv] [-b baseline.csv] [-t tolerance]
+ *
+ *  -o  Write the results as CSV (name,ns_per_op,gb_per_s)
+ *  -b  Compare against a baseline written by -o.  Anything that is more
+ *      than tolerance slower than the baseline is a regression, and the
+ *      exit code is 1 if there are any.  Times are compared relative to
+ *      the "calibrate" run (a plain loop over an array), so a baseline
+ *      from a faster or slower machine still works.
+ *  -t  The tolerance as a fraction.  The default is 0.25.
+ *
+ * Run with "make bench".  "make bench-baseline" saves a baseline and
+ * "make bench-compare" checks against it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include "Arduino.h"
+#include "RAM_EEPROM.h"
+#include "RAM_EEPROM_WearLevel.h"
+#include "RAM_EEPROM_CRC.h"
+#include "RAM_EEPROM_Image.h"
+#include "RAM_EEPROM_KV.h"
+#include "RAM_EEPROM_Allocator.h"
+#include "RAM_EEPROM_Backend.h"
+#include "RAM_EEPROM_Cache.h"
+#include "RAM_EEPROM_RingLog.h"
+
+/** How long each timing run has to be, at least */
+#define BENCH_MIN_NS 10000000.0
+/** How many timing runs to take the best of */
+#define BENCH_RUNS 5
+
+struct Result {
+    std::string name;
+    double ns;
+    double gbps;
+};
+
+/** Keeps the compiler from throwing the reads away */
+static volatile uint64_t sink;
+
+static std::vector<Result> results;
+
+static double now(void)
+{
+    return std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+/**
+ * Times fn, which does ops operations moving bytes bytes in total, and
+ * records the best ns per operation.
+ */
+template<typename F>
+static void bench(const std::string &name, size_t ops, size_t bytes, F fn)
+{
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        size_t reps = 0;
+        double start = now();
+        double elapsed;
+        do {
+            fn();
+            reps++;
+            elapsed = now() - start;
+        } while (elapsed < BENCH_MIN_NS);
+        double ns = elapsed / ((double)reps * ops);
+        if ((run == 0) || (ns < best)) {
+            best = ns;
+        }
+    }
+    Result r;
+    r.name = name;
+    r.ns = best;
+    r.gbps = (double)bytes / ops / best;
+    results.push_back(r);
+    printf("%-40s %10.3f ns/op %8.3f GB/s\n", r.name.c_str(), r.ns, r.gbps);
+    fflush(stdout);
+}
+
+template<size_t N>
+struct Blob {
+    uint8_t data[N];
+};
+
+template<size_t N>
+static void benchGetPut(RAMEEPROMClass &e, const std::string &suffix)
+{
+    size_t count = e.size() / N;
+    char name[64];
+    Blob<N> value;
+    memset(&value, 0x5A, sizeof(value));
+    snprintf(name, sizeof(name), "get<%u>", (unsigned)N);
+    bench(name + suffix, count, count * N, [&]() {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += e.get(i * N, value).data[0];
+        }
+        sink = sum;
+    });
+    snprintf(name, sizeof(name), "put<%u>", (unsigned)N);
+    bench(name + suffix, count, count * N, [&]() {
+        for (size_t i = 0; i < count; i++) {
+            e.put(i * N, value);
+        }
+    });
+}
+
+/**
+ * A plain byte loop and memcpy over an array, for scaling the other times
+ */
+static void benchCalibrate(void)
+{
+    size_t size = 1024 * 1024;
+    std::vector<uint8_t> from(size, 1);
+    std::vector<uint8_t> to(size, 0);
+    bench("calibrate", size, size, [&]() {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < size; i++) {
+            sum += from[i];
+        }
+        memcpy(&to[0], &from[0], size);
+        sink = sum + to[size - 1];
+    });
+}
+
+static void benchDevice(size_t size)
+{
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), "/size=%u", (unsigned)size);
+    {
+        RAMEEPROMClass e((void *)NULL, size);
+        bench(std::string("read") + suffix, size, size, [&]() {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < size; i++) {
+                sum += e.read(i);
+            }
+            sink = sum;
+        });
+        bench(std::string("write") + suffix, size, size, [&]() {
+            for (size_t i = 0; i < size; i++) {
+                e.write(i, i);
+            }
+        });
+        benchGetPut<1>(e, suffix);
+        benchGetPut<4>(e, suffix);
+        benchGetPut<8>(e, suffix);
+        benchGetPut<64>(e, suffix);
+    }
+    const uint8_t blockSizes[] = { 16, 64, 255 };
+    for (size_t b = 0; b < sizeof(blockSizes); b++) {
+        uint8_t blockSize = blockSizes[b];
+        RAMEEPROMClass e((void *)NULL, size, blockSize);
+        int blocks = e.blocks();
+        uint8_t buffer[256];
+        char name[96];
+        memset(buffer, 0xA5, sizeof(buffer));
+        snprintf(name, sizeof(name), "%s/block=%u", suffix, blockSize);
+        bench(std::string("readBlock") + name, blocks, blocks * blockSize, [&]() {
+            uint64_t sum = 0;
+            for (int i = 0; i < blocks; i++) {
+                e.readBlock(i, buffer);
+                sum += buffer[0];
+            }
+            sink = sum;
+        });
+        bench(std::string("writeBlock") + name, blocks, blocks * blockSize, [&]() {
+            for (int i = 0; i < blocks; i++) {
+                e.writeBlock(i, buffer);
+            }
+        });
+        bench(std::string("copyBlock") + name, blocks, blocks * blockSize, [&]() {
+            for (int i = 0; i < blocks; i++) {
+                e.copyBlock(i, blocks - 1 - i);
+            }
+        });
+    }
+}
+
+/**
+ * The block hot path through the wear leveling map, next to the plain
+ * readBlock/writeBlock rows for the same size and block
+ */
+static void benchWearLevel(size_t size)
+{
+    const uint8_t blockSize = 64;
+    RAMEEPROMClass e((void *)NULL, size, blockSize);
+    RAMEEPROMWearLevel wl(e, e.blocks() / 16);
+    uint8_t buffer[blockSize];
+    char name[96];
+    wl.begin();
+    int blocks = wl.blocks();
+    memset(buffer, 0xA5, sizeof(buffer));
+    snprintf(name, sizeof(name), "/size=%u/block=%u", (unsigned)size, blockSize);
+    bench(std::string("wl readBlock") + name, blocks, blocks * blockSize, [&]() {
+        uint64_t sum = 0;
+        for (int i = 0; i < blocks; i++) {
+            wl.readBlock(i, buffer);
+            sum += buffer[0];
+        }
+        sink = sum;
+    });
+    bench(std::string("wl writeBlock") + name, blocks, blocks * blockSize, [&]() {
+        for (int i = 0; i < blocks; i++) {
+            wl.writeBlock(i, buffer);
+        }
+    });
+}
+
+/**
+ * Checking the whole image: a CRC32C of every byte against digest(), and
+ * what keeping the block CRCs up to date costs writeBlock()
+ */
+static void benchChecksums(size_t size)
+{
+    const uint8_t blockSize = 64;
+    uint8_t *image = new uint8_t[size];
+    RAMEEPROMClass e(image, size, blockSize);
+    int blocks = e.blocks();
+    uint8_t buffer[blockSize];
+    char name[96];
+    memset(image, 0x5A, size);
+    memset(buffer, 0xA5, sizeof(buffer));
+    e.checksums();
+    snprintf(name, sizeof(name), "/size=%u/block=%u", (unsigned)size, blockSize);
+    bench(std::string("crc32c image") + name, 1, size, [&]() {
+        sink = RAMEEPROMCrc32c(image, size);
+    });
+    bench(std::string("digest") + name, 1, size, [&]() {
+        sink = e.digest();
+    });
+    bench(std::string("crc writeBlock") + name, blocks, blocks * blockSize, [&]() {
+        for (int i = 0; i < blocks; i++) {
+            e.writeBlock(i, buffer);
+        }
+    });
+    e.verifyReads();
+    bench(std::string("crc readBlock") + name, blocks, blocks * blockSize, [&]() {
+        uint64_t sum = 0;
+        for (int i = 0; i < blocks; i++) {
+            e.readBlock(i, buffer);
+            sum += buffer[0];
+        }
+        sink = sum;
+    });
+    delete [] image;
+}
+
+/**
+ * Key lookups in a store of keys keys, and overwriting them over and over.
+ * The write amplification (bytes written to blocks per byte of key and
+ * value) isn't a time, so it is only printed.
+ */
+static void benchKV(size_t size, size_t keys)
+{
+    const uint8_t blockSize = 64;
+    RAMEEPROMClass e((void *)NULL, size, blockSize);
+    RAMEEPROMKV kv(e);
+    RAMEEPROMKVStats stats;
+    std::vector<std::string> names(keys);
+    uint32_t value = 0;
+    char name[96];
+    kv.begin();
+    for (size_t i = 0; i < keys; i++) {
+        snprintf(name, sizeof(name), "setting%u", (unsigned)i);
+        names[i] = name;
+        kv.put(name, value);
+    }
+    snprintf(name, sizeof(name), "/size=%u/keys=%u", (unsigned)size, (unsigned)keys);
+    bench(std::string("kv get") + name, keys, keys * sizeof(value), [&]() {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < keys; i++) {
+            kv.get(names[i].c_str(), value);
+            sum += value;
+        }
+        sink = sum;
+    });
+    kv.kvStats(stats);
+    uint64_t user = stats.userBytes;
+    uint64_t written = stats.writtenBytes;
+    bench(std::string("kv put") + name, keys, keys * sizeof(value), [&]() {
+        for (size_t i = 0; i < keys; i++) {
+            value++;
+            kv.put(names[i].c_str(), value);
+        }
+    });
+    kv.kvStats(stats);
+    printf("%-40s %10.3f bytes written per byte put, %u compactions\n", (std::string("kv write amplification") + name).c_str(),
+        (double)(stats.writtenBytes - written) / (stats.userBytes - user), stats.compactions);
+}
+
+/**
+ * Appending 8 byte samples one write at a time and in groups, and finding
+ * the newest block again at begin()
+ */
+static void benchRingLog(size_t size)
+{
+    const uint8_t blockSize = 64;
+    const size_t samples = 4096;
+    RAMEEPROMClass e((void *)NULL, size, blockSize);
+    uint64_t sample = 0;
+    char name[96];
+    snprintf(name, sizeof(name), "/size=%u/block=%u", (unsigned)size, blockSize);
+    for (uint16_t group = 1; group <= 16; group *= 16) {
+        RAMEEPROMRingLog ring(e, 0, e.blocks(), group);
+        char suffix[32];
+        ring.begin();
+        snprintf(suffix, sizeof(suffix), "/group=%u", group);
+        bench(std::string("ring append") + name + suffix, samples, samples * sizeof(sample), [&]() {
+            for (size_t i = 0; i < samples; i++) {
+                sample++;
+                ring.append(&sample, sizeof(sample));
+            }
+        });
+        ring.flush();
+    }
+    RAMEEPROMRingLog ring(e, 0, e.blocks());
+    bench(std::string("ring begin") + name, 1, blockSize, [&]() {
+        ring.begin();
+    });
+}
+
+/**
+ * Allocating and freeing on a half full E2 of half a million blocks, one
+ * block at a time and in runs
+ */
+static void benchAllocator(size_t size)
+{
+    const uint8_t blockSize = 32;
+    const size_t ops = 1024;
+    RAMEEPROMClass e((void *)NULL, size, blockSize);
+    RAMEEPROMAllocator blocks(e);
+    std::vector<int> taken(ops);
+    char name[96];
+    blocks.begin();
+    // Every other block, so the free ones are scattered
+    for (size_t i = 0; i < blocks.blocks() / 2; i++) {
+        blocks.allocate();
+    }
+    for (size_t i = 0; i < blocks.blocks() / 2; i += 2) {
+        blocks.free(blocks.firstBlock() + i);
+    }
+    snprintf(name, sizeof(name), "/size=%u/block=%u", (unsigned)size, blockSize);
+    bench(std::string("alloc allocate/free") + name, ops, ops * blockSize, [&]() {
+        for (size_t i = 0; i < ops; i++) {
+            taken[i] = blocks.allocate();
+        }
+        for (size_t i = 0; i < ops; i++) {
+            blocks.free(taken[i]);
+        }
+    });
+    bench(std::string("alloc allocate(8)/free") + name, ops, ops * 8 * blockSize, [&]() {
+        for (size_t i = 0; i < ops; i++) {
+            taken[i] = blocks.allocate((size_t)8);
+        }
+        for (size_t i = 0; i < ops; i++) {
+            blocks.free(taken[i], 8);
+        }
+    });
+}
+
+/**
+ * Bumping a counter cell with get() and put() and with fetchAdd().  The
+ * threaded version is in bench_concurrent.cpp.
+ */
+static void benchAtomics(size_t size)
+{
+    const size_t ops = 1024;
+    RAMEEPROMClass e((void *)NULL, size, 64);
+    char name[64];
+    e.put(64, (uint32_t)0);
+    snprintf(name, sizeof(name), "/size=%u", (unsigned)size);
+    bench(std::string("get/put counter") + name, ops, ops * 4, [&]() {
+        uint32_t count = 0;
+        for (size_t i = 0; i < ops; i++) {
+            e.put(64, e.get(64, count) + 1);
+        }
+    });
+    bench(std::string("fetchAdd<uint32_t>") + name, ops, ops * 4, [&]() {
+        for (size_t i = 0; i < ops; i++) {
+            e.fetchAdd(64, (uint32_t)1);
+        }
+    });
+}
+
+/**
+ * get() and put() through backends.  One with data() should cost the same
+ * as the get<8>/put<8> rows, and one without pays a virtual call each.
+ */
+static void benchBackends(size_t size)
+{
+    RAMEEPROMSlowConfig config = { 64, 100, 25, 5000 };
+    char suffix[64];
+    {
+        RAMEEPROMRamBackend ram;
+        RAMEEPROMClass e(ram, size);
+        snprintf(suffix, sizeof(suffix), "/size=%u/ram backend", (unsigned)size);
+        benchGetPut<8>(e, suffix);
+    }
+    {
+        RAMEEPROMSlowBackend device(config);
+        RAMEEPROMClass e(device, size);
+        snprintf(suffix, sizeof(suffix), "/size=%u/slow backend", (unsigned)size);
+        benchGetPut<8>(e, suffix);
+    }
+}
+
+/**
+ * The slow backend with a cache in front of it.  The virtual device time
+ * for a pass of get<8> and a pass of put<8> and commit() is printed for
+ * both, as the wall time doesn't show what the bus would cost.
+ */
+static void benchCache(size_t size)
+{
+    RAMEEPROMSlowConfig config = { 64, 100, 25, 5000 };
+    RAMEEPROMSlowBackend plain(config), device(config);
+    RAMEEPROMCacheBackend cache(device, 256, 64);
+    RAMEEPROMClass uncached(plain, size), cached(cache, size);
+    RAMEEPROMSlowStats slow;
+    RAMEEPROMCacheStats stats;
+    char suffix[64];
+    uint64_t value = 0;
+    snprintf(suffix, sizeof(suffix), "/size=%u/cached slow backend", (unsigned)size);
+    benchGetPut<8>(cached, suffix);
+    cached.commit();
+    RAMEEPROMClass *e2s[] = { &uncached, &cached };
+    RAMEEPROMSlowBackend *devices[] = { &plain, &device };
+    const char *names[] = { "slow backend", "cached slow backend" };
+    cache.clearCacheStats();
+    for (size_t k = 0; k < 2; k++) {
+        devices[k]->clearSlowStats();
+        for (size_t i = 0; i < size; i += 8) {
+            sink += e2s[k]->get(i, value);
+        }
+        for (size_t i = 0; i < size; i += 8) {
+            e2s[k]->put(i, value + i);
+        }
+        e2s[k]->commit();
+        devices[k]->slowStats(slow);
+        snprintf(suffix, sizeof(suffix), "device time/%s", names[k]);
+        printf("%-40s %10.3f per byte, %u reads, %u writes\n", suffix,
+            (double)slow.time / (2 * size), slow.reads, slow.writes);
+    }
+    cache.cacheStats(stats);
+    printf("%-40s %10.3f%% hits, %u read ahead, %u write backs\n", "cache", 100.0 * stats.hits / (stats.hits + stats.misses),
+        stats.prefetches, stats.writeBacks);
+}
+
+/**
+ * commit() of 64 blocks spread over an image file, with the file mapped and
+ * with it read into RAM and written back through io_uring or pwrite().
+ * Each one ends with the data on the disk, so this is mostly the disk.
+ */
+static void benchFile(size_t size)
+{
+    char filename[] = "/tmp/ram_eeprom_bench_XXXXXX";
+    const size_t blocks = 64;
+    size_t stride = size / blocks;
+    char name[64];
+    int fd = mkstemp(filename);
+    if (fd < 0) {
+        return;
+    }
+    close(fd);
+    for (int mode = 0; mode < 3; mode++) {
+        RAMEEPROMMmapBackend mapped(filename);
+        RAMEEPROMFileBackend file(filename, false, mode == 1);
+        RAMEEPROMBackend *backend = (mode == 0) ? (RAMEEPROMBackend *)&mapped : (RAMEEPROMBackend *)&file;
+        const char *names[] = { "mmap", "file/io_uring", "file/pwrite" };
+        RAMEEPROMClass e(*backend, size, 16);
+        if ((mode == 1) && !file.uring()) {
+            continue;
+        }
+        uint8_t value = 0;
+        snprintf(name, sizeof(name), "commit/%u blocks/size=%u/%s", (unsigned)blocks, (unsigned)size, names[mode]);
+        bench(name, blocks, blocks * 16, [&]() {
+            value++;
+            for (size_t i = 0; i < blocks; i++) {
+                e.write(i * stride, value);
+            }
+            e.commit();
+        });
+    }
+    unlink(filename);
+}
+
+/**
+ * Loading and saving image files, from a file already in the page cache
+ */
+static void benchImage(size_t size)
+{
+    RAMEEPROMClass e((void *)NULL, size);
+    FILE *hex = tmpfile();
+    FILE *bin = tmpfile();
+    char suffix[64];
+    for (size_t i = 0; i < size; i++) {
+        e.write(i, i * 7);
+    }
+    RAMEEPROMSaveHex(e, hex);
+    RAMEEPROMSaveBinary(e, bin);
+    snprintf(suffix, sizeof(suffix), "/size=%u", (unsigned)size);
+    bench(std::string("loadHex") + suffix, 1, size, [&]() {
+        rewind(hex);
+        RAMEEPROMLoadHex(e, hex);
+    });
+    bench(std::string("saveHex") + suffix, 1, size, [&]() {
+        rewind(hex);
+        RAMEEPROMSaveHex(e, hex);
+    });
+    bench(std::string("loadBinary") + suffix, 1, size, [&]() {
+        rewind(bin);
+        RAMEEPROMLoadBinary(e, bin);
+    });
+    fclose(hex);
+    fclose(bin);
+}
+
+static bool save(const char *filename)
+{
+    FILE *fd = fopen(filename, "w");
+    if (fd == NULL) {
+        perror(filename);
+        return false;
+    }
+    fprintf(fd, "name,ns_per_op,gb_per_s\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        fprintf(fd, "%s,%.4f,%.4f\n", results[i].name.c_str(), results[i].ns, results[i].gbps);
+    }
+    fclose(fd);
+    return true;
+}
+
+/**
+ * Compares the results with the baseline in filename
+ *
+ * @return The number of regressions, or -1 if the baseline can't be read
+ */
+static int compare(const char *filename, double tolerance)
+{
+    std::map<std::string, double> baseline;
+    char line[256];
+    int regressions = 0;
+    FILE *fd = fopen(filename, "r");
+    if (fd == NULL) {
+        perror(filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        char *comma = strchr(line, ',');
+        if ((comma == NULL) || (strncmp(line, "name,", 5) == 0)) {
+            continue;
+        }
+        *comma = 0;
+        baseline[line] = atof(comma + 1);
+    }
+    fclose(fd);
+    double scale = 1.0;
+    if ((baseline.count("calibrate") != 0) && (results[0].name == "calibrate")) {
+        scale = results[0].ns / baseline["calibrate"];
+    }
+    printf("\nAgainst %s (tolerance %.0f%%, this machine is %.2fx the baseline)\n", filename, tolerance * 100, scale);
+    for (size_t i = 1; i < results.size(); i++) {
+        std::map<std::string, double>::iterator base = baseline.find(results[i].name);
+        if (base == baseline.end()) {
+            printf("%-40s not in the baseline\n", results[i].name.c_str());
+            continue;
+        }
+        double change = (results[i].ns / scale - base->second) / base->second;
+        if (change > tolerance) {
+            printf("%-40s %+7.1f%% REGRESSION\n", results[i].name.c_str(), change * 100);
+            regressions++;
+        }
+    }
+    printf("%d regression(s)\n", regressions);
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = NULL;
+    const char *baseline = NULL;
+    double tolerance = 0.25;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:b:t:")) != -1) {
+        switch (opt) {
+        case 'o':
+            output = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-o results.csv] [-b baseline.csv] [-t tolerance]\n", argv[0]);
+            return 2;
+        }
+    }
+    benchCalibrate();
+    benchDevice(4096);
+    benchDevice(1024 * 1024);
+    benchDevice(16 * 1024 * 1024);
+    benchWearLevel(1024 * 1024);
+    benchChecksums(16 * 1024 * 1024);
+    benchImage(1024 * 1024);
+    benchKV(1024 * 1024, 1000);
+    benchRingLog(1024 * 1024);
+    benchAllocator(16 * 1024 * 1024);
+    benchAtomics(4096);
+    benchBackends(1024 * 1024);
+    benchCache(1024 * 1024);
+    benchFile(1024 * 1024);
+    if ((output != NULL) && !save(output)) {
+        return 2;
+    }
+    if (baseline != NULL) {
+        int regressions = compare(baseline, tolerance);
+        if (regressions != 0) {
+            return (regressions < 0) ? 2 : 1;
+        }
+    }
+    return 0;
+}
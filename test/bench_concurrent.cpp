@@ -0,0 +1,127 @@
+/**
+ * @file       test/bench_concurrent.cpp
+ * @brief   Read scaling of RAMEEPROMClass::concurrent()
+ * @details
+ *
+ * One writer keeps calling put() while 1, 2, 4 ... reader threads call
+ * get() on random addresses.  Reads never take a lock, so the total read
+ * rate should grow with the number of cores.
+ *
+ * Then 1, 2, 4 ... threads bump counters, with fetchAdd() and with get()
+ * and put() under a mutex.
+ *
+ * Run with "make bench-concurrent".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include "Arduino.h"
+#include "RAM_EEPROM.h"
+
+#define BENCH_SIZE (1024UL * 1024)
+#define BENCH_MS 250
+
+/** Keeps the compiler from throwing the reads away */
+static volatile uint64_t sink;
+
+static void reader(RAMEEPROMClass *e, unsigned int seed, std::atomic<bool> *stop, uint64_t *reads)
+{
+    uint64_t value = 0;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    while (!stop->load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 64; i++) {
+            int address = (rand_r(&seed) % (BENCH_SIZE / 8)) * 8;
+            sum += e->get(address, value);
+        }
+        count += 64;
+    }
+    sink = sum;
+    *reads = count;
+}
+
+static void writer(RAMEEPROMClass *e, std::atomic<bool> *stop)
+{
+    unsigned int seed = 12345;
+    uint64_t value = 0;
+    while (!stop->load(std::memory_order_relaxed)) {
+        int address = (rand_r(&seed) % (BENCH_SIZE / 8)) * 8;
+        e->put(address, value++);
+    }
+}
+
+/** Each thread has its own counter, in the same stripe as the others */
+static void counter(RAMEEPROMClass *e, std::mutex *lock, int address, std::atomic<bool> *stop, uint64_t *adds)
+{
+    uint64_t count = 0;
+    uint32_t value = 0;
+    while (!stop->load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 64; i++) {
+            if (lock == NULL) {
+                e->fetchAdd(address, (uint32_t)1);
+            } else {
+                std::lock_guard<std::mutex> hold(*lock);
+                e->put(address, e->get(address, value) + 1);
+            }
+        }
+        count += 64;
+    }
+    *adds = count;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int cores = std::thread::hardware_concurrency();
+    unsigned int threads;
+    RAMEEPROMClass EEPROM((void *)NULL, BENCH_SIZE, 64);
+    EEPROM.concurrent();
+    printf("%u cores\n", cores);
+    printf("%8s %16s %16s\n", "readers", "reads/s", "reads/s/thread");
+    for (threads = 1; threads <= ((cores < 2) ? 2 : cores); threads *= 2) {
+        std::atomic<bool> stop(false);
+        std::vector<uint64_t> reads(threads, 0);
+        std::vector<std::thread> pool;
+        uint64_t total = 0;
+        std::thread w(writer, &EEPROM, &stop);
+        for (unsigned int i = 0; i < threads; i++) {
+            pool.push_back(std::thread(reader, &EEPROM, i + 1, &stop, &reads[i]));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_MS));
+        stop = true;
+        for (unsigned int i = 0; i < threads; i++) {
+            pool[i].join();
+            total += reads[i];
+        }
+        w.join();
+        double rate = total * 1000.0 / BENCH_MS;
+        printf("%8u %16.0f %16.0f\n", threads, rate, rate / threads);
+    }
+    printf("\n%8s %16s %16s\n", "threads", "fetchAdd/s", "get+put/s");
+    for (threads = 1; threads <= ((cores < 2) ? 2 : cores); threads *= 2) {
+        double rate[2];
+        for (int locked = 0; locked < 2; locked++) {
+            std::atomic<bool> stop(false);
+            std::vector<uint64_t> adds(threads, 0);
+            std::vector<std::thread> pool;
+            std::mutex lock;
+            uint64_t total = 0;
+            for (unsigned int i = 0; i < threads; i++) {
+                pool.push_back(std::thread(counter, &EEPROM, locked ? &lock : NULL, i * 8, &stop, &adds[i]));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_MS));
+            stop = true;
+            for (unsigned int i = 0; i < threads; i++) {
+                pool[i].join();
+                total += adds[i];
+            }
+            rate[locked] = total * 1000.0 / BENCH_MS;
+        }
+        printf("%8u %16.0f %16.0f\n", threads, rate[0], rate[1]);
+    }
+    return 0;
+}
@@ -16,6 +16,14 @@
 FCT_BGN()
 {
     FCTMF_SUITE_CALL(test_ram_eeprom);
+    FCTMF_SUITE_CALL(test_ram_eeprom_journal);
+    FCTMF_SUITE_CALL(test_ram_eeprom_wearlevel);
+    FCTMF_SUITE_CALL(test_ram_eeprom_image);
+    FCTMF_SUITE_CALL(test_ram_eeprom_kv);
+    FCTMF_SUITE_CALL(test_ram_eeprom_ringlog);
+    FCTMF_SUITE_CALL(test_ram_eeprom_allocator);
+    FCTMF_SUITE_CALL(test_ram_eeprom_backend);
+    FCTMF_SUITE_CALL(test_ram_eeprom_cache);
 }
 FCT_END();
 
@@ -15,13 +15,56 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <cmath>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
 #include "main.h"
+#include "RAM_EEPROM_CRC.h"
 
 void incrementE2(RAMEEPROMClass *e)
 {
     uint32_t i;
+    uint8_t *buffer = new uint8_t[e->size()];
     for (i = 0; i < e->size(); i++) {
-        e->write(i, i);
+        buffer[i] = i;
+    }
+    e->writeBytes(0, buffer, e->size());
+    delete [] buffer;
+}
+
+/**
+ * A value big enough to cross several stripes
+ */
+struct Torn {
+    uint32_t word[24];
+};
+
+void tornWriter(RAMEEPROMClass *e, int address, std::atomic<bool> *stop, std::atomic<uint32_t> *writes)
+{
+    Torn value;
+    uint32_t count = 0;
+    while (!stop->load()) {
+        count++;
+        for (uint8_t i = 0; i < 24; i++) {
+            value.word[i] = count;
+        }
+        e->put(address, value);
+        writes->store(count);
+    }
+}
+
+/**
+ * Bumps a boot counter and a sequence number with the atomic calls
+ */
+void atomicCounter(RAMEEPROMClass *e, int count)
+{
+    uint64_t sequence = 0;
+    for (int i = 0; i < count; i++) {
+        e->fetchAdd(8, (uint32_t)1);
+        // The same thing the long way round
+        e->fetchAdd(16, (uint64_t)0, &sequence);
+        while (!e->compareExchange(16, sequence, sequence + 1)) {
+        }
     }
 }
 
@@ -698,6 +741,1138 @@ FCTMF_FIXTURE_SUITE_BGN(test_ram_eeprom)
         delete EEPROM;
     }
     FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(put() and get() work on the last bytes of the E2) {
+        int32_t value = 0;
+        int32_t expect = -4135690;
+        int16_t addr = EEPROM_SIZE - sizeof(expect);
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE);
+        EEPROM->begin();
+        EEPROM->put(addr, expect);
+        value = EEPROM->get(addr, value);
+        fct_xchk(value == expect, "Expected %d got %d", expect, value);
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(writeBytes() and readBytes() work together) {
+        uint8_t buffer[16];
+        uint8_t value[16];
+        uint16_t index;
+        int16_t addr = 37;
+        bool ret;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE);
+        EEPROM->begin();
+        for (index = 0; index < sizeof(buffer); index++) {
+            buffer[index] = 0xA0 + index;
+        }
+        ret = EEPROM->writeBytes(addr, buffer, sizeof(buffer));
+        fct_xchk(ret, "writeBytes() returned FALSE");
+        ret = EEPROM->readBytes(addr, value, sizeof(value));
+        fct_xchk(ret, "readBytes() returned FALSE");
+        for (index = 0; index < sizeof(buffer); index++) {
+            fct_xchk(value[index] == buffer[index], "index: %u Expected %u got %u", index, buffer[index], value[index]);
+        }
+        fct_xchk(EEPROM->read(addr - 1) == 0xFF, "Wrote before the range");
+        fct_xchk(EEPROM->read(addr + sizeof(buffer)) == 0xFF, "Wrote after the range");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(readBytes() covers the whole E2) {
+        uint8_t buffer[EEPROM_SIZE];
+        uint16_t index;
+        bool ret;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE);
+        EEPROM->begin();
+        incrementE2(EEPROM);
+        ret = EEPROM->readBytes(0, buffer, sizeof(buffer));
+        fct_xchk(ret, "readBytes() returned FALSE");
+        for (index = 0; index < sizeof(buffer); index++) {
+            fct_xchk(buffer[index] == (index & 0xFF), "Address: %u Expected %u got %u", index, index & 0xFF, buffer[index]);
+        }
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(readBytes() and writeBytes() reject bad ranges) {
+        uint8_t buffer[8] = { 0 };
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE);
+        EEPROM->begin();
+        fct_xchk(!EEPROM->readBytes(-1, buffer, sizeof(buffer)), "Negative address accepted");
+        fct_xchk(!EEPROM->readBytes(EEPROM_SIZE - 4, buffer, sizeof(buffer)), "Range past the end accepted");
+        fct_xchk(!EEPROM->readBytes(0, NULL, sizeof(buffer)), "NULL buffer accepted");
+        fct_xchk(!EEPROM->writeBytes(-1, buffer, sizeof(buffer)), "Negative address accepted");
+        fct_xchk(!EEPROM->writeBytes(EEPROM_SIZE - 4, buffer, sizeof(buffer)), "Range past the end accepted");
+        fct_xchk(!EEPROM->writeBytes(0, NULL, sizeof(buffer)), "NULL buffer accepted");
+        fct_xchk(!EEPROM->fillBytes(EEPROM_SIZE, 0, 1), "Range past the end accepted");
+        fct_xchk(!EEPROM->writeBytes(1, buffer, (size_t)-1), "Huge length accepted");
+        fct_xchk(EEPROM->read(EEPROM_SIZE - 4) == 0xFF, "Partial write happened");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(fillBytes() and compareBytes() work together) {
+        uint8_t buffer[24];
+        int16_t addr = 8;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE);
+        EEPROM->begin();
+        memset(buffer, 0x5A, sizeof(buffer));
+        fct_xchk(!EEPROM->compareBytes(addr, buffer, sizeof(buffer)), "Matched before the fill");
+        fct_xchk(EEPROM->fillBytes(addr, 0x5A, sizeof(buffer)), "fillBytes() returned FALSE");
+        fct_xchk(EEPROM->compareBytes(addr, buffer, sizeof(buffer)), "Didn't match after the fill");
+        fct_xchk(EEPROM->read(addr + sizeof(buffer)) == 0xFF, "Filled past the range");
+        fct_xchk(!EEPROM->compareBytes(EEPROM_SIZE, buffer, sizeof(buffer)), "Range past the end matched");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(Nothing is dirty at the start) {
+        int address = 0;
+        size_t length = 0;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        EEPROM->begin();
+        fct_xchk(!EEPROM->nextDirty(address, length), "Found a dirty range at %d", address);
+        fct_xchk(!EEPROM->isDirty(0), "Address 0 is dirty");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(nextDirty() walks the dirty ranges) {
+        int32_t value = 5;
+        uint8_t buffer[8] = { 0 };
+        int address = 0;
+        size_t length = 0;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        EEPROM->begin();
+        EEPROM->write(3, 1);
+        EEPROM->put(12, value);
+        EEPROM->writeBlock(10, buffer);
+        EEPROM->fillBytes(EEPROM_SIZE - 1, 0, 1);
+        fct_xchk(EEPROM->nextDirty(address, length), "Didn't find the first range");
+        fct_xchk((address == 0) && (length == 16), "Expected 0/16 got %d/%u", address, (unsigned)length);
+        address += length;
+        fct_xchk(EEPROM->nextDirty(address, length), "Didn't find the second range");
+        fct_xchk((address == 80) && (length == 8), "Expected 80/8 got %d/%u", address, (unsigned)length);
+        address += length;
+        fct_xchk(EEPROM->nextDirty(address, length), "Didn't find the third range");
+        fct_xchk((address == EEPROM_SIZE - 8) && (length == 8), "Expected %d/8 got %d/%u", EEPROM_SIZE - 8, address, (unsigned)length);
+        address += length;
+        fct_xchk(!EEPROM->nextDirty(address, length), "Found an extra range at %d", address);
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(commit() marks everything clean) {
+        int address = 0;
+        size_t length = 0;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE);
+        EEPROM->begin();
+        incrementE2(EEPROM);
+        fct_xchk(EEPROM->nextDirty(address, length), "Didn't find the range");
+        fct_xchk((address == 0) && (length == EEPROM_SIZE), "Expected 0/%u got %d/%u", EEPROM_SIZE, address, (unsigned)length);
+        EEPROM->commit();
+        address = 0;
+        fct_xchk(!EEPROM->nextDirty(address, length), "Found a dirty range at %d", address);
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(update() only dirties pages it changes) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE);
+        EEPROM->begin();
+        EEPROM->update(5, 0xFF);
+        fct_xchk(!EEPROM->isDirty(5), "Unchanged write made the page dirty");
+        EEPROM->update(5, 0x12);
+        fct_xchk(EEPROM->isDirty(5), "Changed write didn't make the page dirty");
+        fct_xchk(EEPROM->read(5) == 0x12, "Expected 0x12 got 0x%02X", EEPROM->read(5));
+        fct_xchk(!EEPROM->isDirty(EEPROM->pageSize()), "The next page is dirty");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(copyBlock() marks the destination dirty) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        EEPROM->begin();
+        EEPROM->copyBlock(4, 1);
+        fct_xchk(EEPROM->isDirty(32), "Destination isn't dirty");
+        fct_xchk(!EEPROM->isDirty(8), "Source is dirty");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(A new image file initializes to all 0xFF) {
+        char filename[] = "/tmp/ram_eeprom_XXXXXX";
+        uint8_t buffer[EEPROM_SIZE];
+        uint16_t index;
+        close(mkstemp(filename));
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass(filename, EEPROM_SIZE);
+        EEPROM->begin();
+        fct_xchk(EEPROM->readBytes(0, buffer, sizeof(buffer)), "readBytes() returned FALSE");
+        for (index = 0; index < sizeof(buffer); index++) {
+            fct_xchk(buffer[index] == 0xFF, "Location %u: Expected 255 got %u", index, buffer[index]);
+        }
+        delete EEPROM;
+        unlink(filename);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(An image file keeps its contents between instances) {
+        char filename[] = "/tmp/ram_eeprom_XXXXXX";
+        int32_t value = 0;
+        int32_t expect = -4135690;
+        int16_t addr = 34;
+        close(mkstemp(filename));
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass(filename, EEPROM_SIZE, 8);
+        EEPROM->begin();
+        EEPROM->put(addr, expect);
+        fct_xchk(EEPROM->commit(), "commit() returned FALSE");
+        fct_xchk(!EEPROM->isDirty(addr), "Still dirty after commit()");
+        EEPROM->end();
+        fct_xchk(EEPROM->read(addr) == 0, "Readable after end()");
+        delete EEPROM;
+        EEPROM = new RAMEEPROMClass(filename, EEPROM_SIZE, 8);
+        EEPROM->begin();
+        value = EEPROM->get(addr, value);
+        fct_xchk(value == expect, "Expected %d got %d", expect, value);
+        fct_xchk(EEPROM->read(0) == 0xFF, "Expected 255 got %u", EEPROM->read(0));
+        delete EEPROM;
+        unlink(filename);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(A missing image directory fails cleanly) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass("/nonexistent/dir/image.bin", EEPROM_SIZE);
+        EEPROM->begin();
+        EEPROM->write(0, 1);
+        fct_xchk(EEPROM->read(0) == 0, "Expected 0 got %u", EEPROM->read(0));
+        fct_xchk(EEPROM->commit(), "commit() returned FALSE");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(A given buffer is used in place) {
+        uint8_t buffer[EEPROM_SIZE];
+        int32_t value = 0;
+        int32_t expect = -4135690;
+        int16_t addr = 34;
+        memset(buffer, 0x55, sizeof(buffer));
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)buffer, sizeof(buffer));
+        EEPROM->begin();
+        fct_xchk(EEPROM->read(0) == 0x55, "Buffer was cleared: expected 0x55 got 0x%02X", EEPROM->read(0));
+        EEPROM->put(addr, expect);
+        memcpy(&value, &buffer[addr], sizeof(value));
+        fct_xchk(value == expect, "Expected %d got %d", expect, value);
+        buffer[0] = 0x12;
+        fct_xchk(EEPROM->read(0) == 0x12, "Expected 0x12 got 0x%02X", EEPROM->read(0));
+        // The buffer is on the stack, so this will blow up if it gets freed
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(RAMEEPROM<> initializes to all 0xFF) {
+        uint16_t i;
+        uint8_t value;
+        RAMEEPROM<EEPROM_SIZE, 8> *EEPROM = new RAMEEPROM<EEPROM_SIZE, 8>();
+        fct_xchk(EEPROM->size() == EEPROM_SIZE, "Expected %u got %u", EEPROM_SIZE, (unsigned)EEPROM->size());
+        fct_xchk(EEPROM->blockSize() == 8, "Expected 8 got %u", (unsigned)EEPROM->blockSize());
+        for (i = 0; i < EEPROM_SIZE; i++) {
+            value = EEPROM->read(i);
+            fct_xchk(value == 0xFF, "Location %u: Expected 255 got %u", i, value);
+        }
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(RAMEEPROM<> get() and put() with constant addresses) {
+        RAMEEPROM<EEPROM_SIZE> EEPROM;
+        int32_t value = 0;
+        int32_t expect = -4135690;
+        EEPROM.begin();
+        EEPROM.put<EEPROM_SIZE - 4>(expect);
+        value = EEPROM.get<EEPROM_SIZE - 4>(value);
+        fct_xchk(value == expect, "Expected %d got %d", expect, value);
+        value = 0;
+        value = EEPROM.get(EEPROM_SIZE - 4, value);
+        fct_xchk(value == expect, "Expected %d got %d", expect, value);
+        fct_xchk(EEPROM.isDirty(EEPROM_SIZE - 4), "put() didn't mark the page dirty");
+        fct_xchk(!EEPROM.isDirty(0), "put() marked the wrong page dirty");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(RAMEEPROM<> get() and put() check runtime addresses) {
+        RAMEEPROM<EEPROM_SIZE> EEPROM;
+        int32_t value = 682024;
+        int addr = EEPROM_SIZE - 2;
+        EEPROM.begin();
+        EEPROM.put(addr, value);
+        fct_xchk(EEPROM.read(addr) == 0xFF, "put() wrote past the end");
+        value = EEPROM.get(addr, value);
+        fct_xchk(value == 682024, "Expected 682024 got %d", value);
+        fct_xchk(!RAMEEPROM<EEPROM_SIZE>::goodAddress(-1, 1), "Negative address accepted");
+        fct_xchk(RAMEEPROM<EEPROM_SIZE>::goodAddress(0, EEPROM_SIZE), "The whole E2 rejected");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(writeBlocks() and readBlocks() work together) {
+        uint8_t blocksize = 8;
+        uint8_t buffer[3 * 8];
+        uint8_t value[3 * 8];
+        uint16_t index;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, blocksize);
+        EEPROM->begin();
+        for (index = 0; index < sizeof(buffer); index++) {
+            buffer[index] = index + 1;
+        }
+        fct_xchk(EEPROM->writeBlocks(4, 3, buffer), "writeBlocks() returned FALSE");
+        fct_xchk(EEPROM->readBlocks(4, 3, value), "readBlocks() returned FALSE");
+        fct_xchk(memcmp(buffer, value, sizeof(buffer)) == 0, "Blocks didn't match");
+        fct_xchk(EEPROM->read(3 * blocksize + 7) == 0xFF, "Wrote before the blocks");
+        fct_xchk(EEPROM->read(7 * blocksize) == 0xFF, "Wrote after the blocks");
+        fct_xchk(!EEPROM->writeBlocks(14, 3, buffer), "Blocks past the end accepted");
+        fct_xchk(!EEPROM->readBlocks(-1, 3, value), "Negative block accepted");
+        fct_xchk(!EEPROM->readBlocks(0, -1, value), "Negative count accepted");
+        fct_xchk(EEPROM->blocks() == EEPROM_SIZE / blocksize, "Expected %u blocks got %u", EEPROM_SIZE / blocksize, (unsigned)EEPROM->blocks());
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(moveBlocks() handles overlapping blocks) {
+        uint8_t blocksize = 8;
+        uint8_t value;
+        uint8_t expect;
+        uint16_t index;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, blocksize);
+        EEPROM->begin();
+        incrementE2(EEPROM);
+        // Blocks 2-5 move up one block
+        fct_xchk(EEPROM->moveBlocks(3, 2, 4), "moveBlocks() returned FALSE");
+        for (index = 3 * blocksize; index < 7 * blocksize; index++) {
+            value = EEPROM->read(index);
+            expect = index - blocksize;
+            fct_xchk(value == expect, "Address: %u Expected %u got %u", index, expect, value);
+        }
+        incrementE2(EEPROM);
+        // Blocks 3-6 move down two blocks
+        fct_xchk(EEPROM->moveBlocks(1, 3, 4), "moveBlocks() returned FALSE");
+        for (index = blocksize; index < 5 * blocksize; index++) {
+            value = EEPROM->read(index);
+            expect = index + 2 * blocksize;
+            fct_xchk(value == expect, "Address: %u Expected %u got %u", index, expect, value);
+        }
+        fct_xchk(!EEPROM->moveBlocks(14, 0, 4), "Destination past the end accepted");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(fillBlocks() and eraseBlocks() set whole blocks) {
+        uint8_t blocksize = 8;
+        uint8_t buffer[4 * 8];
+        uint8_t expect[4 * 8];
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, blocksize);
+        EEPROM->begin();
+        fct_xchk(EEPROM->fillBlocks(2, 4, 0), "fillBlocks() returned FALSE");
+        EEPROM->readBlocks(2, 4, buffer);
+        memset(expect, 0, sizeof(expect));
+        fct_xchk(memcmp(buffer, expect, sizeof(buffer)) == 0, "Blocks weren't filled");
+        fct_xchk(EEPROM->read(2 * blocksize - 1) == 0xFF, "Filled before the blocks");
+        fct_xchk(EEPROM->eraseBlocks(3, 2), "eraseBlocks() returned FALSE");
+        EEPROM->readBlocks(2, 4, buffer);
+        memset(&expect[8], 0xFF, 16);
+        fct_xchk(memcmp(buffer, expect, sizeof(buffer)) == 0, "Blocks weren't erased");
+        fct_xchk(!EEPROM->eraseBlocks(0, 17), "Blocks past the end accepted");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(Sparse E2 starts erased with nothing allocated) {
+        size_t size = 64UL * 1024 * 1024;
+        RAMEEPROMSparseClass *EEPROM = new RAMEEPROMSparseClass(size, 64);
+        EEPROM->begin();
+        fct_xchk(EEPROM->size() == size, "Expected %u got %u", (unsigned)size, (unsigned)EEPROM->size());
+        fct_xchk(EEPROM->residentBytes() == 0, "Expected 0 got %u", (unsigned)EEPROM->residentBytes());
+        fct_xchk(EEPROM->read(size - 1) == 0xFF, "Expected 255 got %u", EEPROM->read(size - 1));
+        fct_xchk(EEPROM->residentBytes() == 0, "Reading allocated %u bytes", (unsigned)EEPROM->residentBytes());
+        EEPROM->write(size / 2, 0);
+        fct_xchk(EEPROM->residentBytes() == RAM_EEPROM_SPARSE_PAGE_SIZE, "Expected %u got %u", RAM_EEPROM_SPARSE_PAGE_SIZE, (unsigned)EEPROM->residentBytes());
+        fct_xchk(EEPROM->read(size / 2) == 0, "Expected 0 got %u", EEPROM->read(size / 2));
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(Sparse erase() wipes everything) {
+        int32_t value = 0;
+        int32_t expect = -1;
+        RAMEEPROMSparseClass *EEPROM = new RAMEEPROMSparseClass(1024 * 1024);
+        EEPROM->begin();
+        EEPROM->put(5000, (int32_t)1234);
+        EEPROM->commit();
+        EEPROM->erase();
+        value = EEPROM->get(5000, value);
+        fct_xchk(value == expect, "Expected %d got %d", expect, value);
+        fct_xchk(EEPROM->isDirty(0) && EEPROM->isDirty(1024 * 1024 - 1), "erase() didn't mark the E2 dirty");
+        fct_xchk(EEPROM->residentBytes() == 0, "Expected 0 got %u", (unsigned)EEPROM->residentBytes());
+        EEPROM->put(5000, (int32_t)99);
+        value = EEPROM->get(5000, value);
+        fct_xchk(value == 99, "Expected 99 got %d", value);
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(erase() wipes a flat E2) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE);
+        EEPROM->begin();
+        incrementE2(EEPROM);
+        EEPROM->erase();
+        fct_xchk(EEPROM->read(5) == 0xFF, "Expected 255 got %u", EEPROM->read(5));
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(Sparse E2 matches a flat E2) {
+        size_t size = 3 * RAM_EEPROM_SPARSE_PAGE_SIZE + 192;
+        uint8_t blocksize = 64;
+        int blocks = size / blocksize;
+        uint8_t buffer[600];
+        uint8_t flat[3 * RAM_EEPROM_SPARSE_PAGE_SIZE + 192];
+        uint8_t sparse[3 * RAM_EEPROM_SPARSE_PAGE_SIZE + 192];
+        unsigned int seed = 1;
+        int step;
+        RAMEEPROMClass *A = new RAMEEPROMClass((void *)NULL, size, blocksize);
+        RAMEEPROMSparseClass *B = new RAMEEPROMSparseClass(size, blocksize);
+        for (step = 0; step < 2000; step++) {
+            int op = rand_r(&seed) % 5;
+            int addr = rand_r(&seed) % size;
+            size_t len = rand_r(&seed) % sizeof(buffer);
+            int first = rand_r(&seed) % blocks;
+            int second = rand_r(&seed) % blocks;
+            int count = rand_r(&seed) % 20;
+            uint8_t value = (rand_r(&seed) % 2) ? 0xFF : rand_r(&seed);
+            if (len > size - addr) {
+                len = size - addr;
+            }
+            if ((first + count > blocks) || (second + count > blocks)) {
+                count = 0;
+            }
+            memset(buffer, value ^ step, len);
+            switch (op) {
+            case 0:
+                A->writeBytes(addr, buffer, len);
+                B->writeBytes(addr, buffer, len);
+                break;
+            case 1:
+                A->fillBytes(addr, value, len);
+                B->fillBytes(addr, value, len);
+                break;
+            case 2:
+                A->moveBlocks(first, second, count);
+                B->moveBlocks(first, second, count);
+                break;
+            case 3:
+                A->eraseBlocks(first, count);
+                B->eraseBlocks(first, count);
+                break;
+            default:
+                A->write(addr, value);
+                B->write(addr, value);
+                break;
+            }
+            A->readBytes(addr, buffer, len);
+            fct_xchk(B->compareBytes(addr, buffer, len), "Step %d: compareBytes() failed", step);
+        }
+        A->readBytes(0, flat, size);
+        B->readBytes(0, sparse, size);
+        fct_xchk(memcmp(flat, sparse, size) == 0, "Sparse E2 doesn't match");
+        delete A;
+        delete B;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(concurrent() get() never sees a torn value) {
+        Torn value;
+        std::atomic<bool> stop(false);
+        std::atomic<uint32_t> writes(0);
+        int address = 20;
+        int torn = 0;
+        int i, j;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        EEPROM->begin();
+        fct_xchk(EEPROM->concurrent(), "concurrent() returned FALSE");
+        std::thread writer(tornWriter, EEPROM, address, &stop, &writes);
+        while (writes.load() == 0) {
+            std::this_thread::yield();
+        }
+        for (i = 0; (i < 1000000) && (writes.load() < 100000); i++) {
+            EEPROM->get(address, value);
+            for (j = 1; j < 24; j++) {
+                if (value.word[j] != value.word[0]) {
+                    torn++;
+                    break;
+                }
+            }
+        }
+        stop = true;
+        writer.join();
+        fct_xchk(torn == 0, "%d torn reads", torn);
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(concurrent() keeps the E2 working) {
+        uint8_t buffer[16];
+        int32_t value = 0;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        EEPROM->begin();
+        fct_xchk(EEPROM->concurrent(), "concurrent() returned FALSE");
+        incrementE2(EEPROM);
+        fct_xchk(EEPROM->copyBlock(2, 0), "copyBlock() returned FALSE");
+        fct_xchk(EEPROM->readBlocks(1, 2, buffer), "readBlocks() returned FALSE");
+        fct_xchk((buffer[0] == 8) && (buffer[8] == 0), "Expected 8/0 got %u/%u", buffer[0], buffer[8]);
+        EEPROM->update(3, 7);
+        fct_xchk(EEPROM->read(3) == 7, "Expected 7 got %u", EEPROM->read(3));
+        EEPROM->put(EEPROM_SIZE - 4, (int32_t)-5);
+        value = EEPROM->get(EEPROM_SIZE - 4, value);
+        fct_xchk(value == -5, "Expected -5 got %d", value);
+        EEPROM->erase();
+        fct_xchk(EEPROM->read(0) == 0xFF, "Expected 255 got %u", EEPROM->read(0));
+        fct_xchk(EEPROM->concurrent(false), "concurrent(false) returned FALSE");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(concurrent() is refused by a sparse E2) {
+        RAMEEPROMSparseClass *EEPROM = new RAMEEPROMSparseClass(EEPROM_SIZE);
+        fct_xchk(!EEPROM->concurrent(), "concurrent() returned TRUE");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(snapshot() keeps the old data) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, 4 * RAM_EEPROM_SNAPSHOT_PAGE_SIZE, 16);
+        uint8_t buffer[16], expect[16];
+        int32_t value = 0;
+        incrementE2(EEPROM);
+        RAMEEPROMSnapshot *snap = EEPROM->snapshot();
+        fct_xchk(snap != NULL, "snapshot() returned NULL");
+        fct_xchk(snap->copiedPages() == 0, "Expected 0 got %u", (unsigned)snap->copiedPages());
+        EEPROM->put(0, (int32_t)-1);
+        EEPROM->fillBytes(RAM_EEPROM_SNAPSHOT_PAGE_SIZE + 5, 0, 10);
+        EEPROM->copyBlock(0, 1);
+        fct_xchk(snap->copiedPages() == 2, "Expected 2 got %u", (unsigned)snap->copiedPages());
+        EEPROM->readBlock(0, buffer);
+        fct_xchk(buffer[0] == 16, "Expected 16 got %u", buffer[0]);
+        snap->readBlock(0, buffer);
+        for (uint8_t i = 0; i < 16; i++) {
+            expect[i] = i;
+        }
+        fct_xchk(memcmp(buffer, expect, sizeof(buffer)) == 0, "Block 0 changed in the snapshot");
+        fct_xchk(snap->read(RAM_EEPROM_SNAPSHOT_PAGE_SIZE + 5) == 5, "Expected 5 got %u", snap->read(RAM_EEPROM_SNAPSHOT_PAGE_SIZE + 5));
+        // Straddles a copied page and a shared one
+        snap->get(RAM_EEPROM_SNAPSHOT_PAGE_SIZE * 2 - 2, value);
+        fct_xchk(value == (int32_t)0x0100FFFE, "Expected 0x0100FFFE got 0x%X", value);
+        fct_xchk(!snap->readBytes(4 * RAM_EEPROM_SNAPSHOT_PAGE_SIZE - 1, buffer, 2), "Expected false got true");
+        fct_xchk(!snap->readBlock(-1, buffer), "Expected false got true");
+        delete snap;
+        EEPROM->write(0, 1);
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(snapshot() keeps each snapshot separate) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE);
+        EEPROM->write(0, 1);
+        RAMEEPROMSnapshot *first = EEPROM->snapshot();
+        EEPROM->write(0, 2);
+        RAMEEPROMSnapshot *second = EEPROM->snapshot();
+        EEPROM->write(0, 3);
+        fct_xchk(first->read(0) == 1, "Expected 1 got %u", first->read(0));
+        fct_xchk(second->read(0) == 2, "Expected 2 got %u", second->read(0));
+        fct_xchk(EEPROM->read(0) == 3, "Expected 3 got %u", EEPROM->read(0));
+        delete second;
+        EEPROM->erase();
+        fct_xchk(first->read(0) == 1, "Expected 1 got %u", first->read(0));
+        delete EEPROM;
+        fct_xchk(!first->readBytes(0, &EEPROM, 1), "Expected reads to fail after the E2 is gone");
+        delete first;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(snapshot() works on sparse and fixed size E2s) {
+        RAMEEPROMSparseClass sparse(1 << 20);
+        RAMEEPROM<EEPROM_SIZE> fixed;
+        sparse.write(100, 7);
+        RAMEEPROMSnapshot *snap = sparse.snapshot();
+        sparse.erase();
+        sparse.write(1 << 19, 8);
+        fct_xchk(snap->read(100) == 7, "Expected 7 got %u", snap->read(100));
+        fct_xchk(snap->read(1 << 19) == 0xFF, "Expected 0xFF got 0x%X", snap->read(1 << 19));
+        fct_xchk(sparse.read(100) == 0xFF, "Expected 0xFF got 0x%X", sparse.read(100));
+        delete snap;
+        fixed.put<4>((int32_t)10);
+        snap = fixed.snapshot();
+        fixed.put<4>((int32_t)20);
+        fixed.put(8, (int32_t)30);
+        int32_t value = 0;
+        snap->get(4, value);
+        fct_xchk(value == 10, "Expected 10 got %d", value);
+        snap->get(8, value);
+        fct_xchk(value == -1, "Expected -1 got %d", value);
+        delete snap;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(snapshot() is stable while a writer runs) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, 2 * RAM_EEPROM_SNAPSHOT_PAGE_SIZE, 8);
+        std::atomic<bool> stop(false);
+        std::atomic<uint32_t> writes(0);
+        const int address = RAM_EEPROM_SNAPSHOT_PAGE_SIZE - 40;
+        Torn value;
+        int changed = 0;
+        EEPROM->concurrent();
+        EEPROM->fillBytes(0, 0, EEPROM->size());
+        RAMEEPROMSnapshot *snap = EEPROM->snapshot();
+        std::thread writer(tornWriter, EEPROM, address, &stop, &writes);
+        while (writes.load() == 0) {
+            std::this_thread::yield();
+        }
+        for (int i = 0; (i < 100000) && (writes.load() < 10000); i++) {
+            snap->get(address, value);
+            for (uint8_t j = 0; j < 24; j++) {
+                if (value.word[j] != 0) {
+                    changed++;
+                    break;
+                }
+            }
+        }
+        stop = true;
+        writer.join();
+        fct_xchk(changed == 0, "%d reads saw new data", changed);
+        fct_xchk(snap->copiedPages() == 2, "Expected 2 got %u", (unsigned)snap->copiedPages());
+        delete snap;
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(flash() only lets writes clear bits) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, 1024, 16);
+        RAMEEPROMFlashConfig config = {256, 64, 10, 1000};
+        RAMEEPROMFlashStats stats;
+        fct_xchk(EEPROM->sectors() == 0, "Expected 0 got %u", (unsigned)EEPROM->sectors());
+        fct_xchk(EEPROM->flash(config), "flash() returned FALSE");
+        fct_xchk(EEPROM->sectors() == 4, "Expected 4 got %u", (unsigned)EEPROM->sectors());
+        EEPROM->write(0, 0xF0);
+        EEPROM->write(0, 0x3C);
+        fct_xchk(EEPROM->read(0) == 0x30, "Expected 0x30 got 0x%X", EEPROM->read(0));
+        EEPROM->fillBytes(1, 0xFF, 4);
+        fct_xchk(EEPROM->read(1) == 0xFF, "Expected 0xFF got 0x%X", EEPROM->read(1));
+        EEPROM->put(60, (uint32_t)0);
+        EEPROM->flashStats(stats);
+        fct_xchk(stats.programs == 4, "Expected 4 got %u", stats.programs);
+        fct_xchk(stats.bytesRequested == 10, "Expected 10 got %u", (unsigned)stats.bytesRequested);
+        fct_xchk(stats.bytesProgrammed == 256, "Expected 256 got %u", (unsigned)stats.bytesProgrammed);
+        fct_xchk(stats.stuckBits == 2, "Expected 2 got %u", stats.stuckBits);
+        fct_xchk(stats.time == 40, "Expected 40 got %u", (unsigned)stats.time);
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(eraseSector() sets a sector back to 0xFF) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, 1000, 16);
+        RAMEEPROMFlashConfig config = {256, 64, 10, 1000};
+        RAMEEPROMFlashStats stats;
+        fct_xchk(!EEPROM->eraseSector(0), "Expected false outside flash mode");
+        EEPROM->flash(config);
+        EEPROM->fillBytes(0, 0, 1000);
+        fct_xchk(EEPROM->eraseSector(3), "eraseSector(3) returned FALSE");
+        fct_xchk(!EEPROM->eraseSector(4), "Expected false got true");
+        fct_xchk(!EEPROM->eraseSector(-1), "Expected false got true");
+        fct_xchk(EEPROM->read(767) == 0, "Expected 0 got %u", EEPROM->read(767));
+        fct_xchk(EEPROM->read(768) == 0xFF, "Expected 0xFF got 0x%X", EEPROM->read(768));
+        fct_xchk(EEPROM->read(999) == 0xFF, "Expected 0xFF got 0x%X", EEPROM->read(999));
+        EEPROM->clearFlashStats();
+        EEPROM->erase();
+        fct_xchk(EEPROM->read(0) == 0xFF, "Expected 0xFF got 0x%X", EEPROM->read(0));
+        EEPROM->flashStats(stats);
+        fct_xchk(stats.erases == 4, "Expected 4 got %u", stats.erases);
+        fct_xchk(stats.time == 4000, "Expected 4000 got %u", (unsigned)stats.time);
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(flash() works with copies and sparse E2s) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, 1024, 16);
+        RAMEEPROMSparseClass sparse(1 << 20);
+        RAMEEPROMFlashConfig config = {256, 64, 10, 1000};
+        RAMEEPROMFlashConfig bad = {100, 64, 10, 1000};
+        uint8_t buffer[32];
+        fct_xchk(!EEPROM->flash(bad), "Expected false got true");
+        EEPROM->flash(config);
+        incrementE2(EEPROM);
+        EEPROM->erase();
+        for (uint8_t i = 0; i < 32; i++) {
+            buffer[i] = i;
+        }
+        EEPROM->writeBlocks(0, 2, buffer);
+        EEPROM->moveBlocks(1, 0, 2);
+        EEPROM->readBlocks(1, 2, buffer);
+        fct_xchk((buffer[0] == 0) && (buffer[31] == 31), "Expected 0/31 got %u/%u", buffer[0], buffer[31]);
+        fct_xchk(EEPROM->read(16) == 0, "Expected 0 got %u", EEPROM->read(16));
+#if RAM_EEPROM_POSIX
+        fct_xchk(!EEPROM->concurrent(), "Expected concurrent() to fail in flash mode");
+#endif
+        fct_xchk(sparse.flash(config), "flash() returned FALSE");
+        sparse.write(5000, 0x0F);
+        sparse.write(5000, 0xF1);
+        fct_xchk(sparse.read(5000) == 0x01, "Expected 0x01 got 0x%X", sparse.read(5000));
+        sparse.eraseSector(5000 / 256);
+        fct_xchk(sparse.read(5000) == 0xFF, "Expected 0xFF got 0x%X", sparse.read(5000));
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(RAMEEPROMCrc32c() matches the check value) {
+        uint8_t data[100];
+        uint32_t crc = RAMEEPROMCrc32c("123456789", 9);
+        fct_xchk(crc == 0xE3069283, "Expected 0xE3069283 got 0x%X", crc);
+        for (uint8_t i = 0; i < sizeof(data); i++) {
+            data[i] = i * 7;
+        }
+        crc = RAMEEPROMCrc32c(&data[37], 63, RAMEEPROMCrc32c(data, 37));
+        fct_xchk(crc == RAMEEPROMCrc32c(data, 100), "Expected 0x%X got 0x%X", RAMEEPROMCrc32c(data, 100), crc);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(checksums() follows every write) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, 1024, 16);
+        RAMEEPROMClass *other = new RAMEEPROMClass((void *)NULL, 1024, 16);
+        uint8_t block[16];
+        fct_xchk(EEPROM->digest() == 0, "Expected 0 got 0x%X", EEPROM->digest());
+        fct_xchk(EEPROM->checksums(), "checksums() returned FALSE");
+        other->checksums();
+        fct_xchk(EEPROM->digest() == other->digest(), "Expected the blank digests to match");
+        memset(block, 0x42, sizeof(block));
+        EEPROM->writeBlock(2, block);
+        EEPROM->copyBlock(5, 2);
+        EEPROM->put(100, (uint32_t)0x12345678);
+        EEPROM->fillBytes(200, 0, 3);
+        for (size_t page = 0; page < 64; page++) {
+            EEPROM->readBlock(page, block);
+            fct_xchk(EEPROM->pageCrc(page) == RAMEEPROMCrc32c(block, 16), "Page %u is wrong", (unsigned)page);
+        }
+        fct_xchk(EEPROM->digest() != other->digest(), "Expected the digests to differ");
+        EEPROM->erase();
+        fct_xchk(EEPROM->digest() == other->digest(), "Expected the erased digests to match");
+        fct_xchk(EEPROM->pageCrc(64) == 0, "Expected 0 got 0x%X", EEPROM->pageCrc(64));
+        EEPROM->checksums(false);
+        fct_xchk(EEPROM->pageCrc(0) == 0, "Expected 0 got 0x%X", EEPROM->pageCrc(0));
+        delete other;
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(verifyReads() catches changes made around the E2) {
+        uint8_t buffer[1024], block[16];
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass(buffer, sizeof(buffer), 16);
+#if RAM_EEPROM_STATS
+        RAMEEPROMStats stats;
+#endif
+        memset(buffer, 0, sizeof(buffer));
+        EEPROM->checksums();
+        EEPROM->verifyReads();
+        fct_xchk(EEPROM->readBlock(3, block), "readBlock failed");
+        buffer[3 * 16 + 1] = 1;
+        fct_xchk(!EEPROM->readBlock(3, block), "Expected the change to be caught");
+        fct_xchk(EEPROM->readBlock(4, block), "readBlock failed");
+#if RAM_EEPROM_STATS
+        EEPROM->stats(stats);
+        fct_xchk(stats.crcErrors == 1, "Expected 1 got %u", stats.crcErrors);
+#endif
+        EEPROM->verifyReads(false);
+        fct_xchk(EEPROM->readBlock(3, block), "readBlock failed");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(checksums() works on sparse and fixed size E2s) {
+        RAMEEPROMSparseClass sparse(1 << 20, 64);
+        RAMEEPROM<1024, 16> fixed;
+        uint8_t block[64];
+        sparse.checksums();
+        uint32_t blank = sparse.digest();
+        memset(block, 1, sizeof(block));
+        sparse.writeBlock(1000, block);
+        fct_xchk(sparse.pageCrc(1000) == RAMEEPROMCrc32c(block, 64), "Page 1000 is wrong");
+        fct_xchk(sparse.digest() != blank, "Expected the digest to change");
+        sparse.erase();
+        fct_xchk(sparse.digest() == blank, "Expected the blank digest back");
+        fixed.checksums();
+        fixed.put<16>((uint32_t)5);
+        fixed.readBlock(1, block);
+        fct_xchk(fixed.pageCrc(1) == RAMEEPROMCrc32c(block, 16), "Page 1 is wrong");
+        // Nothing to sum up
+        RAMEEPROMClass empty((void *)NULL, 0);
+        fct_xchk(empty.checksums(), "checksums() returned FALSE");
+        fct_xchk(empty.digest() == RAMEEPROMCrc32c(block, 0), "Expected the CRC of nothing");
+        fct_xchk(empty.pageCrc(0) == 0, "Expected 0 got %u", empty.pageCrc(0));
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(fetchAdd() exchange() and compareExchange() change cells) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        uint32_t previous = 0;
+        uint16_t expected = 0xFFFF;
+        int8_t small = 0;
+        int address;
+        size_t length;
+        EEPROM->begin();
+        fct_xchk(EEPROM->fetchAdd(8, (uint32_t)2, &previous), "fetchAdd() returned FALSE");
+        fct_xchk(previous == 0xFFFFFFFF, "Expected 0xFFFFFFFF got 0x%X", previous);
+        fct_xchk(EEPROM->fetchAdd(8, (uint32_t)5, &previous), "fetchAdd() returned FALSE");
+        fct_xchk(previous == 1, "Expected 1 got %u", previous);
+        fct_xchk(EEPROM->get(8, previous) == 6, "Expected 6 got %u", previous);
+        fct_xchk(EEPROM->exchange(8, (uint32_t)100, &previous), "exchange() returned FALSE");
+        fct_xchk(previous == 6, "Expected 6 got %u", previous);
+        fct_xchk(EEPROM->get(8, previous) == 100, "Expected 100 got %u", previous);
+        fct_xchk(EEPROM->compareExchange(2, expected, (uint16_t)7), "compareExchange() returned FALSE");
+        expected = 5;
+        fct_xchk(!EEPROM->compareExchange(2, expected, (uint16_t)9), "Expected false with the wrong value");
+        fct_xchk(expected == 7, "Expected 7 got %u", expected);
+        fct_xchk(EEPROM->compareExchange(2, expected, (uint16_t)9), "compareExchange() returned FALSE");
+        fct_xchk(EEPROM->fetchAdd(5, (int8_t)-10, &small), "fetchAdd() returned FALSE");
+        fct_xchk(EEPROM->read(5) == 0xF5, "Expected 0xF5 got 0x%X", EEPROM->read(5));
+        fct_xchk(small == -1, "Expected -1 got %d", small);
+        // Only the writes are dirty
+        EEPROM->clearDirty();
+        EEPROM->fetchAdd(24, (uint32_t)0, &previous);
+        expected = 0;
+        EEPROM->compareExchange(26, expected, (uint16_t)1);
+        address = 0;
+        fct_xchk(!EEPROM->nextDirty(address, length), "Expected nothing dirty");
+        EEPROM->exchange(24, (uint64_t)0);
+        fct_xchk(EEPROM->isDirty(24), "Expected block 3 to be dirty");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(fetchAdd() rejects cells it cant change atomically) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        RAMEEPROMSparseClass sparse(1 << 20, 8);
+        RAMEEPROMFlashConfig config = { 256, 16, 1, 100 };
+        uint32_t previous = 5;
+        uint16_t expected = 0xFFFF;
+        EEPROM->begin();
+        fct_xchk(!EEPROM->fetchAdd(2, (uint32_t)1), "Expected false for a misaligned cell");
+        fct_xchk(!EEPROM->fetchAdd(-4, (uint32_t)1), "Expected false for a negative address");
+        fct_xchk(!EEPROM->exchange(EEPROM_SIZE, (uint16_t)1), "Expected false past the end");
+        fct_xchk(!EEPROM->compareExchange(EEPROM_SIZE - 1, expected, (uint16_t)1), "Expected false past the end");
+        fct_xchk(expected == 0xFFFF, "Expected expected to be left alone");
+        fct_xchk(EEPROM->read(2) == 0xFF, "Expected 0xFF got 0x%X", EEPROM->read(2));
+        fct_xchk(!sparse.fetchAdd(300002, (uint32_t)1), "Expected false for a misaligned cell");
+        fct_xchk(sparse.residentBytes() == 0, "Expected nothing allocated got %u", (unsigned)sparse.residentBytes());
+        fct_xchk(sparse.fetchAdd(500000, (uint32_t)3, &previous), "fetchAdd() returned FALSE");
+        fct_xchk(sparse.fetchAdd(500000, (uint32_t)0, &previous) && (previous == 2), "Expected 2 got %u", previous);
+        fct_xchk(sparse.residentBytes() == RAM_EEPROM_SPARSE_PAGE_SIZE, "Expected one page");
+        fct_xchk(EEPROM->flash(config), "flash() returned FALSE");
+        fct_xchk(!EEPROM->fetchAdd(8, (uint32_t)1), "Expected false in flash mode");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(fetchAdd() works with snapshots and checksums) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        RAMEEPROMSnapshot *snap;
+        uint32_t value = 0;
+        uint8_t block[8];
+        EEPROM->begin();
+        EEPROM->put(8, (uint32_t)10);
+        snap = EEPROM->snapshot();
+        EEPROM->checksums();
+        EEPROM->fetchAdd(8, (uint32_t)5);
+        fct_xchk(snap->get(8, value) == 10, "Expected 10 got %u", value);
+        fct_xchk(EEPROM->get(8, value) == 15, "Expected 15 got %u", value);
+        EEPROM->readBlock(1, block);
+        fct_xchk(EEPROM->pageCrc(1) == RAMEEPROMCrc32c(block, 8), "Page 1 is wrong");
+        delete snap;
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+#if RAM_EEPROM_POSIX
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(concurrent() fetchAdd() doesnt lose counts) {
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        std::thread *threads[4];
+        uint32_t count = 0;
+        uint64_t sequence = 0;
+        int i;
+        EEPROM->begin();
+        EEPROM->put(8, count);
+        EEPROM->put(16, sequence);
+        fct_xchk(EEPROM->concurrent(), "concurrent() returned FALSE");
+        for (i = 0; i < 4; i++) {
+            threads[i] = new std::thread(atomicCounter, EEPROM, 20000);
+        }
+        for (i = 0; i < 4; i++) {
+            threads[i]->join();
+            delete threads[i];
+        }
+        fct_xchk(EEPROM->get(8, count) == 80000, "Expected 80000 got %u", count);
+        fct_xchk(EEPROM->get(16, sequence) == 80000, "Expected 80000 got %u", (unsigned)sequence);
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+#endif
+#if RAM_EEPROM_STATS
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(stats() counts operations and bytes) {
+        RAMEEPROMStats stats;
+        uint8_t buffer[16] = { 0 };
+        int32_t value = 0;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        EEPROM->begin();
+        EEPROM->write(0, 1);
+        EEPROM->read(0);
+        EEPROM->put(8, value);
+        EEPROM->get(8, value);
+        EEPROM->writeBlocks(2, 2, buffer);
+        EEPROM->readBlock(2, buffer);
+        EEPROM->copyBlock(5, 2);
+        EEPROM->read(-1);
+        EEPROM->writeBlock(EEPROM_SIZE, buffer);
+        EEPROM->commit();
+        EEPROM->stats(stats);
+        fct_xchk(stats.reads == 2, "reads: Expected 2 got %u", stats.reads);
+        fct_xchk(stats.writes == 1, "writes: Expected 1 got %u", stats.writes);
+        fct_xchk(stats.gets == 1, "gets: Expected 1 got %u", stats.gets);
+        fct_xchk(stats.puts == 1, "puts: Expected 1 got %u", stats.puts);
+        fct_xchk(stats.blockReads == 1, "blockReads: Expected 1 got %u", stats.blockReads);
+        fct_xchk(stats.blockWrites == 2, "blockWrites: Expected 2 got %u", stats.blockWrites);
+        fct_xchk(stats.blockCopies == 1, "blockCopies: Expected 1 got %u", stats.blockCopies);
+        fct_xchk(stats.commits == 1, "commits: Expected 1 got %u", stats.commits);
+        fct_xchk(stats.rejected == 2, "rejected: Expected 2 got %u", stats.rejected);
+        fct_xchk(stats.bytesRead == 1 + 4 + 8 + 8, "bytesRead: Expected 21 got %u", (unsigned)stats.bytesRead);
+        fct_xchk(stats.bytesWritten == 1 + 4 + 16 + 8, "bytesWritten: Expected 29 got %u", (unsigned)stats.bytesWritten);
+        EEPROM->clearStats();
+        EEPROM->stats(stats);
+        fct_xchk((stats.reads == 0) && (stats.bytesWritten == 0), "clearStats() didn't clear");
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(pageWrites() counts writes to each block) {
+        uint8_t buffer[8] = { 0 };
+        uint8_t i;
+        RAMEEPROMClass *EEPROM = new RAMEEPROMClass((void *)NULL, EEPROM_SIZE, 8);
+        EEPROM->begin();
+        for (i = 0; i < 5; i++) {
+            EEPROM->writeBlock(3, buffer);
+        }
+        EEPROM->put(6, (int32_t)1);
+        fct_xchk(EEPROM->pageWrites(3) == 5, "Expected 5 got %u", EEPROM->pageWrites(3));
+        fct_xchk(EEPROM->pageWrites(0) == 1, "Expected 1 got %u", EEPROM->pageWrites(0));
+        fct_xchk(EEPROM->pageWrites(1) == 1, "Expected 1 got %u", EEPROM->pageWrites(1));
+        fct_xchk(EEPROM->pageWrites(2) == 0, "Expected 0 got %u", EEPROM->pageWrites(2));
+        fct_xchk(EEPROM->pageWrites(1000) == 0, "Expected 0 got %u", EEPROM->pageWrites(1000));
+        delete EEPROM;
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(RAMEEPROM<> counts its own get() and put()) {
+        RAMEEPROM<EEPROM_SIZE, 8> EEPROM;
+        RAMEEPROMStats stats;
+        int32_t value = 3;
+        EEPROM.put<8>(value);
+        EEPROM.put(8, value);
+        EEPROM.get<8>(value);
+        // Rejected, and only counted as that, like RAMEEPROMClass
+        EEPROM.get(EEPROM_SIZE, value);
+        EEPROM.put(-1, value);
+        EEPROM.stats(stats);
+        fct_xchk((stats.puts == 2) && (stats.gets == 1), "Expected 2/1 got %u/%u", stats.puts, stats.gets);
+        fct_xchk(stats.rejected == 2, "Expected 2 got %u", stats.rejected);
+        fct_xchk(EEPROM.pageWrites(1) == 2, "Expected 2 got %u", EEPROM.pageWrites(1));
+    }
+    FCT_TEST_END()
+#endif
 
 }
 FCTMF_FIXTURE_SUITE_END();
@@ -0,0 +1,157 @@
+/**
+ * @file       test/test_ram_eeprom_allocator.cpp
+ * @author     Scott L. Price <prices@hugllc.com>
+ * @copyright  © 2016 Hunt Utilities Group, LLC
+ * @brief   The test file for RAM_EEPROM_Allocator.cpp
+ * @details
+ *
+ *
+ */
+/*
+ *
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "main.h"
+#include "RAM_EEPROM_Allocator.h"
+
+FCTMF_FIXTURE_SUITE_BGN(test_ram_eeprom_allocator)
+{
+    /**
+    * @brief This sets up this suite
+    *
+    * @return void
+    */
+    FCT_SETUP_BGN() {
+        TestInit();
+    }
+    FCT_SETUP_END();
+    /**
+    * @brief This tears down this suite
+    *
+    * @return void
+    */
+    FCT_TEARDOWN_BGN() {
+    } FCT_TEARDOWN_END()
+    /**
+     * @brief Test single blocks
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(allocate and free single blocks) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        RAMEEPROMClass noBlocks(0u, 4096);
+        RAMEEPROMAllocator blocks(EEPROM);
+        RAMEEPROMAllocator none(noBlocks);
+        int i;
+        fct_xchk(blocks.begin(), "begin failed");
+        fct_xchk(!none.begin(), "Expected false without a block size");
+        // One bitmap block for the other 127
+        fct_xchk(blocks.firstBlock() == 1, "Expected 1 got %d", blocks.firstBlock());
+        fct_xchk(blocks.blocks() == 127, "Expected 127 got %u", (unsigned)blocks.blocks());
+        for (i = 1; i < 128; i++) {
+            fct_xchk(blocks.allocate() == i, "Expected %d", i);
+        }
+        fct_xchk(blocks.allocate() == -1, "Expected -1 when full");
+        fct_xchk(blocks.freeBlocks() == 0, "Expected 0 got %u", (unsigned)blocks.freeBlocks());
+        fct_xchk(blocks.free(70), "free failed");
+        fct_xchk(blocks.free(3), "free failed");
+        fct_xchk(!blocks.free(3), "Expected false freeing twice");
+        fct_xchk(!blocks.free(0), "Expected false freeing the bitmap");
+        fct_xchk(!blocks.free(128), "Expected false past the end");
+        fct_xchk(blocks.isFree(70), "Expected 70 free");
+        fct_xchk(!blocks.isFree(71), "Expected 71 used");
+        fct_xchk(blocks.allocate() == 3, "Expected the lowest");
+        fct_xchk(blocks.allocate() == 70, "Expected 70");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test runs of blocks
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(allocate finds runs across words) {
+        RAMEEPROMClass EEPROM(0u, 8192, 32);
+        RAMEEPROMAllocator blocks(EEPROM);
+        RAMEEPROMAllocStats stats;
+        int i;
+        blocks.begin();
+        // Bits 0 to 59 used, leaving 4 at the top of the first word
+        for (i = 0; i < 60; i++) {
+            blocks.allocate();
+        }
+        fct_xchk(blocks.allocate(3) == 61, "Expected 61");
+        // One left in word 0, so 10 has to start there and go over
+        fct_xchk(blocks.allocate(10) == 64, "Expected 64");
+        fct_xchk(blocks.allocate(100) == 74, "Expected 74");
+        blocks.free(20, 5);
+        blocks.free(40, 2);
+        fct_xchk(blocks.allocate(4) == 20, "Expected 20");
+        fct_xchk(blocks.allocate(3) == 174, "Expected 174");
+        fct_xchk(blocks.allocate(0) == -1, "Expected -1 for 0 blocks");
+        fct_xchk(blocks.allocate(1000) == -1, "Expected -1 for too many");
+        fct_xchk(!blocks.free(20, 5), "Expected false with 24 free");
+        blocks.allocStats(stats);
+        // 24, 40 to 41 and 177 to 255
+        fct_xchk(stats.freeBlocks == 82, "Expected 82 got %u", stats.freeBlocks);
+        fct_xchk(stats.freeRuns == 3, "Expected 3 got %u", stats.freeRuns);
+        fct_xchk(stats.largestRun == 79, "Expected 79 got %u", stats.largestRun);
+        fct_xchk(stats.fragmentation == 4, "Expected 4 got %u", stats.fragmentation);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test the bitmap in the E2
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(begin reads the bitmap back) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        int i;
+        {
+            RAMEEPROMAllocator blocks(EEPROM, 16, 64);
+            blocks.begin();
+            for (i = 0; i < 10; i++) {
+                blocks.allocate();
+            }
+            blocks.free(20);
+        }
+        // 10 bits allocated, then one given back: bit 3 of byte 0
+        fct_xchk(EEPROM.read(16 * 32) == 0x08, "Expected 0x08 got 0x%X", EEPROM.read(16 * 32));
+        fct_xchk(EEPROM.read(16 * 32 + 1) == 0xFC, "Expected 0xFC got 0x%X", EEPROM.read(16 * 32 + 1));
+        RAMEEPROMAllocator blocks(EEPROM, 16, 64);
+        fct_xchk(blocks.begin(), "begin failed");
+        fct_xchk(blocks.freeBlocks() == 54, "Expected 54 got %u", (unsigned)blocks.freeBlocks());
+        fct_xchk(blocks.allocate() == 20, "Expected 20");
+        fct_xchk(blocks.allocate() == 27, "Expected 27");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test a big device
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(allocate stays fast with many blocks) {
+        RAMEEPROMSparseClass EEPROM(16 * 1024 * 1024, 32);
+        RAMEEPROMAllocator blocks(EEPROM);
+        int i, first = -1, last = -1;
+        fct_xchk(blocks.begin(), "begin failed");
+        // 524288 blocks, 2041 of them for the bitmap
+        fct_xchk(blocks.blocks() == 522247, "Expected 522247 got %u", (unsigned)blocks.blocks());
+        for (i = 0; i < 1000; i++) {
+            last = blocks.allocate();
+            if (first < 0) {
+                first = last;
+            }
+        }
+        fct_xchk(first == 2041, "Expected 2041 got %d", first);
+        fct_xchk(last == 3040, "Expected 3040 got %d", last);
+        blocks.free(2500);
+        fct_xchk(blocks.allocate() == 2500, "Expected 2500");
+        fct_xchk(blocks.allocate(5000) == 3041, "Expected 3041");
+    }
+    FCT_TEST_END()
+
+}
+FCTMF_FIXTURE_SUITE_END();
@@ -0,0 +1,560 @@
+/**
+ * @file       test/test_ram_eeprom_backend.cpp
+ * @author     Scott L. Price <prices@hugllc.com>
+ * @copyright  © 2016 Hunt Utilities Group, LLC
+ * @brief   The test file for RAM_EEPROM_Backend.cpp
+ * @details
+ *
+ *
+ */
+/*
+ *
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <vector>
+#include <thread>
+#include "main.h"
+#include "RAM_EEPROM_Backend.h"
+#include "RAM_EEPROM_CRC.h"
+
+/**
+ * Keeps what sync() was given, and can fail its writes
+ */
+class RecordingBackend : public RAMEEPROMBackend {
+public:
+    RecordingBackend(bool direct) : memory(), synced(), _direct(direct) {}
+
+    bool open(size_t size) {
+        memset(memory, 0xFF, sizeof(memory));
+        return size <= sizeof(memory);
+    }
+    uint8_t *data(void) {
+        return _direct ? memory : NULL;
+    }
+    bool read(size_t address, void *buffer, size_t length) {
+        memcpy(buffer, &memory[address], length);
+        return true;
+    }
+    bool write(size_t address, const void *buffer, size_t length) {
+        if (fail) {
+            return false;
+        }
+        memcpy(&memory[address], buffer, length);
+        return true;
+    }
+    bool sync(const RAMEEPROMRange *ranges, size_t count) {
+        calls++;
+        for (size_t i = 0; i < count; i++) {
+            synced.push_back(ranges[i]);
+        }
+        return true;
+    }
+
+    uint8_t memory[1024];
+    std::vector<RAMEEPROMRange> synced;
+    int calls = 0;
+    bool fail = false;
+
+private:
+    bool _direct;
+};
+
+#if RAM_EEPROM_POSIX
+/**
+ * Holds sync() up until it is let go, the way a slow disk would
+ */
+class GatedBackend : public RAMEEPROMBackend {
+public:
+    GatedBackend() : memory(), synced() {}
+
+    bool open(size_t size) {
+        memset(memory, 0xFF, sizeof(memory));
+        return size <= sizeof(memory);
+    }
+    uint8_t *data(void) {
+        return memory;
+    }
+    bool read(size_t address, void *buffer, size_t length) {
+        return false;
+    }
+    bool write(size_t address, const void *buffer, size_t length) {
+        return false;
+    }
+    bool sync(const RAMEEPROMRange *ranges, size_t count) {
+        while (__atomic_load_n(&hold, __ATOMIC_ACQUIRE)) {
+            usleep(100);
+        }
+        for (size_t i = 0; i < count; i++) {
+            synced.push_back(ranges[i]);
+        }
+        return !fail;
+    }
+
+    uint8_t memory[1024];
+    std::vector<RAMEEPROMRange> synced;
+    bool hold = false;
+    bool fail = false;
+};
+
+/**
+ * What the async commit() callback was told
+ */
+struct CommitCalls {
+    int count;
+    uint64_t last;
+    bool ok;
+};
+
+static void commitDone(void *arg, uint64_t number, bool ok)
+{
+    CommitCalls *calls = (CommitCalls *)arg;
+    calls->count++;
+    calls->last = number;
+    calls->ok = ok;
+}
+#endif
+
+FCTMF_FIXTURE_SUITE_BGN(test_ram_eeprom_backend)
+{
+    /**
+    * @brief This sets up this suite
+    *
+    * @return void
+    */
+    FCT_SETUP_BGN() {
+        TestInit();
+    }
+    FCT_SETUP_END();
+    /**
+    * @brief This tears down this suite
+    *
+    * @return void
+    */
+    FCT_TEARDOWN_BGN() {
+    } FCT_TEARDOWN_END()
+    /**
+     * @brief Test the RAM backend
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(A RAM backend is used in place) {
+        RAMEEPROMRamBackend ram;
+        RAMEEPROMClass EEPROM(ram, 256, 16);
+        uint32_t value = 0;
+        fct_xchk(EEPROM.backend() == &ram, "Expected the backend");
+        fct_xchk(ram.data() != NULL, "Expected the backend to be open");
+        EEPROM.put(20, (uint32_t)0x12345678);
+        fct_xchk(ram.data()[20] == 0x78, "Expected 0x78 got 0x%X", ram.data()[20]);
+        fct_xchk(ram.data()[100] == 0xFF, "Expected 0xFF got 0x%X", ram.data()[100]);
+        fct_xchk(EEPROM.fetchAdd(20, (uint32_t)1), "fetchAdd() returned FALSE");
+        fct_xchk(EEPROM.get(20, value) == 0x12345679, "Expected 0x12345679 got 0x%X", value);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        EEPROM.end();
+        fct_xchk(ram.data() == NULL, "Expected end() to close the backend");
+        fct_xchk(EEPROM.read(20) == 0, "Readable after end()");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test commit() handing ranges to sync()
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(commit() hands the dirty ranges to sync() in batches) {
+        RecordingBackend backend(true);
+        RAMEEPROMClass EEPROM(backend, 1024, 16);
+        int i;
+        // 20 ranges, with a two block one in the middle
+        for (i = 0; i < 20; i++) {
+            EEPROM.write(i * 48, 1);
+        }
+        EEPROM.write(5 * 48 + 16, 1);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        fct_xchk(backend.calls == 2, "Expected 2 got %d", backend.calls);
+        fct_xchk(backend.synced.size() == 20, "Expected 20 got %u", (unsigned)backend.synced.size());
+        fct_xchk((backend.synced[5].address == 240) && (backend.synced[5].length == 32),
+            "Expected 240/32 got %u/%u", (unsigned)backend.synced[5].address, (unsigned)backend.synced[5].length);
+        fct_xchk(backend.synced[19].address == 912, "Expected 912 got %u", (unsigned)backend.synced[19].address);
+        fct_xchk(!EEPROM.isDirty(0), "Still dirty after commit()");
+        backend.calls = 0;
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        fct_xchk(backend.calls == 0, "Expected nothing to sync");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test a backend without data()
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(A backend without data() sees every access) {
+        RecordingBackend backend(false);
+        RAMEEPROMClass EEPROM(backend, 1024, 16);
+        RAMEEPROMSnapshot *snap;
+        uint8_t buffer[40], block[16];
+        int i;
+        for (i = 0; i < 40; i++) {
+            buffer[i] = i;
+        }
+        fct_xchk(EEPROM.writeBytes(10, buffer, 40), "writeBytes() returned FALSE");
+        fct_xchk(backend.memory[10] == 0 && backend.memory[49] == 39, "Expected the bytes in the backend");
+        fct_xchk(EEPROM.compareBytes(10, buffer, 40), "compareBytes() returned FALSE");
+        fct_xchk(EEPROM.moveBlocks(1, 0, 3), "moveBlocks() returned FALSE");
+        EEPROM.readBlock(1, block);
+        fct_xchk((block[10] == 0) && (block[15] == 5), "Expected 0/5 got %u/%u", block[10], block[15]);
+        snap = EEPROM.snapshot();
+        EEPROM.checksums();
+        EEPROM.fillBytes(0, 0, 100);
+        fct_xchk(snap->read(26) == 0, "Expected the snapshot to keep 0 got %u", snap->read(26));
+        fct_xchk(EEPROM.read(26) == 0, "Expected 0 got %u", EEPROM.read(26));
+        EEPROM.readBlock(2, block);
+        fct_xchk(EEPROM.pageCrc(2) == RAMEEPROMCrc32c(block, 16), "Page 2 is wrong");
+        delete snap;
+        EEPROM.erase();
+        fct_xchk(backend.memory[1023] == 0xFF && backend.memory[0] == 0xFF, "Expected erase() to reach the backend");
+        fct_xchk(!EEPROM.fetchAdd(0, (uint32_t)1), "Expected atomics to be refused");
+#if RAM_EEPROM_POSIX
+        fct_xchk(!EEPROM.concurrent(), "Expected concurrent() to be refused");
+#endif
+        backend.fail = true;
+        EEPROM.write(0, 5);
+        fct_xchk(!EEPROM.commit(), "Expected commit() to report the failed write");
+        backend.fail = false;
+        EEPROM.write(0, 5);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        // Flash mode goes with the backend
+        RAMEEPROMFlashConfig config = {256, 64, 10, 1000};
+        fct_xchk(EEPROM.flash(config), "flash() returned FALSE");
+        EEPROM.end();
+        fct_xchk(EEPROM.sectors() == 0, "Expected 0 got %u", (unsigned)EEPROM.sectors());
+        fct_xchk(!EEPROM.eraseSector(0), "Expected false after end()");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test the slow device simulator
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(The slow backend charges for the bus and page writes) {
+        RAMEEPROMSlowConfig config = { 16, 10, 1, 100 };
+        RAMEEPROMSlowBackend device(config);
+        RAMEEPROMClass EEPROM(device, 256, 16);
+        RAMEEPROMSlowStats stats;
+        uint8_t buffer[20];
+        memset(buffer, 0x5A, sizeof(buffer));
+        // 8 bytes in one page and 12 in the next
+        EEPROM.writeBytes(8, buffer, sizeof(buffer));
+        device.slowStats(stats);
+        fct_xchk(stats.writes == 2, "Expected 2 got %u", stats.writes);
+        fct_xchk(stats.bytesWritten == 20, "Expected 20 got %u", (unsigned)stats.bytesWritten);
+        fct_xchk(stats.time == 2 * 10 + 20 + 2 * 100, "Expected 240 got %u", (unsigned)stats.time);
+        device.clearSlowStats();
+        buffer[0] = EEPROM.read(27);
+        buffer[1] = EEPROM.read(28);
+        fct_xchk((buffer[0] == 0x5A) && (buffer[1] == 0xFF), "Expected 0x5A/0xFF got 0x%X/0x%X", buffer[0], buffer[1]);
+        device.slowStats(stats);
+        fct_xchk((stats.reads == 2) && (stats.time == 22), "Expected 2/22 got %u/%u", stats.reads, (unsigned)stats.time);
+        fct_xchk(!device.read(250, buffer, 10), "Expected false past the end");
+    }
+    FCT_TEST_END()
+#if RAM_EEPROM_POSIX
+    /**
+     * @brief Test shared memory
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(Two shm backends share the same bytes) {
+        char name[64];
+        uint32_t value = 0;
+        snprintf(name, sizeof(name), "/ram_eeprom_test_%d", (int)getpid());
+        RAMEEPROMShmBackend first(name), second(name);
+        {
+            RAMEEPROMClass A(first, 4096, 64);
+            RAMEEPROMClass B(second, 4096, 64);
+            fct_xchk(A.read(100) == 0xFF, "Expected 0xFF got 0x%X", A.read(100));
+            A.put(100, (uint32_t)0xCAFEF00D);
+            fct_xchk(B.get(100, value) == 0xCAFEF00D, "Expected 0xCAFEF00D got 0x%X", value);
+            B.fetchAdd(100, (uint32_t)2);
+            fct_xchk(A.get(100, value) == 0xCAFEF00F, "Expected 0xCAFEF00F got 0x%X", value);
+        }
+        {
+            RAMEEPROMClass A(first, 4096, 64);
+            fct_xchk(A.get(100, value) == 0xCAFEF00F, "Expected it to outlast the E2s");
+        }
+        {
+            // The stripes have to cover the same pages in both
+            RAMEEPROMShmBackend third(name);
+            RAMEEPROMClass A(first, 4096, 64), B(second, 4096, 32), C(third, 4096, 64);
+            fct_xchk(A.concurrent(), "concurrent() returned FALSE");
+            fct_xchk(!B.concurrent(), "Expected false with a different block size");
+            fct_xchk(C.concurrent(), "concurrent() returned FALSE");
+        }
+        fct_xchk(first.unlink(), "unlink() returned FALSE");
+        fct_xchk(!second.unlink(), "Expected it to be gone");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test the seqlocks in shared memory
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(E2s in different processes share the seqlocks) {
+        char name[64];
+        uint32_t value[4] = { 0, 0, 0, 0 };
+        uint32_t counter = 0;
+        uint64_t seen = 0, now;
+        bool torn = false, backwards = false;
+        pid_t child;
+        int status = -1;
+        snprintf(name, sizeof(name), "/ram_eeprom_seq_%d", (int)getpid());
+        RAMEEPROMShmBackend mine(name);
+        RAMEEPROMClass EEPROM(mine, 1024, 32);
+        fct_xchk(mine.shared() != NULL, "Expected shared()");
+        fct_xchk(EEPROM.changes() == 0, "Expected 0 outside concurrent mode");
+        fct_xchk(EEPROM.concurrent(), "concurrent() returned FALSE");
+        EEPROM.put(30, value);
+        EEPROM.put(100, counter);
+        child = fork();
+        if (child == 0) {
+            // Its own mapping and E2, like another program would have
+            RAMEEPROMShmBackend theirs(name);
+            RAMEEPROMClass Other(theirs, 1024, 32);
+            Other.concurrent();
+            for (uint32_t i = 1; i <= 20000; i++) {
+                uint32_t out[4] = { i, i, i, i };
+                // Across two stripes
+                Other.put(30, out);
+                Other.fetchAdd(100, (uint32_t)1);
+            }
+            _exit(0);
+        }
+        fct_xchk(child > 0, "fork() failed");
+        for (int i = 0; i < 20000; i++) {
+            EEPROM.fetchAdd(100, (uint32_t)1);
+        }
+        while ((child > 0) && (value[0] != 20000) && !torn) {
+            now = EEPROM.changes();
+            backwards = backwards || (now < seen);
+            seen = now;
+            EEPROM.get(30, value);
+            torn = (value[0] != value[1]) || (value[0] != value[2]) || (value[0] != value[3]);
+        }
+        waitpid(child, &status, 0);
+        fct_xchk(WIFEXITED(status) && (WEXITSTATUS(status) == 0), "The child failed");
+        fct_xchk(!torn, "Torn read %u %u %u %u", value[0], value[1], value[2], value[3]);
+        fct_xchk(!backwards, "changes() went backwards");
+        fct_xchk(EEPROM.get(100, counter) == 40000, "Expected 40000 got %u", counter);
+        // The child's puts and fetchAdds, and ours
+        now = EEPROM.changes();
+        fct_xchk(now == 60002, "Expected 60002 got %u", (unsigned)now);
+        mine.unlink();
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test async commits
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(An async commit() returns before sync() is done) {
+        GatedBackend backend;
+        RAMEEPROMClass EEPROM(backend, 1024, 16);
+        CommitCalls calls = { 0, 0, false };
+        fct_xchk(EEPROM.async(true, RAM_EEPROM_ASYNC_LIMIT, commitDone, &calls), "async() returned FALSE");
+        __atomic_store_n(&backend.hold, true, __ATOMIC_RELEASE);
+        EEPROM.write(0, 1);
+        EEPROM.write(100, 2);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        fct_xchk(!EEPROM.isDirty(0), "Still dirty after commit()");
+        EEPROM.write(200, 3);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        // Nothing to queue
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        fct_xchk(EEPROM.lastCommit() == 2, "Expected 2 got %u", (unsigned)EEPROM.lastCommit());
+        fct_xchk(EEPROM.committed() == 0, "Expected 0 got %u", (unsigned)EEPROM.committed());
+        __atomic_store_n(&backend.hold, false, __ATOMIC_RELEASE);
+        fct_xchk(EEPROM.flush(), "flush() returned FALSE");
+        fct_xchk(EEPROM.committed() == 2, "Expected 2 got %u", (unsigned)EEPROM.committed());
+        fct_xchk((calls.count == 2) && (calls.last == 2) && calls.ok, "Expected 2 good callbacks got %d", calls.count);
+        fct_xchk(backend.synced.size() == 3, "Expected 3 got %u", (unsigned)backend.synced.size());
+        fct_xchk(backend.synced[2].address == 192, "Expected 192 got %u", (unsigned)backend.synced[2].address);
+        // A failed sync() comes back from flush(), once
+        backend.fail = true;
+        EEPROM.write(0, 4);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        fct_xchk(!EEPROM.flush(), "Expected flush() to report the failure");
+        fct_xchk(!calls.ok, "Expected the callback to be told");
+        fct_xchk(EEPROM.flush(), "flush() returned FALSE");
+        fct_xchk(EEPROM.async(false), "async(false) returned FALSE");
+        fct_xchk(EEPROM.lastCommit() == 0, "Expected 0 out of async mode");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test the async queue limit
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(An async commit() waits when the queue is full) {
+        GatedBackend backend;
+        RAMEEPROMClass EEPROM(backend, 1024, 16);
+        bool done = false;
+        fct_xchk(EEPROM.async(true, 48), "async() returned FALSE");
+        __atomic_store_n(&backend.hold, true, __ATOMIC_RELEASE);
+        EEPROM.write(0, 1);
+        EEPROM.write(32, 1);
+        EEPROM.write(64, 1);
+        EEPROM.commit();
+        EEPROM.write(500, 1);
+        std::thread writer([&]() {
+            EEPROM.commit();
+            __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+        });
+        usleep(20000);
+        fct_xchk(!__atomic_load_n(&done, __ATOMIC_ACQUIRE), "Expected commit() to wait");
+        __atomic_store_n(&backend.hold, false, __ATOMIC_RELEASE);
+        writer.join();
+        fct_xchk(done, "Expected commit() to finish");
+        fct_xchk(EEPROM.flush(), "flush() returned FALSE");
+        fct_xchk(backend.synced.size() == 4, "Expected 4 got %u", (unsigned)backend.synced.size());
+        // One bigger than the limit still goes on its own
+        EEPROM.fillBytes(0, 0, 1024);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        fct_xchk(EEPROM.flush(), "flush() returned FALSE");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test where async mode can't be used
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(Async mode needs a backend with data()) {
+        RecordingBackend backend(false);
+        RAMEEPROMClass EEPROM(backend, 1024, 16), Plain((void *)NULL, 1024, 16);
+        fct_xchk(!EEPROM.async(), "Expected async() to be refused");
+        fct_xchk(!Plain.async(), "Expected async() to be refused in RAM");
+        fct_xchk(EEPROM.flush(), "flush() returned FALSE");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test the file backend
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(A file backend joins up the ranges and writes them together) {
+        for (int mode = 0; mode < 2; mode++) {
+            char filename[] = "/tmp/ram_eeprom_XXXXXX";
+            uint8_t buffer[4096];
+            RAMEEPROMFileStats stats;
+            size_t got = 0;
+            FILE *fd;
+            close(mkstemp(filename));
+            // io_uring first, then pwrite()
+            RAMEEPROMFileBackend file(filename, false, mode == 0);
+            {
+                RAMEEPROMClass EEPROM(file, 4096, 16);
+                fct_xchk(EEPROM.read(100) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(100));
+                file.clearFileStats();
+                // 8 blocks close together are one write, and two far off are two more
+                for (int i = 0; i < 8; i++) {
+                    EEPROM.write(i * 48, i + 1);
+                }
+                EEPROM.write(2048, 0x11);
+                EEPROM.write(4080, 0x22);
+                fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+                file.fileStats(stats);
+                fct_xchk((stats.syncs == 1) && (stats.writes == 3), "Expected 1/3 got %u/%u", stats.syncs, stats.writes);
+                fct_xchk(stats.bytes == 352 + 16 + 16, "Expected 384 got %u", (unsigned)stats.bytes);
+                if (file.uring()) {
+                    fct_xchk(stats.syscalls == 1, "Expected 1 got %u", stats.syscalls);
+                } else {
+                    fct_xchk(stats.syscalls == 4, "Expected 4 got %u", stats.syscalls);
+                }
+                fct_xchk((mode == 0) || !file.uring(), "Expected no io_uring");
+            }
+            fd = fopen(filename, "rb");
+            if (fd != NULL) {
+                got = fread(buffer, 1, sizeof(buffer), fd);
+                fclose(fd);
+            }
+            fct_xchk(got == 4096, "Expected 4096 got %u", (unsigned)got);
+            fct_xchk((buffer[48] == 2) && (buffer[2048] == 0x11) && (buffer[4080] == 0x22) && (buffer[20] == 0xFF),
+                "The file is wrong");
+            {
+                RAMEEPROMClass EEPROM(file, 4096, 16);
+                fct_xchk(EEPROM.read(336) == 8, "Expected 8 got %u", EEPROM.read(336));
+            }
+            unlink(filename);
+        }
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test the file backend with O_DIRECT
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(A direct file backend writes whole aligned blocks) {
+        char filename[] = "/tmp/ram_eeprom_XXXXXX";
+        RAMEEPROMFileStats stats;
+        close(mkstemp(filename));
+        RAMEEPROMFileBackend file(filename, true);
+        {
+            RAMEEPROMClass EEPROM(file, 10000, 16);
+            fct_xchk(((uintptr_t)file.data() % RAM_EEPROM_FILE_ALIGN) == 0, "Expected an aligned buffer");
+            file.clearFileStats();
+            EEPROM.write(5000, 7);
+            EEPROM.write(9990, 8);
+            fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+            file.fileStats(stats);
+            if (file.direct()) {
+                // 4096 to 8192 and 8192 to 12288, joined
+                fct_xchk((stats.writes == 1) && (stats.bytes == 8192), "Expected 1/8192 got %u/%u",
+                    stats.writes, (unsigned)stats.bytes);
+            }
+        }
+        {
+            RAMEEPROMFileBackend again(filename, true);
+            RAMEEPROMClass EEPROM(again, 10000, 16);
+            fct_xchk((EEPROM.read(5000) == 7) && (EEPROM.read(9990) == 8), "Expected 7/8 got %u/%u",
+                EEPROM.read(5000), EEPROM.read(9990));
+            fct_xchk(EEPROM.read(9999) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(9999));
+        }
+        unlink(filename);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test the file stats in async mode
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(File stats can be read while the flusher is syncing) {
+        char filename[] = "/tmp/ram_eeprom_XXXXXX";
+        RAMEEPROMFileStats stats;
+        uint32_t last = 0;
+        bool good = true;
+        close(mkstemp(filename));
+        RAMEEPROMFileBackend file(filename);
+        {
+            RAMEEPROMClass EEPROM(file, 4096, 16);
+            file.clearFileStats();
+            fct_xchk(EEPROM.async(), "async() returned FALSE");
+            for (int i = 0; i < 50; i++) {
+                EEPROM.write(i * 64, i);
+                EEPROM.commit();
+                file.fileStats(stats);
+                good = good && (stats.syncs >= last);
+                last = stats.syncs;
+            }
+            fct_xchk(EEPROM.flush(), "flush() returned FALSE");
+            file.fileStats(stats);
+            fct_xchk(good, "Expected the syncs to only go up");
+            fct_xchk((stats.syncs == 50) && (stats.writes == 50), "Expected 50/50 got %u/%u", stats.syncs, stats.writes);
+        }
+        unlink(filename);
+    }
+    FCT_TEST_END()
+#endif
+
+}
+FCTMF_FIXTURE_SUITE_END();
@@ -0,0 +1,197 @@
+/**
+ * @file       test/test_ram_eeprom_cache.cpp
+ * @author     Scott L. Price <prices@hugllc.com>
+ * @copyright  © 2016 Hunt Utilities Group, LLC
+ * @brief   The test file for RAM_EEPROM_Cache.cpp
+ * @details
+ *
+ *
+ */
+/*
+ *
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "main.h"
+#include "RAM_EEPROM_Backend.h"
+#include "RAM_EEPROM_Cache.h"
+
+FCTMF_FIXTURE_SUITE_BGN(test_ram_eeprom_cache)
+{
+    /**
+    * @brief This sets up this suite
+    *
+    * @return void
+    */
+    FCT_SETUP_BGN() {
+        TestInit();
+    }
+    FCT_SETUP_END();
+    /**
+    * @brief This tears down this suite
+    *
+    * @return void
+    */
+    FCT_TEARDOWN_BGN() {
+    } FCT_TEARDOWN_END()
+    /**
+     * @brief Test that writes wait for commit()
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(Writes stay in the cache until commit() and go back joined) {
+        RAMEEPROMSlowConfig config = { 64, 10, 1, 100 };
+        RAMEEPROMSlowBackend device(config);
+        RAMEEPROMCacheBackend cache(device, 8, 16);
+        RAMEEPROMClass EEPROM(cache, 1024, 16);
+        RAMEEPROMSlowStats stats;
+        RAMEEPROMCacheStats cstats;
+        uint8_t buffer[64];
+        int i;
+        for (i = 0; i < 64; i += 4) {
+            EEPROM.put(i, (uint32_t)(0x01010101 * i));
+        }
+        device.slowStats(stats);
+        fct_xchk(stats.writes == 0, "Expected 0 got %u", stats.writes);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        device.slowStats(stats);
+        fct_xchk(stats.writes == 1, "Expected 1 got %u", stats.writes);
+        fct_xchk(stats.bytesWritten == 64, "Expected 64 got %u", (unsigned)stats.bytesWritten);
+        cache.cacheStats(cstats);
+        fct_xchk(cstats.writeBacks == 1, "Expected 1 got %u", cstats.writeBacks);
+        fct_xchk(device.read(0, buffer, sizeof(buffer)), "read() returned FALSE");
+        fct_xchk((buffer[4] == 4) && (buffer[63] == 60), "Expected 4/60 got %u/%u", buffer[4], buffer[63]);
+        // Nothing is dirty now
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        device.slowStats(stats);
+        fct_xchk(stats.writes == 1, "Expected 1 got %u", stats.writes);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test eviction
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(Dirty lines are written back when they are evicted) {
+        RAMEEPROMSlowConfig config = { 64, 10, 1, 100 };
+        RAMEEPROMSlowBackend device(config);
+        RAMEEPROMCacheBackend cache(device, 4, 16);
+        RAMEEPROMClass EEPROM(cache, 1024, 16);
+        RAMEEPROMSlowStats stats;
+        RAMEEPROMCacheStats cstats;
+        uint8_t value = 0;
+        int i;
+        // Every other line, so nothing is read ahead
+        for (i = 0; i < 12; i++) {
+            EEPROM.write(i * 32 + 3, i + 1);
+        }
+        device.slowStats(stats);
+        fct_xchk(stats.writes == 8, "Expected 8 got %u", stats.writes);
+        cache.cacheStats(cstats);
+        fct_xchk(cstats.evictions == 8, "Expected 8 got %u", cstats.evictions);
+        fct_xchk(cstats.prefetches == 0, "Expected 0 got %u", cstats.prefetches);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        for (i = 0; i < 12; i++) {
+            device.read(i * 32 + 3, &value, 1);
+            fct_xchk(value == i + 1, "Expected %d got %u", i + 1, value);
+        }
+        fct_xchk(EEPROM.read(3) == 1, "Expected 1 got %u", EEPROM.read(3));
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test read ahead
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(A sequential scan is read ahead) {
+        RAMEEPROMSlowConfig config = { 64, 10, 1, 100 };
+        RAMEEPROMSlowBackend device(config), plain(config);
+        RAMEEPROMCacheBackend cache(device, 16, 16), none(plain, 16, 16, 0);
+        RAMEEPROMClass EEPROM(cache, 1024, 16), Other(none, 1024, 16);
+        RAMEEPROMSlowStats stats, other;
+        RAMEEPROMCacheStats cstats;
+        uint8_t buffer[1024];
+        bool good = true;
+        int i;
+        for (i = 0; i < 1024; i++) {
+            buffer[i] = (uint8_t)(i * 7);
+        }
+        device.write(0, buffer, sizeof(buffer));
+        plain.write(0, buffer, sizeof(buffer));
+        device.clearSlowStats();
+        plain.clearSlowStats();
+        for (i = 0; i < 1024; i++) {
+            good = good && (EEPROM.read(i) == buffer[i]) && (Other.read(i) == buffer[i]);
+        }
+        fct_xchk(good, "Expected the bytes back");
+        device.slowStats(stats);
+        plain.slowStats(other);
+        fct_xchk(other.reads == 64, "Expected 64 got %u", other.reads);
+        fct_xchk(stats.reads == 18, "Expected 18 got %u", stats.reads);
+        fct_xchk(stats.time < other.time, "Expected it to be quicker");
+        cache.cacheStats(cstats);
+        fct_xchk(cstats.misses == 2, "Expected 2 got %u", cstats.misses);
+        fct_xchk(cstats.prefetchHits == 62, "Expected 62 got %u", cstats.prefetchHits);
+        fct_xchk(cstats.prefetches == 62, "Expected 62 got %u", cstats.prefetches);
+        cache.clearCacheStats();
+        cache.cacheStats(cstats);
+        fct_xchk(cstats.hits == 0, "Expected 0 got %u", cstats.hits);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test against a plain E2
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(Random access matches a plain E2) {
+        RAMEEPROMSlowConfig config = { 64, 10, 1, 100 };
+        RAMEEPROMSlowBackend device(config);
+        RAMEEPROMRamBackend ram;
+        // 24 byte lines, so the last one is short
+        RAMEEPROMCacheBackend cache(device, 5, 24, 2);
+        RAMEEPROMClass EEPROM(cache, 1024, 16), Model(ram, 1024, 16);
+        uint8_t buffer[40], check[40];
+        bool good = true;
+        int i;
+        srand(22);
+        for (i = 0; (i < 4000) && good; i++) {
+            int address = rand() % 984;
+            size_t length = 1 + rand() % 40;
+            switch (rand() % 4) {
+            case 0:
+                for (size_t j = 0; j < length; j++) {
+                    buffer[j] = (uint8_t)rand();
+                }
+                EEPROM.writeBytes(address, buffer, length);
+                Model.writeBytes(address, buffer, length);
+                break;
+            case 1:
+                // Runs to the end
+                EEPROM.fillBytes(address, (uint8_t)i, 1024 - address);
+                Model.fillBytes(address, (uint8_t)i, 1024 - address);
+                break;
+            case 2:
+                EEPROM.commit();
+                break;
+            default:
+                EEPROM.readBytes(address, buffer, length);
+                Model.readBytes(address, check, length);
+                good = (memcmp(buffer, check, length) == 0);
+                break;
+            }
+        }
+        fct_xchk(good, "Mismatch at step %d", i);
+        fct_xchk(EEPROM.commit(), "commit() returned FALSE");
+        for (i = 0; (i < 1024) && good; i += 32) {
+            device.read(i, buffer, 32);
+            Model.readBytes(i, check, 32);
+            good = (memcmp(buffer, check, 32) == 0);
+        }
+        fct_xchk(good, "The device doesn't match at %d", i);
+    }
+    FCT_TEST_END()
+
+}
+FCTMF_FIXTURE_SUITE_END();
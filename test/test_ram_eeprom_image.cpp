@@ -0,0 +1,175 @@
+/**
+ * @file       test/test_ram_eeprom_image.cpp
+ * @author     Scott L. Price <prices@hugllc.com>
+ * @copyright  © 2016 Hunt Utilities Group, LLC
+ * @brief   The test file for RAM_EEPROM_Image.cpp
+ * @details
+ *
+ *
+ */
+/*
+ *
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "main.h"
+#include "RAM_EEPROM_Image.h"
+
+/**
+ * Returns a temporary file holding text, rewound
+ */
+static FILE *textFile(const char *text)
+{
+    FILE *file = tmpfile();
+    fputs(text, file);
+    rewind(file);
+    return file;
+}
+
+FCTMF_FIXTURE_SUITE_BGN(test_ram_eeprom_image)
+{
+    /**
+    * @brief This sets up this suite
+    *
+    * @return void
+    */
+    FCT_SETUP_BGN() {
+        TestInit();
+    }
+    FCT_SETUP_END();
+    /**
+    * @brief This tears down this suite
+    *
+    * @return void
+    */
+    FCT_TEARDOWN_BGN() {
+    } FCT_TEARDOWN_END()
+    /**
+     * @brief Test raw binary
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(binary images round trip) {
+        RAMEEPROMClass from(0u, 10000);
+        RAMEEPROMClass to(0u, 10000);
+        RAMEEPROMClass small(0u, 100);
+        uint8_t a[10000], b[10000];
+        FILE *file = tmpfile();
+        for (int i = 0; i < 10000; i++) {
+            from.write(i, i * 13);
+        }
+        fct_xchk(RAMEEPROMSaveBinary(from, file), "save failed");
+        fct_xchk(ftell(file) == 10000, "Expected 10000 got %ld", ftell(file));
+        rewind(file);
+        fct_xchk(RAMEEPROMLoadBinary(to, file), "load failed");
+        from.readBytes(0, a, sizeof(a));
+        to.readBytes(0, b, sizeof(b));
+        fct_xchk(memcmp(a, b, sizeof(a)) == 0, "The images don't match");
+        rewind(file);
+        fct_xchk(!RAMEEPROMLoadBinary(small, file), "Expected an oversize file to fail");
+        fct_xchk(small.read(99) == a[99], "Expected %u got %u", a[99], small.read(99));
+        fct_xchk(!RAMEEPROMSaveBinary(from, file, 9000, 2000), "Expected a bad range to fail");
+        fclose(file);
+        file = tmpfile();
+        RAMEEPROMSaveBinary(from, file, 100, 10);
+        rewind(file);
+        fct_xchk(RAMEEPROMLoadBinary(small, file, 50), "load failed");
+        fct_xchk(small.read(50) == a[100], "Expected %u got %u", a[100], small.read(50));
+        fclose(file);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test reading HEX
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(loadHex reads the records) {
+        RAMEEPROMClass EEPROM(0u, 0x30000);
+        FILE *file = textFile(
+            ":0400100001020304E2\r\n"
+            "\n"
+            ":020000040002F8\n"
+            ":04000005000000cd2a\n"
+            ":020020001122AB\n"
+            ":020000021000EC\n"
+            ":0100000055AA\n"
+            ":00000001FF\n"
+            ":0100000099XX\n"
+        );
+        fct_xchk(RAMEEPROMLoadHex(EEPROM, file), "loadHex failed");
+        fct_xchk(EEPROM.read(0x10) == 1, "Expected 1 got %u", EEPROM.read(0x10));
+        fct_xchk(EEPROM.read(0x13) == 4, "Expected 4 got %u", EEPROM.read(0x13));
+        fct_xchk(EEPROM.read(0x14) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(0x14));
+        fct_xchk(EEPROM.read(0x20020) == 0x11, "Expected 0x11 got 0x%X", EEPROM.read(0x20020));
+        fct_xchk(EEPROM.read(0x10000) == 0x55, "Expected 0x55 got 0x%X", EEPROM.read(0x10000));
+        fclose(file);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test bad HEX
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(loadHex rejects bad records) {
+        RAMEEPROMClass EEPROM(0u, 256);
+        const char *bad[] = {
+            ":0400100001020304E3\n",        // Checksum
+            "0400100001020304E2\n",         // No colon
+            ":0500100001020304E2\n",        // Length
+            ":04001000010203G4E2\n",        // Not hex
+            ":0401000001020304F1\n",        // Off the end
+            ":00000006FA\n",                // Unknown type
+        };
+        for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+            FILE *file = textFile(bad[i]);
+            fct_xchk(!RAMEEPROMLoadHex(EEPROM, file), "Expected %s to fail", bad[i]);
+            fclose(file);
+        }
+        fct_xchk(EEPROM.read(0x10) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(0x10));
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test writing HEX
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(saveHex skips erased runs and round trips) {
+        RAMEEPROMSparseClass from(1 << 20);
+        RAMEEPROMSparseClass to(1 << 20);
+        uint8_t a[4096], b[4096];
+        char line[64];
+        int lines = 0;
+        FILE *file = tmpfile();
+        for (int i = 0; i < 40; i++) {
+            from.write(i, i);
+        }
+        // A short erased run stays in the record, a long one doesn't
+        from.write(5, 0xFF);
+        from.write(0x1FFF8, 0x42);
+        from.fillBytes(0x1FFFC, 0x24, 8);
+        from.write(0xFFFFF, 0);
+        fct_xchk(RAMEEPROMSaveHex(from, file), "saveHex failed");
+        rewind(file);
+        while (fgets(line, sizeof(line), file) != NULL) {
+            lines++;
+        }
+        // 3 records at 0, one each side of 0x20000 with an 04 record each,
+        // an 04 and one at the end, and the end of file
+        fct_xchk(lines == 10, "Expected 10 got %d", lines);
+        rewind(file);
+        fct_xchk(RAMEEPROMLoadHex(to, file), "loadHex failed");
+        for (size_t at = 0; at < (1 << 20); at += sizeof(a)) {
+            from.readBytes(at, a, sizeof(a));
+            to.readBytes(at, b, sizeof(b));
+            fct_xchk(memcmp(a, b, sizeof(a)) == 0, "Mismatch at 0x%X", (unsigned)at);
+        }
+        fct_xchk(to.residentBytes() == 4 * RAM_EEPROM_SPARSE_PAGE_SIZE, "Expected 4 pages got %u bytes", (unsigned)to.residentBytes());
+        fclose(file);
+    }
+    FCT_TEST_END()
+
+}
+FCTMF_FIXTURE_SUITE_END();
@@ -0,0 +1,345 @@
+/**
+ * @file       test/test_ram_eeprom_journal.cpp
+ * @author     Scott L. Price <prices@hugllc.com>
+ * @copyright  © 2016 Hunt Utilities Group, LLC
+ * @brief   The test file for RAM_EEPROM_Journal.cpp
+ * @details
+ *
+ *
+ */
+/*
+ *
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "main.h"
+#include "RAM_EEPROM_Journal.h"
+#include "RAM_EEPROM_Backend.h"
+
+#define JOURNAL_ADDRESS 768
+#define JOURNAL_LENGTH 256
+
+/**
+ * A journal that can stop part way through a flush
+ */
+class CrashJournal : public RAMEEPROMJournal {
+public:
+    CrashJournal(RAMEEPROMClass &eeprom) : RAMEEPROMJournal(eeprom, JOURNAL_ADDRESS, JOURNAL_LENGTH, 100) {};
+    /**
+     * Writes the journal, then stops like the power went out
+     */
+    bool crash(void) {
+        return _writeJournal();
+    };
+};
+
+/**
+ * A backend in RAM whose sync() can be made to fail
+ */
+class FailingBackend : public RAMEEPROMBackend {
+public:
+    FailingBackend() : memory() {}
+
+    bool open(size_t size) {
+        memset(memory, 0xFF, sizeof(memory));
+        return size <= sizeof(memory);
+    }
+    uint8_t *data(void) {
+        return memory;
+    }
+    bool read(size_t address, void *buffer, size_t length) {
+        memcpy(buffer, &memory[address], length);
+        return true;
+    }
+    bool write(size_t address, const void *buffer, size_t length) {
+        memcpy(&memory[address], buffer, length);
+        return true;
+    }
+    bool sync(const RAMEEPROMRange *ranges, size_t count) {
+        return !fail;
+    }
+
+    uint8_t memory[1024];
+    bool fail = false;
+};
+
+FCTMF_FIXTURE_SUITE_BGN(test_ram_eeprom_journal)
+{
+    /**
+    * @brief This sets up this suite
+    *
+    * @return void
+    */
+    FCT_SETUP_BGN() {
+        TestInit();
+    }
+    FCT_SETUP_END();
+    /**
+    * @brief This tears down this suite
+    *
+    * @return void
+    */
+    FCT_TEARDOWN_BGN() {
+    } FCT_TEARDOWN_END()
+    /**
+     * @brief Test formatting a blank region
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(begin formats an erased region) {
+        RAMEEPROMClass EEPROM(0u, 1024);
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH);
+        fct_xchk(journal.begin(), "begin failed");
+        fct_xchk(journal.recovered() == 0, "Expected 0 got %u", journal.recovered());
+        fct_xchk(EEPROM.read(JOURNAL_ADDRESS) == 'R', "Expected 'R' got %u", EEPROM.read(JOURNAL_ADDRESS));
+        fct_xchk(journal.begin(), "second begin failed");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test bad journal regions
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(begin rejects a bad region) {
+        RAMEEPROMClass EEPROM(0u, 1024);
+        RAMEEPROMJournal outside(EEPROM, 900, JOURNAL_LENGTH);
+        RAMEEPROMJournal negative(EEPROM, -1, JOURNAL_LENGTH);
+        RAMEEPROMJournal tiny(EEPROM, 0, 16);
+        fct_xchk(!outside.begin(), "Expected false got true");
+        fct_xchk(!negative.begin(), "Expected false got true");
+        fct_xchk(!tiny.begin(), "Expected false got true");
+        fct_xchk(!outside.start(), "Expected false got true");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test a committed transaction
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(commit writes every put) {
+        RAMEEPROMClass EEPROM(0u, 1024);
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH);
+        uint32_t a = 0, b = 0;
+        journal.begin();
+        fct_xchk(journal.start(), "start failed");
+        fct_xchk(!journal.start(), "Expected nested start to fail");
+        fct_xchk(journal.put(0, (uint32_t)0x12345678), "put failed");
+        fct_xchk(journal.put(100, (uint32_t)0xCAFEF00D), "put failed");
+        fct_xchk(EEPROM.read(0) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(0));
+        fct_xchk(journal.commit(), "commit failed");
+        EEPROM.get(0, a);
+        EEPROM.get(100, b);
+        fct_xchk(a == 0x12345678, "Expected 0x12345678 got 0x%X", a);
+        fct_xchk(b == 0xCAFEF00D, "Expected 0xCAFEF00D got 0x%X", b);
+        fct_xchk(!EEPROM.isDirty(0) && !EEPROM.isDirty(100), "Expected the E2 to be committed");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test a commit that doesnt reach the backend
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(commit stops if the journal isnt committed) {
+        FailingBackend backend;
+        RAMEEPROMClass EEPROM(backend, 1024);
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH);
+        uint32_t a = 0;
+        fct_xchk(journal.begin(), "begin failed");
+        backend.fail = true;
+        journal.start();
+        journal.put(0, (uint32_t)0x12345678);
+        fct_xchk(!journal.commit(), "Expected commit to fail");
+        fct_xchk(EEPROM.get(0, a) == 0xFFFFFFFF, "Expected 0xFFFFFFFF got 0x%X", a);
+        fct_xchk(backend.memory[0] == 0xFF, "Expected 0xFF got 0x%X", backend.memory[0]);
+        // It is still waiting, and goes in once the backend works
+        backend.fail = false;
+        fct_xchk(journal.flush(), "flush failed");
+        fct_xchk(EEPROM.get(0, a) == 0x12345678, "Expected 0x12345678 got 0x%X", a);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test an aborted transaction
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(abort writes nothing) {
+        RAMEEPROMClass EEPROM(0u, 1024);
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH);
+        journal.begin();
+        journal.start();
+        journal.put(0, (uint32_t)0);
+        journal.abort();
+        fct_xchk(!journal.commit(), "Expected commit with nothing open to fail");
+        fct_xchk(EEPROM.read(0) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(0));
+        journal.start();
+        journal.put(1, (uint8_t)7);
+        journal.commit();
+        fct_xchk(EEPROM.read(0) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(0));
+        fct_xchk(EEPROM.read(1) == 7, "Expected 7 got %u", EEPROM.read(1));
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test writes that don't belong in a transaction
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(write rejects bad ranges) {
+        RAMEEPROMClass EEPROM(0u, 1024);
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH);
+        uint8_t big[JOURNAL_LENGTH];
+        memset(big, 0, sizeof(big));
+        journal.begin();
+        fct_xchk(!journal.put(0, (uint8_t)1), "Expected put outside a transaction to fail");
+        journal.start();
+        fct_xchk(!journal.put(JOURNAL_ADDRESS - 1, (uint16_t)1), "Expected a put into the journal to fail");
+        fct_xchk(!journal.put(1022, (uint32_t)1), "Expected a put off the end to fail");
+        fct_xchk(!journal.put(-1, (uint8_t)1), "Expected a negative address to fail");
+        fct_xchk(!journal.write(0, big, sizeof(big)), "Expected an oversize write to fail");
+        fct_xchk(journal.put(JOURNAL_ADDRESS - 2, (uint16_t)1), "Expected a put next to the journal to work");
+        fct_xchk(journal.commit(), "commit failed");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test whole blocks
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(writeBlock writes a whole block) {
+        RAMEEPROMClass EEPROM(0u, 1024, 16);
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH);
+        uint8_t block[16], back[16];
+        memset(block, 0x5A, sizeof(block));
+        journal.begin();
+        journal.start();
+        fct_xchk(journal.writeBlock(3, block), "writeBlock failed");
+        fct_xchk(!journal.writeBlock(64, block), "Expected block 64 to fail");
+        journal.commit();
+        EEPROM.readBlock(3, back);
+        fct_xchk(memcmp(block, back, sizeof(block)) == 0, "Block 3 doesn't match");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test group commit
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(group commit waits for a full group) {
+        RAMEEPROMClass EEPROM(0u, 1024);
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH, 3);
+        uint8_t i;
+        journal.begin();
+        for (i = 0; i < 2; i++) {
+            journal.start();
+            journal.put(i, i);
+            journal.commit();
+        }
+        fct_xchk(journal.waiting() == 2, "Expected 2 got %u", journal.waiting());
+        fct_xchk(EEPROM.read(0) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(0));
+        journal.start();
+        journal.put(2, (uint8_t)2);
+        journal.commit();
+        fct_xchk(journal.waiting() == 0, "Expected 0 got %u", journal.waiting());
+        for (i = 0; i < 3; i++) {
+            fct_xchk(EEPROM.read(i) == i, "Expected %u got %u", i, EEPROM.read(i));
+        }
+        journal.start();
+        journal.put(10, (uint8_t)10);
+        journal.commit();
+        journal.start();
+        journal.put(11, (uint8_t)11);
+        fct_xchk(journal.flush(), "flush failed");
+        fct_xchk(EEPROM.read(10) == 10, "Expected 10 got %u", EEPROM.read(10));
+        fct_xchk(EEPROM.read(11) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(11));
+        journal.commit();
+        journal.flush();
+        fct_xchk(EEPROM.read(11) == 11, "Expected 11 got %u", EEPROM.read(11));
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test a group too big for the journal
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(a full journal flushes early) {
+        RAMEEPROMClass EEPROM(0u, 1024);
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH, 100);
+        uint8_t data[100];
+        int i;
+        memset(data, 0x11, sizeof(data));
+        journal.begin();
+        for (i = 0; i < 4; i++) {
+            journal.start();
+            fct_xchk(journal.write(i * 100, data, sizeof(data)), "write %d failed", i);
+            fct_xchk(journal.commit(), "commit %d failed", i);
+        }
+        fct_xchk(journal.waiting() < 4, "Expected an early flush");
+        fct_xchk(EEPROM.read(0) == 0x11, "Expected 0x11 got 0x%X", EEPROM.read(0));
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test recovery after a crash
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(begin replays a journal a crash left behind) {
+        RAMEEPROMClass EEPROM(0u, 1024);
+        uint32_t value = 0;
+        {
+            CrashJournal journal(EEPROM);
+            journal.begin();
+            journal.start();
+            journal.put(0, (uint32_t)0xDEADBEEF);
+            journal.commit();
+            journal.start();
+            journal.put(200, (uint32_t)0x01020304);
+            journal.commit();
+            fct_xchk(journal.crash(), "crash failed");
+        }
+        fct_xchk(EEPROM.read(0) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(0));
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH);
+        fct_xchk(journal.begin(), "begin failed");
+        fct_xchk(journal.recovered() == 2, "Expected 2 got %u", journal.recovered());
+        EEPROM.get(0, value);
+        fct_xchk(value == 0xDEADBEEF, "Expected 0xDEADBEEF got 0x%X", value);
+        EEPROM.get(200, value);
+        fct_xchk(value == 0x01020304, "Expected 0x01020304 got 0x%X", value);
+        journal.begin();
+        fct_xchk(journal.recovered() == 0, "Expected 0 got %u", journal.recovered());
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test recovery of a torn journal
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(begin skips a torn transaction) {
+        RAMEEPROMClass EEPROM(0u, 1024);
+        uint32_t value = 0;
+        {
+            CrashJournal journal(EEPROM);
+            journal.begin();
+            journal.start();
+            journal.put(0, (uint32_t)0xDEADBEEF);
+            journal.commit();
+            journal.start();
+            journal.put(200, (uint32_t)0x01020304);
+            journal.put(300, (uint32_t)0x05060708);
+            journal.commit();
+            journal.crash();
+        }
+        // The second transaction starts after the first one's 16 + 16 bytes
+        EEPROM.write(JOURNAL_ADDRESS + 8 + 32 + 12, 0);
+        RAMEEPROMJournal journal(EEPROM, JOURNAL_ADDRESS, JOURNAL_LENGTH);
+        fct_xchk(journal.begin(), "begin failed");
+        fct_xchk(journal.recovered() == 1, "Expected 1 got %u", journal.recovered());
+        EEPROM.get(0, value);
+        fct_xchk(value == 0xDEADBEEF, "Expected 0xDEADBEEF got 0x%X", value);
+        fct_xchk(EEPROM.read(200) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(200));
+        fct_xchk(EEPROM.read(300) == 0xFF, "Expected 0xFF got 0x%X", EEPROM.read(300));
+    }
+    FCT_TEST_END()
+
+}
+FCTMF_FIXTURE_SUITE_END();
@@ -0,0 +1,232 @@
+/**
+ * @file       test/test_ram_eeprom_kv.cpp
+ * @author     Scott L. Price <prices@hugllc.com>
+ * @copyright  © 2016 Hunt Utilities Group, LLC
+ * @brief   The test file for RAM_EEPROM_KV.cpp
+ * @details
+ *
+ *
+ */
+/*
+ *
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "main.h"
+#include "RAM_EEPROM_KV.h"
+
+FCTMF_FIXTURE_SUITE_BGN(test_ram_eeprom_kv)
+{
+    /**
+    * @brief This sets up this suite
+    *
+    * @return void
+    */
+    FCT_SETUP_BGN() {
+        TestInit();
+    }
+    FCT_SETUP_END();
+    /**
+    * @brief This tears down this suite
+    *
+    * @return void
+    */
+    FCT_TEARDOWN_BGN() {
+    } FCT_TEARDOWN_END()
+    /**
+     * @brief Test put, get and remove
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(put get and remove) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        RAMEEPROMClass noBlocks(0u, 4096);
+        RAMEEPROMKV kv(EEPROM);
+        RAMEEPROMKV none(noBlocks);
+        RAMEEPROMKV tiny(EEPROM, 0, 4, 4);
+        char big[300];
+        uint32_t value = 0;
+        uint8_t part;
+        fct_xchk(kv.begin(), "begin failed");
+        fct_xchk(!none.begin(), "Expected false without a block size");
+        fct_xchk(!tiny.begin(), "Expected false with one segment");
+        fct_xchk(kv.put("volume", (uint32_t)0x12345678), "put failed");
+        fct_xchk(kv.get("volume", value), "get failed");
+        fct_xchk(value == 0x12345678, "Expected 0x12345678 got 0x%X", value);
+        fct_xchk(kv.get("volume", &part, 1) == 4, "Expected the whole length");
+        fct_xchk(part == 0x78, "Expected 0x78 got 0x%X", part);
+        fct_xchk(kv.contains("volume"), "Expected true got false");
+        fct_xchk(!kv.contains("vol"), "Expected false got true");
+        fct_xchk(kv.count() == 1, "Expected 1 got %u", (unsigned)kv.count());
+        fct_xchk(kv.put("empty", NULL, 0), "put failed");
+        fct_xchk(kv.get("empty", NULL, 0) == 0, "Expected 0 long");
+        fct_xchk(kv.remove("volume"), "remove failed");
+        fct_xchk(!kv.remove("volume"), "Expected false removing it twice");
+        fct_xchk(!kv.get("volume", value), "Expected false got true");
+        fct_xchk(kv.count() == 1, "Expected 1 got %u", (unsigned)kv.count());
+        memset(big, 'k', sizeof(big));
+        big[255] = 0;
+        fct_xchk(!kv.put(big, value), "Expected false with a 255 byte key");
+        fct_xchk(!kv.put("", value), "Expected false with no key");
+        fct_xchk(!kv.put("big", big, kv.maxValue(3) + 1), "Expected false with a value too big");
+        fct_xchk(kv.put("big", big, kv.maxValue(3)), "put failed");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test replaying the log
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(begin replays the log) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        char name[8];
+        uint16_t value = 0;
+        int i;
+        {
+            RAMEEPROMKV kv(EEPROM);
+            kv.begin();
+            for (i = 0; i < 20; i++) {
+                snprintf(name, sizeof(name), "key%d", i);
+                kv.put(name, (uint16_t)i);
+            }
+            kv.put("key3", (uint16_t)300);
+            kv.remove("key4");
+        }
+        RAMEEPROMKV kv(EEPROM);
+        fct_xchk(kv.begin(), "begin failed");
+        fct_xchk(kv.count() == 19, "Expected 19 got %u", (unsigned)kv.count());
+        fct_xchk(kv.get("key3", value) && (value == 300), "Expected 300 got %u", value);
+        fct_xchk(kv.get("key19", value) && (value == 19), "Expected 19 got %u", value);
+        fct_xchk(!kv.contains("key4"), "Expected key4 to stay removed");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test compaction
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(updates are compacted) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        RAMEEPROMKV kv(EEPROM);
+        RAMEEPROMKVStats stats;
+        char name[8];
+        uint32_t value = 0;
+        int i, j;
+        kv.begin();
+        kv.put("gone", (uint32_t)1);
+        kv.remove("gone");
+        for (i = 0; i < 1000; i++) {
+            for (j = 0; j < 10; j++) {
+                snprintf(name, sizeof(name), "k%d", j);
+                fct_req(kv.put(name, (uint32_t)(i * 10 + j)));
+            }
+        }
+        kv.kvStats(stats);
+        fct_xchk(stats.compactions > 0, "Expected compactions");
+        // 10 records of 8 + 2 + 4 bytes.  The tombstone for gone went when
+        // its segment was the oldest.
+        fct_xchk(stats.liveBytes == 140, "Expected 140 got %u", stats.liveBytes);
+        fct_xchk(stats.userBytes == 60012, "Expected 60012 got %u", (unsigned)stats.userBytes);
+        fct_xchk(stats.writtenBytes >= stats.logBytes, "Expected every byte logged to be written");
+        RAMEEPROMKV again(EEPROM);
+        fct_xchk(again.begin(), "begin failed");
+        fct_xchk(again.count() == 10, "Expected 10 got %u", (unsigned)again.count());
+        for (j = 0; j < 10; j++) {
+            snprintf(name, sizeof(name), "k%d", j);
+            fct_xchk(again.get(name, value) && (value == (uint32_t)(9990 + j)), "%s: Expected %d got %u", name, 9990 + j, value);
+        }
+        fct_xchk(!again.contains("gone"), "Expected gone to stay removed");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test idle compaction
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(compact frees garbage segments) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        RAMEEPROMKV kv(EEPROM);
+        RAMEEPROMKVStats before, after;
+        uint32_t value = 0;
+        int i;
+        kv.begin();
+        for (i = 0; i < 100; i++) {
+            kv.put("counter", (uint32_t)i);
+        }
+        kv.kvStats(before);
+        fct_xchk(kv.compact(5), "compact failed");
+        kv.kvStats(after);
+        fct_xchk(after.freeSegments == before.freeSegments + 5, "Expected %u got %u", before.freeSegments + 5, after.freeSegments);
+        fct_xchk(after.compactions == 5, "Expected 5 got %u", after.compactions);
+        fct_xchk(kv.get("counter", value) && (value == 99), "Expected 99 got %u", value);
+        // Only the tail is left, and it isn't compacted
+        fct_xchk(!kv.compact(100), "Expected to run out");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test a torn record
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(a torn record is thrown away) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        uint32_t value = 0;
+        {
+            RAMEEPROMKV kv(EEPROM);
+            kv.begin();
+            kv.put("x", (uint32_t)1);
+            kv.put("x", (uint32_t)2);
+        }
+        // Records of 13 bytes after the 8 byte header, so the second value
+        // ends at byte 33
+        EEPROM.write(33, 0x55);
+        {
+            RAMEEPROMKV kv(EEPROM);
+            fct_xchk(kv.begin(), "begin failed");
+            fct_xchk(kv.get("x", value) && (value == 1), "Expected 1 got %u", value);
+            kv.put("x", (uint32_t)3);
+        }
+        RAMEEPROMKV kv(EEPROM);
+        fct_xchk(kv.begin(), "begin failed");
+        fct_xchk(kv.get("x", value) && (value == 3), "Expected 3 got %u", value);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test that a put only writes its record
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(put writes only the new record) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        RAMEEPROMKV kv(EEPROM);
+        RAMEEPROMKVStats before, after;
+        uint32_t value = 0;
+        kv.begin();
+        kv.put("x", (uint32_t)1);
+        kv.kvStats(before);
+#if RAM_EEPROM_STATS
+        RAMEEPROMStats counts;
+        EEPROM.stats(counts);
+        uint32_t blockWrites = counts.blockWrites;
+#endif
+        // 13 bytes at 21, in the block the first record is in
+        fct_xchk(kv.put("y", (uint32_t)2), "put failed");
+        kv.kvStats(after);
+        fct_xchk(after.writtenBytes - before.writtenBytes == 13, "Expected 13 got %u", (unsigned)(after.writtenBytes - before.writtenBytes));
+#if RAM_EEPROM_STATS
+        EEPROM.stats(counts);
+        fct_xchk(counts.blockWrites == blockWrites, "Expected the block not to be rewritten");
+#endif
+        // Tearing the new record leaves the first one alone
+        EEPROM.write(30, 0x55);
+        RAMEEPROMKV again(EEPROM);
+        fct_xchk(again.begin(), "begin failed");
+        fct_xchk(again.get("x", value) && (value == 1), "Expected 1 got %u", value);
+        fct_xchk(!again.contains("y"), "Expected y to be thrown away");
+    }
+    FCT_TEST_END()
+
+}
+FCTMF_FIXTURE_SUITE_END();
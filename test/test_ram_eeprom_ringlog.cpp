@@ -0,0 +1,250 @@
+/**
+ * @file       test/test_ram_eeprom_ringlog.cpp
+ * @author     Scott L. Price <prices@hugllc.com>
+ * @copyright  © 2016 Hunt Utilities Group, LLC
+ * @brief   The test file for RAM_EEPROM_RingLog.cpp
+ * @details
+ *
+ *
+ */
+/*
+ *
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "main.h"
+#include "RAM_EEPROM_RingLog.h"
+
+FCTMF_FIXTURE_SUITE_BGN(test_ram_eeprom_ringlog)
+{
+    /**
+    * @brief This sets up this suite
+    *
+    * @return void
+    */
+    FCT_SETUP_BGN() {
+        TestInit();
+    }
+    FCT_SETUP_END();
+    /**
+    * @brief This tears down this suite
+    *
+    * @return void
+    */
+    FCT_TEARDOWN_BGN() {
+    } FCT_TEARDOWN_END()
+    /**
+     * @brief Test appending round the ring
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(append wraps round the ring) {
+        RAMEEPROMClass EEPROM(0u, 128 * 36, 36);
+        RAMEEPROMClass noBlocks(0u, 4096);
+        RAMEEPROMRingLog ring(EEPROM, 8, 16);
+        RAMEEPROMRingLog none(noBlocks, 0, 16);
+        RAMEEPROMRingLog outside(EEPROM, 120, 16);
+        uint32_t i, value = 0, expect;
+        uint8_t big[32];
+        int count = 0;
+        fct_xchk(ring.begin(), "begin failed");
+        fct_xchk(!none.begin(), "Expected false without a block size");
+        fct_xchk(!outside.begin(), "Expected false past the end");
+        fct_xchk(ring.last(&value, sizeof(value)) == -1, "Expected an empty log");
+        fct_xchk(ring.next(&value, sizeof(value)) == -1, "Expected an empty log");
+        fct_xchk(!ring.append(big, ring.maxRecord() + 1), "Expected false with a record too big");
+        fct_xchk(!ring.append(big, 0), "Expected false with an empty record");
+        // 4 records of 7 bytes to a block, so 25 blocks
+        for (i = 0; i < 100; i++) {
+            fct_req(ring.append(&i, sizeof(i)));
+        }
+        fct_xchk(ring.sequence() == 25, "Expected 25 got %u", ring.sequence());
+        fct_xchk(ring.last(&value, sizeof(value)) == 4, "Expected 4 long");
+        fct_xchk(value == 99, "Expected 99 got %u", value);
+        // The last 16 blocks are left, 36 to 99
+        ring.rewind();
+        for (expect = 36; ring.next(&value, sizeof(value)) == 4; expect++) {
+            fct_xchk(value == expect, "Expected %u got %u", expect, value);
+            count++;
+        }
+        fct_xchk(count == 64, "Expected 64 got %d", count);
+        // Nothing outside the range was touched
+        fct_xchk(EEPROM.read(8 * 36 - 1) == 0xFF, "Expected 0xFF before the ring");
+        fct_xchk(EEPROM.read(24 * 36) == 0xFF, "Expected 0xFF after the ring");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test finding the head
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(begin finds the newest block) {
+        RAMEEPROMClass EEPROM(0u, 128 * 36, 36);
+        uint32_t i, value = 0;
+        {
+            RAMEEPROMRingLog ring(EEPROM, 0, 128);
+            ring.begin();
+            for (i = 0; i < 1000; i++) {
+                ring.append(&i, sizeof(i));
+            }
+        }
+        RAMEEPROMRingLog ring(EEPROM, 0, 128);
+        fct_xchk(ring.begin(), "begin failed");
+        fct_xchk(ring.sequence() == 250, "Expected 250 got %u", ring.sequence());
+        // Block 0, 7 steps of binary search and the head
+        fct_xchk(ring.probes() == 9, "Expected 9 got %u", (unsigned)ring.probes());
+        ring.last(&value, sizeof(value));
+        fct_xchk(value == 999, "Expected 999 got %u", value);
+        i = 1000;
+        ring.append(&i, sizeof(i));
+        fct_xchk(ring.sequence() == 251, "Expected 251 got %u", ring.sequence());
+        ring.rewind();
+        ring.next(&value, sizeof(value));
+        // 128 blocks back from 251 is 124, which starts with 492
+        fct_xchk(value == 492, "Expected 492 got %u", value);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test grouped appends
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(grouped appends wait for flush) {
+        RAMEEPROMClass EEPROM(0u, 128 * 36, 36);
+        RAMEEPROMRingLog ring(EEPROM, 0, 16, 4);
+        uint32_t i, value = 0;
+        ring.begin();
+        for (i = 0; i < 3; i++) {
+            ring.append(&i, sizeof(i));
+        }
+        fct_xchk(ring.waiting() == 3, "Expected 3 got %u", ring.waiting());
+        fct_xchk(EEPROM.read(0) == 0xFF, "Expected nothing written");
+        // They can be read before they are written
+        ring.rewind();
+        fct_xchk(ring.next(&value, sizeof(value)) == 4, "Expected 4 long");
+        fct_xchk(ring.flush(), "flush failed");
+        fct_xchk(ring.waiting() == 0, "Expected 0 got %u", ring.waiting());
+        RAMEEPROMRingLog again(EEPROM, 0, 16, 4);
+        again.begin();
+        again.last(&value, sizeof(value));
+        fct_xchk(value == 2, "Expected 2 got %u", value);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test torn blocks
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(a torn block ends the log) {
+        RAMEEPROMClass EEPROM(0u, 128 * 36, 36);
+        uint32_t i, value = 0;
+        {
+            RAMEEPROMRingLog ring(EEPROM, 0, 16);
+            ring.begin();
+            for (i = 0; i < 30; i++) {
+                ring.append(&i, sizeof(i));
+            }
+        }
+        // 30 records is 8 blocks, and the last one is block 7
+        EEPROM.write(7 * 36 + 1, 0x55);
+        {
+            RAMEEPROMRingLog ring(EEPROM, 0, 16);
+            ring.begin();
+            fct_xchk(ring.sequence() == 7, "Expected 7 got %u", ring.sequence());
+            ring.last(&value, sizeof(value));
+            fct_xchk(value == 27, "Expected 27 got %u", value);
+            // Go round to block 0 again, and tear it
+            for (i = 0; i < 4 * 9 + 1; i++) {
+                ring.append(&i, sizeof(i));
+            }
+            fct_xchk(ring.sequence() == 17, "Expected 17 got %u", ring.sequence());
+        }
+        EEPROM.write(1, 0x55);
+        RAMEEPROMRingLog ring(EEPROM, 0, 16);
+        ring.begin();
+        fct_xchk(ring.sequence() == 16, "Expected 16 got %u", ring.sequence());
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test torn appends
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(a torn append only loses that record) {
+        RAMEEPROMClass EEPROM(0u, 128 * 36, 36);
+        uint32_t i, value = 0;
+        int count = 0;
+        {
+            RAMEEPROMRingLog ring(EEPROM, 0, 16);
+            ring.begin();
+            for (i = 0; i < 7; i++) {
+                ring.append(&i, sizeof(i));
+            }
+        }
+        // Block 1 has 4 and 5 and 6.  Tear 6, which is at 8 + 2 * 7.
+        EEPROM.write(36 + 22 + 4, 0x55);
+        {
+            RAMEEPROMRingLog ring(EEPROM, 0, 16);
+            ring.begin();
+            fct_xchk(ring.sequence() == 2, "Expected 2 got %u", ring.sequence());
+            fct_xchk(ring.last(&value, sizeof(value)) == 4, "Expected 4 long");
+            fct_xchk(value == 5, "Expected 5 got %u", value);
+            ring.rewind();
+            while (ring.next(&value, sizeof(value)) == 4) {
+                fct_xchk(value == (uint32_t)count, "Expected %d got %u", count, value);
+                count++;
+            }
+            fct_xchk(count == 6, "Expected 6 got %d", count);
+            // It goes where the torn one was
+            i = 100;
+            fct_xchk(ring.append(&i, sizeof(i)), "append failed");
+        }
+        // Tear the first record in block 1, so last() has to go back
+        EEPROM.write(36 + 12, 0x55);
+        RAMEEPROMRingLog ring(EEPROM, 0, 16);
+        ring.begin();
+        fct_xchk(ring.sequence() == 2, "Expected 2 got %u", ring.sequence());
+        fct_xchk(ring.last(&value, sizeof(value)) == 4, "Expected 4 long");
+        fct_xchk(value == 3, "Expected 3 got %u", value);
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test a ring of one block
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(a log of one block) {
+        RAMEEPROMClass EEPROM(0u, 128 * 36, 36);
+        uint32_t i, value = 0;
+        {
+            RAMEEPROMRingLog ring(EEPROM, 4, 1);
+            ring.begin();
+            for (i = 0; i < 6; i++) {
+                ring.append(&i, sizeof(i));
+            }
+        }
+        {
+            RAMEEPROMRingLog ring(EEPROM, 4, 1);
+            fct_xchk(ring.begin(), "begin failed");
+            fct_xchk(ring.sequence() == 2, "Expected 2 got %u", ring.sequence());
+            ring.rewind();
+            fct_xchk(ring.next(&value, sizeof(value)) == 4, "Expected 4 long");
+            fct_xchk(value == 4, "Expected 4 got %u", value);
+        }
+        // Torn, so there is nothing left
+        EEPROM.write(4 * 36 + 1, 0x55);
+        RAMEEPROMRingLog ring(EEPROM, 4, 1);
+        fct_xchk(ring.begin(), "begin failed");
+        fct_xchk(ring.sequence() == 0, "Expected 0 got %u", ring.sequence());
+        fct_xchk(ring.next(&value, sizeof(value)) == -1, "Expected an empty log");
+        fct_xchk(ring.last(&value, sizeof(value)) == -1, "Expected an empty log");
+        fct_xchk(ring.append(&i, sizeof(i)), "append failed");
+        fct_xchk(ring.sequence() == 1, "Expected 1 got %u", ring.sequence());
+        fct_xchk(EEPROM.read(5 * 36) == 0xFF, "Expected 0xFF after the ring");
+    }
+    FCT_TEST_END()
+
+}
+FCTMF_FIXTURE_SUITE_END();
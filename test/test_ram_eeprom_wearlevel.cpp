@@ -0,0 +1,172 @@
+/**
+ * @file       test/test_ram_eeprom_wearlevel.cpp
+ * @author     Scott L. Price <prices@hugllc.com>
+ * @copyright  © 2016 Hunt Utilities Group, LLC
+ * @brief   The test file for RAM_EEPROM_WearLevel.cpp
+ * @details
+ *
+ *
+ */
+/*
+ *
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include "main.h"
+#include "RAM_EEPROM_WearLevel.h"
+
+FCTMF_FIXTURE_SUITE_BGN(test_ram_eeprom_wearlevel)
+{
+    /**
+    * @brief This sets up this suite
+    *
+    * @return void
+    */
+    FCT_SETUP_BGN() {
+        TestInit();
+    }
+    FCT_SETUP_END();
+    /**
+    * @brief This tears down this suite
+    *
+    * @return void
+    */
+    FCT_TEARDOWN_BGN() {
+    } FCT_TEARDOWN_END()
+    /**
+     * @brief Test the geometry
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(begin sets up the map) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        RAMEEPROMClass noBlocks(0u, 4096);
+        RAMEEPROMWearLevel blocks(EEPROM, 8);
+        RAMEEPROMWearLevel none(noBlocks, 8);
+        RAMEEPROMWearLevel greedy(EEPROM, 128);
+        fct_xchk(blocks.begin(), "begin failed");
+        // 128 blocks, less 2 slots of 21 blocks for 16 + 4 * (86 + 78) bytes
+        fct_xchk(blocks.blocks() == 78, "Expected 78 got %u", (unsigned)blocks.blocks());
+        fct_xchk(blocks.physical(5) == 5, "Expected 5 got %d", blocks.physical(5));
+        fct_xchk(blocks.physical(78) == -1, "Expected -1 got %d", blocks.physical(78));
+        fct_xchk(!none.begin(), "Expected false without a block size");
+        fct_xchk(!greedy.begin(), "Expected false with no room for blocks");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test that writes move
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(writeBlock moves the block) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        RAMEEPROMWearLevel blocks(EEPROM, 8);
+        uint8_t data[32], back[32];
+        blocks.begin();
+        memset(data, 0x42, sizeof(data));
+        fct_xchk(blocks.writeBlock(3, data), "writeBlock failed");
+        fct_xchk(blocks.physical(3) != 3, "Expected block 3 to move");
+        fct_xchk(blocks.readBlock(3, back), "readBlock failed");
+        fct_xchk(memcmp(data, back, sizeof(data)) == 0, "Block 3 doesn't match");
+        fct_xchk(blocks.copyBlock(4, 3), "copyBlock failed");
+        blocks.readBlock(4, back);
+        fct_xchk(memcmp(data, back, sizeof(data)) == 0, "Block 4 doesn't match");
+        fct_xchk(blocks.physical(4) != blocks.physical(3), "Expected separate blocks");
+        fct_xchk(!blocks.writeBlock(-1, data), "Expected false got true");
+        fct_xchk(!blocks.readBlock(78, back), "Expected false got true");
+        fct_xchk(!blocks.copyBlock(0, 78), "Expected false got true");
+    }
+    FCT_TEST_END()
+    /**
+     * @brief Test the wear spread
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(hammering one block spreads the wear) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        RAMEEPROMWearLevel blocks(EEPROM, 8);
+        RAMEEPROMWearStats stats;
+        uint8_t data[32];
+        uint32_t i;
+        blocks.begin();
+        for (i = 0; i < 900; i++) {
+            memset(data, i, sizeof(data));
+            blocks.writeBlock(0, data);
+        }
+        blocks.wearStats(stats);
+        fct_xchk(stats.remaps == 900, "Expected 900 got %u", stats.remaps);
+        // Block 0 and the 8 spares share the writes
+        fct_xchk(stats.maxWear == 100, "Expected 100 got %u", stats.maxWear);
+        fct_xchk(stats.minWear == 0, "Expected 0 got %u", stats.minWear);
+        // 900 over 86 physical blocks
+        fct_xchk(stats.meanWear == 10, "Expected 10 got %u", stats.meanWear);
+        // The first commit, then one every 8 writes, and slot 1 has the
+        // odd ones of those 113
+        fct_xchk(stats.mapWear == 57, "Expected 57 got %u", stats.mapWear);
+    }
+    FCT_TEST_END()
+#if RAM_EEPROM_STATS
+    /**
+     * @brief Test that commit() skips the map blocks that didn't change
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(commit writes only the changed map blocks) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        RAMEEPROMWearLevel blocks(EEPROM, 8);
+        RAMEEPROMStats before, after;
+        uint8_t data[32];
+        blocks.begin();
+        memset(data, 1, sizeof(data));
+        blocks.writeBlock(0, data);
+        fct_xchk(blocks.commit(), "commit failed");
+        EEPROM.stats(before);
+        blocks.writeBlock(0, data);
+        fct_xchk(blocks.commit(), "commit failed");
+        EEPROM.stats(after);
+        // The data, then the first block of slot 1 with the map entry and
+        // the block with the wear of the spares, not all 21
+        fct_xchk(after.bytesWritten - before.bytesWritten == 3 * 32, "Expected 96 got %u", (unsigned)(after.bytesWritten - before.bytesWritten));
+    }
+    FCT_TEST_END()
+#endif
+    /**
+     * @brief Test reloading the map
+     *
+     * @return void
+     */
+    FCT_TEST_BGN(begin reloads the committed map) {
+        RAMEEPROMClass EEPROM(0u, 4096, 32);
+        uint8_t data[32], back[32];
+        int moved;
+        {
+            RAMEEPROMWearLevel blocks(EEPROM, 8);
+            blocks.begin();
+            memset(data, 1, sizeof(data));
+            blocks.writeBlock(7, data);
+            blocks.commit();
+            moved = blocks.physical(7);
+            memset(data, 2, sizeof(data));
+            // Not committed, so lost
+            blocks.writeBlock(7, data);
+        }
+        RAMEEPROMWearLevel blocks(EEPROM, 8);
+        fct_xchk(blocks.begin(), "begin failed");
+        fct_xchk(blocks.physical(7) == moved, "Expected %d got %d", moved, blocks.physical(7));
+        blocks.readBlock(7, back);
+        fct_xchk(back[0] == 1, "Expected 1 got %u", back[0]);
+        // Tear the newer slot, and the older one is used
+        blocks.writeBlock(7, data);
+        blocks.commit();
+        // The third map went to slot 1, at block 86 + 21
+        EEPROM.write(107 * 32 + 20, EEPROM.read(107 * 32 + 20) ^ 1);
+        RAMEEPROMWearLevel again(EEPROM, 8);
+        fct_xchk(again.begin(), "begin failed");
+        fct_xchk(again.physical(7) == moved, "Expected %d got %d", moved, again.physical(7));
+    }
+    FCT_TEST_END()
+
+}
+FCTMF_FIXTURE_SUITE_END();